@@ -0,0 +1,120 @@
+#include <sched.h>
+#include <time.h>
+#include "ring.h"
+
+/*
+ * Device state
+ *
+ * The fields live in the ring on cache lines of their own and are only
+ * touched with the __atomic builtins. A writer makes the sequence odd,
+ * stores, and makes it even again; `snapshot` copies the fields and
+ * retries if the sequence moved meanwhile. The fields are stored with
+ * release and loaded with acquire, which orders them against the
+ * sequence without fences (plain moves on x86, and TSan understands
+ * it). Writers are rare (a press, a battery step) and serialize on the
+ * sequence itself. The red LED toggles on every blink edge: it has a
+ * line of its own and does not bump the sequence, so blinking never
+ * makes a reader retry.
+ */
+/* yields before a waiter sleeps on a sequence held odd */
+#define DEVICE_SPINS 64
+
+static int *device_slot(ring_p ring, enum device_field field)
+{
+    return field == DEVICE_RED_LED ? &ring->red_led_gpio
+                                   : ring->device.value + field;
+}
+
+/*
+ * The writer may be preempted with the sequence odd, do not spin against
+ * it. A SCHED_FIFO waiter would only yield to its own priority and
+ * starve a writer below it, so it ends up sleeping.
+ */
+static void device_pause(int *spins)
+{
+    struct timespec pause = { .tv_nsec = 50000 };
+
+    if (++*spins < DEVICE_SPINS)
+        sched_yield();
+    else
+        nanosleep(&pause, NULL);
+}
+
+/* take the sequence odd, return the odd value */
+static unsigned device_lock(ring_p ring)
+{
+    int spins = 0;
+
+    for (;;) {
+        unsigned seq = __atomic_load_n(&ring->device.seq, __ATOMIC_RELAXED);
+        if (!(seq & 1) &&
+            __atomic_compare_exchange_n(&ring->device.seq, &seq, seq + 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return seq + 1;
+        device_pause(&spins);
+    }
+}
+
+static void device_unlock(ring_p ring, unsigned seq)
+{
+    __atomic_store_n(&ring->device.seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+static int device_get(ring_p ring, enum device_field field)
+{
+    return __atomic_load_n(device_slot(ring, field), __ATOMIC_ACQUIRE);
+}
+
+static int device_set(ring_p ring, enum device_field field, int value)
+{
+    int *slot = device_slot(ring, field);
+    unsigned seq;
+    int old;
+
+    if (field == DEVICE_RED_LED)
+        return __atomic_exchange_n(slot, value, __ATOMIC_ACQ_REL);
+    seq = device_lock(ring);
+    old = __atomic_load_n(slot, __ATOMIC_RELAXED);
+    __atomic_store_n(slot, value, __ATOMIC_RELEASE);
+    device_unlock(ring, seq);
+    return old;
+}
+
+static int device_add(ring_p ring, enum device_field field, int delta)
+{
+    int *slot = device_slot(ring, field);
+    unsigned seq;
+    int value;
+
+    if (field == DEVICE_RED_LED)
+        return __atomic_add_fetch(slot, delta, __ATOMIC_ACQ_REL);
+    seq = device_lock(ring);
+    value = __atomic_load_n(slot, __ATOMIC_RELAXED) + delta;
+    __atomic_store_n(slot, value, __ATOMIC_RELEASE);
+    device_unlock(ring, seq);
+    return value;
+}
+
+static void device_snapshot(ring_p ring, struct device_state *state)
+{
+    unsigned begin, end;
+    int spins = 0;
+
+    do {
+        while ((begin = __atomic_load_n(&ring->device.seq,
+                                        __ATOMIC_ACQUIRE)) & 1)
+            device_pause(&spins);
+        for (int i = 0; i < DEVICE_FIELDS; i++)
+            state->value[i] = __atomic_load_n(device_slot(ring, i),
+                                              __ATOMIC_ACQUIRE);
+        end = __atomic_load_n(&ring->device.seq, __ATOMIC_RELAXED);
+    } while (begin != end);
+}
+
+/* Device API gateway */
+const struct __DEVICE_API__ Device = {
+    .get = device_get,
+    .set = device_set,
+    .add = device_add,
+    .snapshot = device_snapshot,
+};
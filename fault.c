@@ -0,0 +1,318 @@
+#include <sys/timerfd.h>
+#include <time.h>
+#include "ring.h"
+
+/*
+ * Fault injection
+ *
+ * Decides per reply whether it is dropped, corrupted, duplicated, delayed
+ * or reordered, from the reply's index in its peer's stream (schedules)
+ * and a per injector xorshift generator (probabilities). Held replies
+ * are copied into a fixed set of slots and kept in a binary min-heap on
+ * their due time; a timerfd armed for the head wakes the owner's event
+ * loop, which sends the due ones with `dispatch`. Nothing ever sleeps,
+ * so a delayed peer does not stall the others. An injector belongs to
+ * one thread (a server worker).
+ */
+#define FAULT_DELAY_MS 600
+#define FAULT_REORDER_MS 10
+#define FAULT_QUEUE 1024
+
+struct held {
+    struct sockaddr_storage addr;
+    uint64_t due_ns;
+    uint32_t seq; /* keeps the replies due at once in FIFO order */
+    uint32_t len;
+    char data[BUF_SIZE];
+};
+
+struct faults {
+    struct fault_plan plan;
+    uint64_t rng;
+    uint32_t seq;
+    int tfd;
+    uint64_t armed_ns; /* due time the timerfd is armed for, 0 if none */
+    int count, free_count;
+    struct held **heap; /* `count` held replies, earliest first */
+    struct held **free; /* `free_count` unused slots */
+    struct held *slots;
+};
+
+static const char *const fault_names[FAULT_KINDS] = {
+    [FAULT_DROP] = "drop",
+    [FAULT_DELAY] = "delay",
+    [FAULT_REORDER] = "reorder",
+    [FAULT_DUPLICATE] = "dup",
+    [FAULT_CORRUPT] = "corrupt",
+};
+
+static const enum stat_id fault_stats[FAULT_KINDS] = {
+    [FAULT_DROP] = STAT_FAULTS_DROPPED,
+    [FAULT_DELAY] = STAT_FAULTS_DELAYED,
+    [FAULT_REORDER] = STAT_FAULTS_REORDERED,
+    [FAULT_DUPLICATE] = STAT_FAULTS_DUPLICATED,
+    [FAULT_CORRUPT] = STAT_FAULTS_CORRUPTED,
+};
+
+static uint64_t fault_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Parse a preset or a comma separated list of `kind=probability`,
+ * `kind=every:at`, `delay_ms=`, `reorder_ms=`, `queue=` and `seed=`.
+ * The "classic" preset delays the reply 3 and corrupts the reply 6 of
+ * every 20, the behavior the echo server always had.
+ */
+static int faults_plan(struct fault_plan *plan, const char *spec)
+{
+    char buf[256], *item, *save;
+
+    memset(plan, 0, sizeof(*plan));
+    plan->delay_ms = FAULT_DELAY_MS;
+    plan->reorder_ms = FAULT_REORDER_MS;
+    plan->queue = FAULT_QUEUE;
+    if (!spec || !strcmp(spec, "none")) return 0;
+    if (!strcmp(spec, "classic")) {
+        plan->rule[FAULT_DELAY] = (struct fault_rule) {.every = 20, .at = 3};
+        plan->rule[FAULT_CORRUPT] = (struct fault_rule) {.every = 20, .at = 6};
+        return 0;
+    }
+    if (strlen(spec) >= sizeof(buf)) return -1;
+    strcpy(buf, spec);
+    for (item = strtok_r(buf, ",", &save); item;
+         item = strtok_r(NULL, ",", &save)) {
+        char *value = strchr(item, '=');
+        int kind;
+
+        if (!value) return -1;
+        *value++ = 0;
+        if (!strcmp(item, "delay_ms")) {
+            plan->delay_ms = atoi(value);
+            continue;
+        }
+        if (!strcmp(item, "reorder_ms")) {
+            plan->reorder_ms = atoi(value);
+            continue;
+        }
+        if (!strcmp(item, "queue")) {
+            plan->queue = atoi(value);
+            continue;
+        }
+        if (!strcmp(item, "seed")) {
+            plan->seed = strtoull(value, NULL, 0);
+            continue;
+        }
+        for (kind = 0; kind < FAULT_KINDS; kind++)
+            if (!strcmp(item, fault_names[kind])) break;
+        if (kind == FAULT_KINDS) return -1;
+        if (strchr(value, ':')) {
+            if (sscanf(value, "%d:%d", &plan->rule[kind].every,
+                       &plan->rule[kind].at) != 2 ||
+                plan->rule[kind].every <= 0)
+                return -1;
+        } else {
+            plan->rule[kind].probability = atof(value);
+        }
+    }
+    return 0;
+}
+
+static faults_p faults_create(const struct fault_plan *plan)
+{
+    struct faults *f = calloc(1, sizeof(*f));
+    int queue = plan->queue > 0 ? plan->queue : FAULT_QUEUE;
+
+    if (!f) return NULL;
+    f->plan = *plan;
+    f->plan.queue = queue;
+    if (f->plan.reorder_ms <= 0) f->plan.reorder_ms = 1;
+    f->rng = plan->seed ? plan->seed : fault_now() ^ (uintptr_t)f;
+    f->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    f->heap = calloc(queue, sizeof(*f->heap));
+    f->free = calloc(queue, sizeof(*f->free));
+    /* the slots are only backed by memory once a reply is held in them */
+    f->slots = calloc(queue, sizeof(*f->slots));
+    if (f->tfd < 0 || !f->heap || !f->free || !f->slots) {
+        perror("fault injector");
+        if (f->tfd >= 0) close(f->tfd);
+        free(f->heap);
+        free(f->free);
+        free(f->slots);
+        free(f);
+        return NULL;
+    }
+    for (int i = queue - 1; i >= 0; i--) f->free[f->free_count++] = f->slots + i;
+    return f;
+}
+
+static void faults_destroy(faults_p f)
+{
+    if (!f) return;
+    close(f->tfd);
+    free(f->heap);
+    free(f->free);
+    free(f->slots);
+    free(f);
+}
+
+static uint64_t fault_random(faults_p f)
+{
+    f->rng ^= f->rng >> 12;
+    f->rng ^= f->rng << 25;
+    f->rng ^= f->rng >> 27;
+    return f->rng * 0x2545f4914f6cdd1dULL;
+}
+
+static int fault_hits(faults_p f, int kind, uint32_t n)
+{
+    const struct fault_rule *r = f->plan.rule + kind;
+
+    if (r->every && n % r->every == (uint32_t)r->at) return 1;
+    return r->probability > 0 &&
+           (fault_random(f) >> 11) * 0x1.0p-53 < r->probability;
+}
+
+static int held_before(const struct held *a, const struct held *b)
+{
+    return a->due_ns < b->due_ns ||
+           (a->due_ns == b->due_ns && (int32_t)(a->seq - b->seq) < 0);
+}
+
+/* arm the timerfd for the earliest held reply, if it changed */
+static void fault_arm(faults_p f)
+{
+    uint64_t due = f->count ? f->heap[0]->due_ns : 0;
+    struct itimerspec its = {
+        .it_value = {.tv_sec = due / 1000000000, .tv_nsec = due % 1000000000},
+    };
+
+    if (due == f->armed_ns) return;
+    f->armed_ns = due;
+    timerfd_settime(f->tfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/* hold a copy of the reply until `due_ns`, return -1 if no slot is free */
+static int fault_hold(faults_p f, const void *data, size_t len,
+                      const struct sockaddr *addr, uint64_t due_ns)
+{
+    struct held *h;
+    int i;
+
+    if (!f->free_count) {
+        Stats.add(STAT_FAULTS_OVERFLOW, 1);
+        return -1;
+    }
+    h = f->free[--f->free_count];
+    if (len > sizeof(h->data)) len = sizeof(h->data);
+    memcpy(h->data, data, len);
+    memcpy(&h->addr, addr, addr->sa_family == AF_INET6
+                               ? sizeof(struct sockaddr_in6)
+                               : sizeof(struct sockaddr_in));
+    h->len = len;
+    h->due_ns = due_ns;
+    h->seq = f->seq++;
+    /* sift up */
+    for (i = f->count++; i > 0 && held_before(h, f->heap[(i - 1) / 2]);
+         i = (i - 1) / 2)
+        f->heap[i] = f->heap[(i - 1) / 2];
+    f->heap[i] = h;
+    fault_arm(f);
+    return 0;
+}
+
+static struct held *fault_pop(faults_p f)
+{
+    struct held *top = f->heap[0], *last = f->heap[--f->count];
+    int i = 0;
+
+    /* sift the last one down from the root */
+    for (;;) {
+        int c = 2 * i + 1;
+        if (c >= f->count) break;
+        if (c + 1 < f->count && held_before(f->heap[c + 1], f->heap[c])) c++;
+        if (!held_before(f->heap[c], last)) break;
+        f->heap[i] = f->heap[c];
+        i = c;
+    }
+    if (f->count) f->heap[i] = last;
+    return top;
+}
+
+static int faults_filter(faults_p f, uint32_t n, void *data, size_t len,
+                         const struct sockaddr *addr)
+{
+    uint64_t now;
+    int hits = 0;
+
+    for (int kind = 0; kind < FAULT_KINDS; kind++)
+        if (fault_hits(f, kind, n)) {
+            hits |= 1 << kind;
+            Stats.add(fault_stats[kind], 1);
+        }
+    if (!hits) return 1;
+    if (hits & (1 << FAULT_DROP)) return 0;
+    if (hits & (1 << FAULT_CORRUPT) && len) ((char *)data)[0] += 1;
+    now = fault_now();
+    /* the copy goes out with the next dispatch, right after this one */
+    if (hits & (1 << FAULT_DUPLICATE)) fault_hold(f, data, len, addr, now);
+    if (hits & (1 << FAULT_DELAY))
+        return fault_hold(f, data, len, addr,
+                          now + f->plan.delay_ms * 1000000ULL) < 0;
+    /* a short random hold lets the following replies overtake this one */
+    if (hits & (1 << FAULT_REORDER))
+        return fault_hold(f, data, len, addr, now + 1000000ULL *
+                          (1 + fault_random(f) % f->plan.reorder_ms)) < 0;
+    return 1;
+}
+
+static int faults_dispatch(faults_p f, socket_p socket, int fd)
+{
+    struct iovec iov[SOCKET_BATCH];
+    struct sockaddr_storage addrs[SOCKET_BATCH];
+    struct held *due[SOCKET_BATCH];
+    uint64_t expirations, now = fault_now();
+    int sent = 0, n;
+
+    if (read(f->tfd, &expirations, sizeof(expirations)) > 0)
+        f->armed_ns = 0; /* fired, a one shot timer is disarmed */
+    do {
+        for (n = 0; n < SOCKET_BATCH && f->count &&
+                    f->heap[0]->due_ns <= now; n++) {
+            due[n] = fault_pop(f);
+            iov[n].iov_base = due[n]->data;
+            iov[n].iov_len = due[n]->len;
+            addrs[n] = due[n]->addr;
+        }
+        if (n) Socket.write_batch(socket, fd, iov, addrs, n);
+        /* the backends copy or send the data before returning */
+        for (int i = 0; i < n; i++) f->free[f->free_count++] = due[i];
+        sent += n;
+    } while (n == SOCKET_BATCH);
+    fault_arm(f);
+    return sent;
+}
+
+static int faults_fd(faults_p f)
+{
+    return f->tfd;
+}
+
+static int faults_held(faults_p f)
+{
+    return f->count;
+}
+
+/* Faults API gateway */
+const struct __FAULTS_API__ Faults = {
+    .plan = faults_plan,
+    .create = faults_create,
+    .filter = faults_filter,
+    .fd = faults_fd,
+    .dispatch = faults_dispatch,
+    .held = faults_held,
+    .destroy = faults_destroy,
+};
@@ -0,0 +1,115 @@
+#include "ring.h"
+
+/*
+ * HDR style log-linear histogram
+ *
+ * Values below 2^HIST_SUB_BITS get a bucket each. Above that every power
+ * of 2 is split into 2^HIST_SUB_BITS linear buckets, so any recorded value
+ * is known within 1/32 (~3%) of its magnitude, from 1 to 2^64.
+ *
+ * A histogram has a single writer. Every counter is accessed with relaxed
+ * atomics, so other threads may read percentiles while it is recorded.
+ */
+#define HIST_SUB (1 << HIST_SUB_BITS)
+
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+
+static int hist_index(uint64_t value)
+{
+    int exp;
+
+    if (value < HIST_SUB) return value;
+    exp = 63 - __builtin_clzll(value);
+    return (exp - HIST_SUB_BITS + 1) * HIST_SUB +
+           ((value >> (exp - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* the highest value that lands in bucket `index` */
+static uint64_t hist_value(int index)
+{
+    int exp;
+    uint64_t sub;
+
+    if (index < HIST_SUB) return index;
+    exp = index / HIST_SUB + HIST_SUB_BITS - 1;
+    sub = HIST_SUB + index % HIST_SUB;
+    return ((sub + 1) << (exp - HIST_SUB_BITS)) - 1;
+}
+
+static void hist_init(histogram_p h)
+{
+    memset(h, 0, sizeof(*h));
+}
+
+static void hist_record(histogram_p h, uint64_t value)
+{
+    int i = hist_index(value);
+
+    STORE(h->buckets[i], LOAD(h->buckets[i]) + 1);
+    STORE(h->sum, LOAD(h->sum) + value);
+    if (!LOAD(h->count) || value < LOAD(h->min)) STORE(h->min, value);
+    if (value > LOAD(h->max)) STORE(h->max, value);
+    STORE(h->count, LOAD(h->count) + 1);
+}
+
+/* add the samples of `src` to `dst`, `dst` must not be recorded meanwhile */
+static void hist_merge(histogram_p dst, histogram_p src)
+{
+    uint64_t count = LOAD(src->count);
+
+    if (!count) return;
+    for (int i = 0; i < HIST_BUCKETS; i++)
+        dst->buckets[i] += LOAD(src->buckets[i]);
+    if (!dst->count || LOAD(src->min) < dst->min) dst->min = LOAD(src->min);
+    if (LOAD(src->max) > dst->max) dst->max = LOAD(src->max);
+    dst->sum += LOAD(src->sum);
+    dst->count += count;
+}
+
+/* the value at or below which `percent` of the samples fall */
+static uint64_t hist_percentile(histogram_p h, double percent)
+{
+    uint64_t count = 0, total = 0, rank, max = LOAD(h->max);
+
+    for (int i = 0; i < HIST_BUCKETS; i++)
+        total += LOAD(h->buckets[i]);
+    if (!total) return 0;
+    rank = percent >= 100 ? total : (uint64_t)(total * percent / 100) + 1;
+    if (rank > total) rank = total;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        count += LOAD(h->buckets[i]);
+        if (count >= rank) {
+            uint64_t v = hist_value(i);
+            return v < max ? v : max;
+        }
+    }
+    return max;
+}
+
+static void hist_print(histogram_p h, const char *label, const char *unit,
+                       FILE *out)
+{
+    uint64_t count = LOAD(h->count);
+
+    fprintf(out, "%s: n=%lu", label, (unsigned long)count);
+    if (count)
+        fprintf(out, " min=%lu%s avg=%lu%s p50=%lu%s p99=%lu%s"
+                " p99.9=%lu%s max=%lu%s",
+                (unsigned long)LOAD(h->min), unit,
+                (unsigned long)(LOAD(h->sum) / count), unit,
+                (unsigned long)hist_percentile(h, 50), unit,
+                (unsigned long)hist_percentile(h, 99), unit,
+                (unsigned long)hist_percentile(h, 99.9), unit,
+                (unsigned long)LOAD(h->max), unit);
+    fprintf(out, "\n");
+}
+
+/* Histogram API gateway */
+const struct __HISTOGRAM_API__ Histogram = {
+    .init = hist_init,
+    .record = hist_record,
+    .merge = hist_merge,
+    .percentile = hist_percentile,
+    .print = hist_print,
+};
@@ -0,0 +1,197 @@
+#include "ring.h"
+
+/*
+ * Arena
+ *
+ * A bump allocator for objects that live as long as their owner (a ring,
+ * a socket and its settings). The first chunk is sized by the creator up
+ * front and holds the arena itself; if it runs out a new chunk is chained,
+ * so an estimate that is too small costs a malloc, not a failure. Every
+ * object is zeroed and aligned to a cache line, so objects of different
+ * threads never share one. Nothing is freed before `destroy`.
+ */
+#define ALIGN_UP(x) (((x) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size, used;
+    char data[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+struct arena {
+    struct arena_chunk *chunk; /* the chunk being carved, chained to older */
+    size_t reserved, used;
+};
+
+static struct arena_chunk *arena_chunk(size_t size)
+{
+    struct arena_chunk *c;
+
+    if (posix_memalign((void **)&c, ARENA_ALIGN, sizeof(*c) + size))
+        return NULL;
+    memset(c, 0, sizeof(*c) + size);
+    c->size = size;
+    return c;
+}
+
+static void *arena_alloc(arena_p arena, size_t size)
+{
+    struct arena_chunk *c = arena->chunk;
+    void *p;
+
+    size = ALIGN_UP(size ? size : 1);
+    if (c->size - c->used < size) {
+        size_t grow = size > c->size ? size : c->size;
+        if (!(c = arena_chunk(grow))) return NULL;
+        c->next = arena->chunk;
+        arena->chunk = c;
+        arena->reserved += grow;
+    }
+    p = c->data + c->used;
+    c->used += size;
+    arena->used += size;
+    return p;
+}
+
+static arena_p arena_create(size_t size)
+{
+    size_t head = ALIGN_UP(sizeof(struct arena));
+    struct arena_chunk *c = arena_chunk(head + ALIGN_UP(size));
+    arena_p arena;
+
+    if (!c) return NULL;
+    arena = (arena_p)c->data;
+    c->used = head;
+    arena->chunk = c;
+    arena->reserved = c->size - head;
+    return arena;
+}
+
+static void arena_destroy(arena_p arena)
+{
+    struct arena_chunk *c, *next;
+
+    if (!arena) return;
+    /* the first chunk holds the arena itself, it goes last */
+    for (c = arena->chunk; c; c = next) {
+        next = c->next;
+        free(c);
+    }
+}
+
+static size_t arena_reserved(arena_p arena)
+{
+    return arena ? arena->reserved : 0;
+}
+
+static size_t arena_used(arena_p arena)
+{
+    return arena ? arena->used : 0;
+}
+
+/* Arena API gateway */
+const struct __ARENA_API__ Arena = {
+    .create = arena_create,
+    .alloc = arena_alloc,
+    .reserved = arena_reserved,
+    .used = arena_used,
+    .destroy = arena_destroy,
+};
+
+/*
+ * Packet buffer pool
+ *
+ * `count` fixed size buffers carved from an arena in one block, with the
+ * free ones chained through their first bytes. Borrowing and returning is
+ * a pointer swap, so the packet path never touches the heap. A pool has
+ * a single owner thread (a server worker), there is no locking.
+ */
+struct packet_pool {
+    size_t size; /* bytes per buffer */
+    int count, available;
+    void *free; /* freelist, linked through the buffers */
+};
+
+static size_t buffers_footprint(int count, size_t size)
+{
+    return ALIGN_UP(sizeof(struct packet_pool)) + count * ALIGN_UP(size);
+}
+
+static packet_pool_p buffers_create(arena_p arena, int count, size_t size)
+{
+    packet_pool_p pool;
+    char *base;
+
+    if (count <= 0 || size < sizeof(void *)) return NULL;
+    pool = Arena.alloc(arena, sizeof(*pool));
+    base = Arena.alloc(arena, count * ALIGN_UP(size));
+    if (!pool || !base) return NULL;
+    pool->size = size;
+    pool->count = count;
+    for (int i = count - 1; i >= 0; i--) {
+        void **buf = (void **)(base + i * ALIGN_UP(size));
+        *buf = pool->free;
+        pool->free = buf;
+    }
+    pool->available = count;
+    return pool;
+}
+
+static void *buffers_get(packet_pool_p pool)
+{
+    void **buf = pool->free;
+
+    if (!buf) return NULL;
+    pool->free = *buf;
+    pool->available--;
+    return buf;
+}
+
+static void buffers_put(packet_pool_p pool, void *buf)
+{
+    if (!buf) return;
+    *(void **)buf = pool->free;
+    pool->free = buf;
+    pool->available++;
+}
+
+static int buffers_get_batch(packet_pool_p pool, struct iovec *iov, int n)
+{
+    int i;
+
+    for (i = 0; i < n && pool->free; i++) {
+        iov[i].iov_base = buffers_get(pool);
+        iov[i].iov_len = pool->size;
+    }
+    return i;
+}
+
+static void buffers_put_batch(packet_pool_p pool, struct iovec *iov, int n)
+{
+    for (int i = 0; i < n; i++) {
+        buffers_put(pool, iov[i].iov_base);
+        iov[i].iov_base = NULL;
+    }
+}
+
+static size_t buffers_size(packet_pool_p pool)
+{
+    return pool->size;
+}
+
+static int buffers_available(packet_pool_p pool)
+{
+    return pool->available;
+}
+
+/* Buffers API gateway */
+const struct __BUFFERS_API__ Buffers = {
+    .footprint = buffers_footprint,
+    .create = buffers_create,
+    .get = buffers_get,
+    .put = buffers_put,
+    .get_batch = buffers_get_batch,
+    .put_batch = buffers_put_batch,
+    .size = buffers_size,
+    .available = buffers_available,
+};
@@ -0,0 +1,211 @@
+#include <poll.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include "ring.h"
+
+/*
+ * PWM engine
+ *
+ * Every channel keeps the absolute deadline of its next edge and the
+ * next one is computed from it, not from the time the edge ran, so a
+ * late wakeup shows up as jitter of that edge only and the waveform
+ * never drifts. `Pwm.task` polls a timerfd armed for the earliest
+ * deadline (TFD_TIMER_ABSTIME) together with a notifier, so that `set`
+ * wakes it at once even while it waits for another channel's edge; the
+ * timerfd is disarmed while every channel is steady. A new frequency or
+ * duty is only stored by `set` and taken by the channel at its next
+ * edge, so the cycle in progress is cut short or stretched instead of
+ * finishing first. A ring with a Reactor has no thread to sleep on, the
+ * edges run from a wheel timer there.
+ */
+struct pwm {
+    pthread_mutex_t lock; /* the channels and their waveforms */
+    struct pwm_channel *channels;
+    struct notifier notify; /* wakes a Pwm.task for a new waveform */
+    int fd; /* timerfd of the earliest deadline of a Pwm.task */
+    struct timer timer; /* runs the edges of a Reactor ring */
+};
+
+/* the level of a steady waveform, -1 if it has edges */
+static int pwm_steady(const struct pwm_channel *ch)
+{
+    if (ch->high_ns <= 0) return 0;
+    if (ch->high_ns >= ch->period_ns) return 1;
+    return -1;
+}
+
+static void pwm_write(struct pwm_channel *ch, int level)
+{
+    ch->level = level;
+    ch->write(ch->arg, level);
+}
+
+/* run the edges due by `now`, return the next deadline, -1 if none */
+static int64_t pwm_edges(struct pwm *pwm, int64_t now)
+{
+    int64_t next = -1;
+
+    for (struct pwm_channel *ch = pwm->channels; ch; ch = ch->next) {
+        int steady = pwm_steady(ch);
+
+        if (!ch->next_ns) {
+            /* a steady channel takes its new waveform at once */
+            if (steady >= 0) {
+                if (ch->level != steady) pwm_write(ch, steady);
+                continue;
+            }
+            ch->next_ns = now + ch->high_ns;
+            pwm_write(ch, 1);
+        } else if (ch->next_ns <= now) {
+            Histogram.record(&ch->jitter, now - ch->next_ns);
+            if (steady >= 0) {
+                ch->next_ns = 0;
+                pwm_write(ch, steady);
+                continue;
+            }
+            ch->next_ns += ch->level ? ch->period_ns - ch->high_ns
+                                     : ch->high_ns;
+            /* a whole phase was missed, restart rather than catch up */
+            if (ch->next_ns <= now)
+                ch->next_ns = now + (ch->level ? ch->period_ns - ch->high_ns
+                                               : ch->high_ns);
+            pwm_write(ch, !ch->level);
+        }
+        if (next < 0 || ch->next_ns < next) next = ch->next_ns;
+    }
+    return next;
+}
+
+/* the wheel timer of a Reactor ring */
+static void pwm_tick(void *arg)
+{
+    ring_p ring = arg;
+    struct pwm *pwm = ring->pwm;
+    int64_t now = Clock.now_ns(), next;
+
+    pthread_mutex_lock(&pwm->lock);
+    next = pwm_edges(pwm, now);
+    pthread_mutex_unlock(&pwm->lock);
+    if (next >= 0)
+        Timer.schedule(ring, &pwm->timer,
+                       (next - now + 999999) / 1000000, 0);
+}
+
+static void *pwm_task(void *arg)
+{
+    ring_p ring = arg;
+    struct pwm *pwm = ring->pwm;
+    struct pollfd fds[2] = { { .fd = pwm->fd, .events = POLLIN },
+                             { .fd = pwm->notify.fd, .events = POLLIN } };
+    struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+    uint64_t expired;
+    int64_t next;
+
+    Stats.name("pwm_task");
+    while (Thread.running(ring)) {
+        pthread_mutex_lock(&pwm->lock);
+        next = pwm_edges(pwm, Clock.now_ns());
+        pthread_mutex_unlock(&pwm->lock);
+        /* a zero it_value disarms the timerfd */
+        its.it_value.tv_sec = next > 0 ? next / 1000000000 : 0;
+        its.it_value.tv_nsec = next > 0 ? next % 1000000000 : 0;
+        if (timerfd_settime(pwm->fd, TFD_TIMER_ABSTIME, &its, NULL))
+            perror("timerfd_settime");
+        Stats.idle_begin();
+        while (poll(fds, 2, -1) < 0 && errno == EINTR);
+        Stats.idle_end();
+        if (fds[0].revents & POLLIN &&
+            read(pwm->fd, &expired, sizeof(expired)) < 0)
+            perror("timerfd read");
+        if (fds[1].revents & POLLIN) Notifier.drain(&pwm->notify);
+    }
+    return NULL;
+}
+
+static int pwm_open(ring_p ring)
+{
+    struct pwm *pwm = Arena.alloc(ring->arena, sizeof(*pwm));
+
+    if (!pwm) return -1;
+    if (pthread_mutex_init(&pwm->lock, NULL)) return -1;
+    if (Notifier.init(&pwm->notify, 0)) {
+        pthread_mutex_destroy(&pwm->lock);
+        return -1;
+    }
+    pwm->fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (pwm->fd < 0) {
+        perror("timerfd_create");
+        Notifier.close(&pwm->notify);
+        pthread_mutex_destroy(&pwm->lock);
+        return -1;
+    }
+    pwm->channels = NULL;
+    Timer.init(&pwm->timer, pwm_tick, ring);
+    ring->pwm = pwm;
+    return 0;
+}
+
+static void pwm_close(ring_p ring)
+{
+    if (!ring->pwm) return;
+    Notifier.close(&ring->pwm->notify);
+    close(ring->pwm->fd);
+    pthread_mutex_destroy(&ring->pwm->lock);
+    /* the engine goes with the ring arena */
+    ring->pwm = NULL;
+}
+
+static void pwm_add(ring_p ring, pwm_channel_p ch,
+                    void (*write)(void *arg, int level), void *arg)
+{
+    struct pwm *pwm = ring->pwm;
+
+    ch->write = write;
+    ch->arg = arg;
+    Histogram.init(&ch->jitter);
+    ch->period_ns = 1;
+    ch->high_ns = 0;
+    ch->next_ns = 0;
+    ch->level = 0;
+    pthread_mutex_lock(&pwm->lock);
+    ch->next = pwm->channels;
+    pwm->channels = ch;
+    pthread_mutex_unlock(&pwm->lock);
+}
+
+static void pwm_set(ring_p ring, pwm_channel_p ch, double hz, double duty)
+{
+    struct pwm *pwm = ring->pwm;
+    int64_t period_ns = hz > 0 ? 1e9 / hz : 1;
+    int64_t high_ns = hz > 0 ? duty * period_ns : duty > 0;
+    int kick;
+
+    pthread_mutex_lock(&pwm->lock);
+    /* a running waveform has an edge coming, a steady one needs a kick,
+     * unless nothing changes */
+    kick = !ch->next_ns &&
+           (period_ns != ch->period_ns || high_ns != ch->high_ns);
+    ch->period_ns = period_ns;
+    ch->high_ns = high_ns;
+    pthread_mutex_unlock(&pwm->lock);
+    if (!kick) return;
+    if (ring->reactor)
+        Timer.schedule(ring, &pwm->timer, 0, 0);
+    else
+        Notifier.signal(&pwm->notify);
+}
+
+static void pwm_wake(ring_p ring)
+{
+    if (ring->pwm) Notifier.signal(&ring->pwm->notify);
+}
+
+/* Pwm API gateway */
+const struct __PWM_API__ Pwm = {
+    .open = pwm_open,
+    .close = pwm_close,
+    .add = pwm_add,
+    .set = pwm_set,
+    .wake = pwm_wake,
+    .task = pwm_task,
+};
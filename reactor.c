@@ -0,0 +1,134 @@
+#include "ring.h"
+
+/*
+ * Reactor
+ *
+ * A single threaded event loop for a ring created without threads: one
+ * epoll set with the ring's timerfd and the fds of the handlers, so the
+ * socket, the timers and the notifiers of the Thread API are dispatched
+ * as callbacks on the thread that calls `run`. There is no locking and
+ * no cross thread wakeup; `Thread.signal` (from a callback or a signal
+ * handler) makes `run` return. On the virtual Clock the loop only polls
+ * the fds; when none is ready it moves the clock to the next timer, so
+ * the timers fire in order without any wall time passing.
+ */
+struct reactor {
+    int epfd;
+    struct epoll_event *ready; /* the events being dispatched */
+    int nready;
+};
+
+static int reactor_open(ring_p ring)
+{
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+    struct reactor *r = Arena.alloc(ring->arena, sizeof(*r));
+
+    if (!r) return -1;
+    r->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (r->epfd < 0) {
+        perror("reactor");
+        return -1;
+    }
+    /* the timer wheel is the NULL handler */
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, Timer.fd(ring), &event)) {
+        perror("reactor timers");
+        close(r->epfd);
+        return -1;
+    }
+    ring->reactor = r;
+    return 0;
+}
+
+static void reactor_close(ring_p ring)
+{
+    if (!ring->reactor) return;
+    close(ring->reactor->epfd);
+    /* the reactor goes with the ring arena */
+    ring->reactor = NULL;
+}
+
+/* stands in for the handlers removed while their event is pending */
+static struct handler removed;
+
+static int reactor_add(ring_p ring, struct handler *h, int fd,
+                       void (*func)(void *arg), void *arg)
+{
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = h };
+
+    h->fd = fd;
+    h->func = func;
+    h->arg = arg;
+    if (epoll_ctl(ring->reactor->epfd, EPOLL_CTL_ADD, fd, &event)) {
+        Stats.add(STAT_EPOLL_CTL_FAILURES, 1);
+        return -1;
+    }
+    return 0;
+}
+
+static int reactor_remove(ring_p ring, struct handler *h)
+{
+    struct reactor *r = ring->reactor;
+
+    /* a callback may remove a handler whose event is still to come */
+    for (int i = 0; i < r->nready; i++)
+        if (r->ready[i].data.ptr == h) r->ready[i].data.ptr = &removed;
+    if (epoll_ctl(ring->reactor->epfd, EPOLL_CTL_DEL, h->fd, NULL)) {
+        Stats.add(STAT_EPOLL_CTL_FAILURES, 1);
+        return -1;
+    }
+    return 0;
+}
+
+static int reactor_run(ring_p ring)
+{
+    struct epoll_event events[MAX_EVENTS];
+    uint64_t expirations;
+
+    Stats.name("reactor");
+    while (Thread.running(ring)) {
+        int n;
+
+        Stats.idle_begin();
+        n = epoll_wait(ring->reactor->epfd, events, MAX_EVENTS,
+                       Clock.is_virtual() ? 0 : -1);
+        Stats.idle_end();
+        Stats.add(STAT_SYSCALLS, 1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("reactor wait");
+            return -1;
+        }
+        if (!n && Clock.is_virtual()) {
+            int64_t next = Timer.next(ring);
+            if (next < 0) return 0; /* nothing can happen any more */
+            Clock.advance(next);
+            Timer.dispatch(ring);
+            continue;
+        }
+        ring->reactor->ready = events;
+        ring->reactor->nready = n;
+        for (int i = 0; i < n && Thread.running(ring); i++) {
+            struct handler *h = events[i].data.ptr;
+            if (h == &removed) continue;
+            if (!h) {
+                if (read(Timer.fd(ring), &expirations,
+                         sizeof(expirations)) < 0 && errno != EAGAIN)
+                    perror("timerfd read");
+                Timer.dispatch(ring);
+                continue;
+            }
+            h->func(h->arg);
+        }
+        ring->reactor->nready = 0;
+    }
+    return 0;
+}
+
+/* Reactor API gateway */
+const struct __REACTOR_API__ Reactor = {
+    .open = reactor_open,
+    .close = reactor_close,
+    .add = reactor_add,
+    .remove = reactor_remove,
+    .run = reactor_run,
+};
@@ -0,0 +1,245 @@
+#include <time.h>
+#include "ring.h"
+
+/*
+ * Host resolution cache
+ *
+ * A small process wide table of resolved hosts, filled by one background
+ * thread so a lookup never waits on the network once the entry is warm.
+ * getaddrinfo() honors /etc/hosts and nsswitch but does not report the
+ * record TTLs, so entries live `ttl_ms` (default 60s), failures
+ * `negative_ms` (5s). An entry used after 3/4 of its TTL is refreshed in
+ * the background while the cached address keeps being served, and so is
+ * an expired one: only the first lookup of a host waits. A failed
+ * refresh serves the last address, or the failure, for another
+ * `negative_ms`. Each entry keeps the first IPv4 and the first IPv6
+ * address, IPv4 is preferred.
+ */
+#define RESOLVER_ENTRIES 32
+#define RESOLVER_HOST_LEN 256
+#define RESOLVER_TTL_MS 60000
+#define RESOLVER_NEGATIVE_MS 5000
+
+struct resolver_entry {
+    char host[RESOLVER_HOST_LEN];
+    int port;
+    struct sockaddr_storage v4, v6; /* ss_family 0 if none */
+    int64_t resolved_ms; /* last answer, good or bad */
+    int64_t expires_ms;
+    int64_t used_ms; /* for the LRU replacement */
+    int queued; /* waiting for or in the resolver thread */
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t queued, resolved;
+    int started;
+    int ttl_ms, negative_ms;
+    /* answers instead of getaddrinfo(), for tests */
+    int (*stub)(const char *host, int port, struct sockaddr_storage *addr);
+    struct resolver_entry entries[RESOLVER_ENTRIES];
+} cache = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .queued = PTHREAD_COND_INITIALIZER,
+    .ttl_ms = RESOLVER_TTL_MS,
+    .negative_ms = RESOLVER_NEGATIVE_MS,
+};
+static pthread_once_t resolver_once = PTHREAD_ONCE_INIT;
+
+static int64_t resolver_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* copy the answer of `host` into `e`, called without the lock */
+static void resolver_query(const char *host, int port,
+                           struct resolver_entry *e)
+{
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_DGRAM,
+    };
+    struct addrinfo *res, *ai;
+    struct sockaddr_storage addr;
+    char service[8];
+    int (*stub)(const char *, int, struct sockaddr_storage *) =
+        __atomic_load_n(&cache.stub, __ATOMIC_ACQUIRE);
+
+    memset(&e->v4, 0, sizeof(e->v4));
+    memset(&e->v6, 0, sizeof(e->v6));
+    if (stub) {
+        memset(&addr, 0, sizeof(addr));
+        if (!stub(host, port, &addr))
+            *(addr.ss_family == AF_INET6 ? &e->v6 : &e->v4) = addr;
+        return;
+    }
+    snprintf(service, sizeof(service), "%d", port);
+    if (getaddrinfo(host, service, &hints, &res)) return;
+    for (ai = res; ai; ai = ai->ai_next) {
+        struct sockaddr_storage *to = ai->ai_family == AF_INET ? &e->v4 :
+                                      ai->ai_family == AF_INET6 ? &e->v6 : NULL;
+        if (to && !to->ss_family) memcpy(to, ai->ai_addr, ai->ai_addrlen);
+    }
+    freeaddrinfo(res);
+}
+
+static void *resolver_task(void *arg)
+{
+    Stats.name("resolver");
+    pthread_mutex_lock(&cache.lock);
+    for (;;) {
+        struct resolver_entry *e = NULL, answer;
+        char host[RESOLVER_HOST_LEN];
+        int port;
+
+        for (int i = 0; i < RESOLVER_ENTRIES && !e; i++)
+            if (cache.entries[i].queued == 1) e = cache.entries + i;
+        if (!e) {
+            Stats.idle_begin();
+            pthread_cond_wait(&cache.queued, &cache.lock);
+            Stats.idle_end();
+            continue;
+        }
+        e->queued = 2; /* in flight, the entry is not replaced */
+        strcpy(host, e->host);
+        port = e->port;
+        pthread_mutex_unlock(&cache.lock);
+
+        resolver_query(host, port, &answer);
+
+        pthread_mutex_lock(&cache.lock);
+        e->resolved_ms = resolver_now();
+        if (answer.v4.ss_family || answer.v6.ss_family) {
+            e->v4 = answer.v4;
+            e->v6 = answer.v6;
+            e->expires_ms = e->resolved_ms + cache.ttl_ms;
+        } else {
+            /* the last address, if any, stays until the next attempt */
+            e->expires_ms = e->resolved_ms + cache.negative_ms;
+        }
+        e->queued = 0;
+        pthread_cond_broadcast(&cache.resolved);
+    }
+    return NULL;
+}
+
+static void resolver_start(void)
+{
+    pthread_condattr_t attr;
+    pthread_t thread;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&cache.resolved, &attr);
+    pthread_condattr_destroy(&attr);
+    if (pthread_create(&thread, NULL, resolver_task, NULL)) {
+        perror("resolver thread");
+        return;
+    }
+    pthread_detach(thread);
+    cache.started = 1;
+}
+
+/* the entry of `host`, or a replaced least recently used one; locked */
+static struct resolver_entry *resolver_entry(const char *host, int port)
+{
+    struct resolver_entry *lru = NULL;
+
+    for (int i = 0; i < RESOLVER_ENTRIES; i++) {
+        struct resolver_entry *e = cache.entries + i;
+        if (e->port == port && !strcmp(e->host, host)) return e;
+        if (!e->queued && (!lru || e->used_ms < lru->used_ms)) lru = e;
+    }
+    if (!lru) return NULL;
+    memset(lru, 0, sizeof(*lru));
+    strcpy(lru->host, host);
+    lru->port = port;
+    return lru;
+}
+
+/* queue a query of `e` for the resolver thread; locked */
+static void resolver_queue(struct resolver_entry *e)
+{
+    if (e->queued || !cache.started) return;
+    e->queued = 1;
+    pthread_cond_signal(&cache.queued);
+}
+
+static int resolver_copy(struct resolver_entry *e,
+                         struct sockaddr_storage *addr)
+{
+    if (e->v4.ss_family)
+        *addr = e->v4;
+    else if (e->v6.ss_family)
+        *addr = e->v6;
+    else
+        return -1;
+    return 0;
+}
+
+static int resolver_lookup(const char *host, int port,
+                           struct sockaddr_storage *addr, int wait_ms)
+{
+    struct resolver_entry *e;
+    int64_t now = resolver_now(), deadline = now + wait_ms;
+    int ret = -1;
+
+    if (!host || strlen(host) >= RESOLVER_HOST_LEN) return -1;
+    pthread_once(&resolver_once, resolver_start);
+    pthread_mutex_lock(&cache.lock);
+    if (!(e = resolver_entry(host, port))) goto out;
+    e->used_ms = now;
+    if (e->resolved_ms) {
+        /* refresh ahead, the answer (or failure) we have is served */
+        if (now >= e->resolved_ms + (e->expires_ms - e->resolved_ms) * 3 / 4)
+            resolver_queue(e);
+        ret = resolver_copy(e, addr);
+        goto out;
+    }
+    resolver_queue(e);
+    while (e->queued && now < deadline) {
+        struct timespec ts = {
+            .tv_sec = deadline / 1000, .tv_nsec = deadline % 1000 * 1000000,
+        };
+        pthread_cond_timedwait(&cache.resolved, &cache.lock, &ts);
+        now = resolver_now();
+    }
+    /* the first answer, unless it is late or the entry was handed to
+     * another host in the meantime */
+    if (e->port == port && !strcmp(e->host, host))
+        ret = resolver_copy(e, addr);
+out:
+    pthread_mutex_unlock(&cache.lock);
+    return ret;
+}
+
+static void resolver_prefetch(const char *host, int port)
+{
+    struct sockaddr_storage addr;
+
+    resolver_lookup(host, port, &addr, 0);
+}
+
+static void resolver_ttl(int ttl_ms, int negative_ms)
+{
+    pthread_mutex_lock(&cache.lock);
+    if (ttl_ms > 0) cache.ttl_ms = ttl_ms;
+    if (negative_ms > 0) cache.negative_ms = negative_ms;
+    pthread_mutex_unlock(&cache.lock);
+}
+
+static void resolver_stub(int (*query)(const char *host, int port,
+                                       struct sockaddr_storage *addr))
+{
+    __atomic_store_n(&cache.stub, query, __ATOMIC_RELEASE);
+}
+
+/* Resolver API gateway */
+const struct __RESOLVER_API__ Resolver = {
+    .lookup = resolver_lookup,
+    .prefetch = resolver_prefetch,
+    .ttl = resolver_ttl,
+    .stub = resolver_stub,
+};
@@ -0,0 +1,874 @@
+#include <fcntl.h>
+#include <math.h>
+#include <time.h>
+#include "ring.h"
+
+/*
+ * Microbenchmarks for the ring primitives.
+ *
+ * wakeup: wake-to-run latency of a task thread, measured as the time
+ *         from posting a wakeup until the woken thread runs, for the
+ *         eventfd Notifier and for the pipe signalling it replaced.
+ * trace:  cost of recording one event with Trace.event, against the
+ *         printf + fflush per message it replaced (into /dev/null).
+ * jitter: lateness of a thread waking on absolute 1ms deadlines while a
+ *         busy thread per CPU competes with it, with the default thread
+ *         attributes, pinned to CPU 0, and pinned with SCHED_FIFO and
+ *         locked memory (Thread.create_attr).
+ * run:    wake-to-run latency of Thread.run, from queueing a task until
+ *         an idle pool worker runs it.
+ * create: cost of Thread.create and Thread.finish of a ring of `-t` pool
+ *         threads.
+ * socket: round trip of a datagram with Socket.write and Socket.read over
+ *         loopback, echoed by a thread of the bench.
+ * connect: cost of Socket.connect with a new socket every time
+ *         (SocketSettings.reconnect) and with the socket kept, the socket
+ *         events traced to a file.
+ * blink:  edge lateness and high time error of a Pwm channel blinking at
+ *         100Hz with 25% duty, the engine behind red_led_blink.
+ *
+ * Every bench adds its numbers to the results, all of them lower is
+ * better: `-j file` saves them as JSON, `-c file` compares them with a
+ * saved run and fails if one got worse by more than `-T` percent, or
+ * if a bench that ran (or one that is gone) left a gate out. Only
+ * the medians (and the trace cost) can fail it; the averages and p99s
+ * move by tens of percent from one run to the next on a loaded machine,
+ * they are shown for information, as is blink, which mostly measures how
+ * long an idle CPU takes to wake up for a timer. With `-r` every bench
+ * runs that many times and each result is the best of them, which takes
+ * most of the noise of a machine that is busy elsewhere out of the
+ * medians.
+ */
+
+#define RESULTS_MAX 128
+
+struct result {
+    char name[48];
+    char unit[8];
+    double value;
+    int gate; /* worse than the baseline fails the comparison */
+};
+
+static struct {
+    struct result r[RESULTS_MAX];
+    int n;
+} results;
+
+/* `all` runs them in this order, jitter last as it locks the memory */
+static struct {
+    const char *name;
+    int iterations;
+    int ran; /* a gate of it missing from the results fails -c */
+} benches[] = {
+    { "wakeup", 100000 },
+    { "run", 20000 },
+    { "create", 200 },
+    { "socket", 20000 },
+    { "connect", 2000 },
+    { "blink", 200 },
+    { "trace", 100000 },
+    { "jitter", 2000 },
+};
+
+/* the bench of a result, named up to its first '.', -1 if none is */
+static int bench_of(const char *result)
+{
+    size_t len = strcspn(result, ".");
+
+    for (int j = 0; j < sizeof(benches) / sizeof(*benches); j++)
+        if (strlen(benches[j].name) == len &&
+            !strncmp(benches[j].name, result, len))
+            return j;
+    return -1;
+}
+
+struct wakeup_channel {
+    const char *name;
+    int (*init)(struct wakeup_channel *);
+    void (*signal)(struct wakeup_channel *);
+    int (*wait)(struct wakeup_channel *); /* return the wakeups consumed */
+    void (*close)(struct wakeup_channel *);
+    struct notifier notify;
+    int fds[2];
+};
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int cmp_i64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* a result seen before, by a repeat of its bench, keeps the best value */
+static void result(const char *name, const char *unit, double value,
+                   int gate)
+{
+    struct result *res;
+
+    for (int i = 0; i < results.n; i++)
+        if (!strcmp(results.r[i].name, name)) {
+            if (value < results.r[i].value) results.r[i].value = value;
+            return;
+        }
+    if (results.n == RESULTS_MAX) return;
+    res = results.r + results.n++;
+    snprintf(res->name, sizeof(res->name), "%s", name);
+    snprintf(res->unit, sizeof(res->unit), "%s", unit);
+    res->value = value;
+    res->gate = gate;
+}
+
+/*
+ * sort the `n` samples, print them on one line and add their average,
+ * p50 and p99 to the results as `name`.avg etc., in `unit`s of `scale` ns
+ * and with the p50 as a `gate`
+ */
+static void samples_report(const char *name, const char *unit, double scale,
+                           int64_t *samples, int n, const char *extra,
+                           int gate)
+{
+    char key[40];
+    double sum = 0;
+
+    qsort(samples, n, sizeof(*samples), cmp_i64);
+    for (int i = 0; i < n; i++)
+        sum += samples[i];
+    printf("%-8s %s: min %.1f avg %.1f p50 %.1f p99 %.1f max %.1f%s\n",
+           name, unit, samples[0] / scale, sum / n / scale,
+           samples[n / 2] / scale, samples[n * 99 / 100] / scale,
+           samples[n - 1] / scale, extra ? extra : "");
+    snprintf(key, sizeof(key), "%s.avg", name);
+    result(key, unit, sum / n / scale, 0);
+    snprintf(key, sizeof(key), "%s.p50", name);
+    result(key, unit, samples[n / 2] / scale, gate);
+    snprintf(key, sizeof(key), "%s.p99", name);
+    result(key, unit, samples[n * 99 / 100] / scale, 0);
+}
+
+/* one result per line, which is what `results_read` parses back */
+static int results_write(const char *path)
+{
+    FILE *out = fopen(path, "w");
+
+    if (!out) {
+        perror(path);
+        return -1;
+    }
+    fprintf(out, "{\"results\": [\n");
+    for (int i = 0; i < results.n; i++)
+        fprintf(out, "  {\"name\": \"%s\", \"unit\": \"%s\","
+                " \"value\": %.3f, \"gate\": %s}%s\n", results.r[i].name,
+                results.r[i].unit, results.r[i].value,
+                results.r[i].gate ? "true" : "false",
+                i + 1 < results.n ? "," : "");
+    fprintf(out, "]}\n");
+    return fclose(out);
+}
+
+/* return the number of results read from a file of `results_write` */
+static int results_read(const char *path, struct result *r, int max)
+{
+    FILE *in = fopen(path, "r");
+    char line[256];
+    int n = 0;
+
+    if (!in) {
+        perror(path);
+        return -1;
+    }
+    while (n < max && fgets(line, sizeof(line), in))
+        if (sscanf(line, " {\"name\": \"%47[^\"]\", \"unit\": \"%7[^\"]\","
+                   " \"value\": %lf", r[n].name, r[n].unit,
+                   &r[n].value) == 3) {
+            r[n].gate = strstr(line, "\"gate\": true") != NULL;
+            n++;
+        }
+    fclose(in);
+    return n;
+}
+
+/* return the number of gates worse than the baseline by `percent`, or
+ * missing */
+static int results_compare(const char *path, double percent)
+{
+    struct result *base = calloc(RESULTS_MAX, sizeof(*base));
+    int n = base ? results_read(path, base, RESULTS_MAX) : -1, worse = 0;
+
+    if (n < 0) {
+        free(base);
+        return -1;
+    }
+    printf("\n%-28s %12s %12s %8s  (worse above +%.0f%%)\n", path,
+           "baseline", "now", "change", percent);
+    for (int i = 0; i < results.n; i++) {
+        struct result *now = results.r + i, *old = NULL;
+        double change;
+
+        for (int j = 0; j < n && !old; j++)
+            if (!strcmp(base[j].name, now->name)) old = base + j;
+        if (!old) {
+            printf("%-28s %12s %10.1f%-2s %8s\n", now->name, "-",
+                   now->value, now->unit, "new");
+            continue;
+        }
+        change = old->value > 0 ? 100 * (now->value / old->value - 1)
+                                : now->value > 0 ? INFINITY : 0;
+        printf("%-28s %10.1f%-2s %10.1f%-2s %+7.1f%%%s\n", now->name,
+               old->value, old->unit, now->value, now->unit, change,
+               change <= percent ? "" : now->gate ? "  REGRESSION"
+                                                  : "  (worse, not a gate)");
+        worse += now->gate && change > percent;
+    }
+    /* a gate of the baseline that this run did not produce: its bench
+     * failed to report it, or was removed or renamed */
+    for (int j = 0; j < n; j++) {
+        int bench = bench_of(base[j].name), found = 0;
+
+        if (!base[j].gate || (bench >= 0 && !benches[bench].ran)) continue;
+        for (int i = 0; i < results.n && !found; i++)
+            found = !strcmp(results.r[i].name, base[j].name);
+        if (found) continue;
+        printf("%-28s %10.1f%-2s %12s %8s  MISSING\n", base[j].name,
+               base[j].value, base[j].unit, "-", "gone");
+        worse++;
+    }
+    free(base);
+    return worse;
+}
+
+/* the pipe signalling: one byte per wakeup, one read() per byte */
+static int pipe_init(struct wakeup_channel *ch)
+{
+    if (pipe(ch->fds)) return -1;
+    fcntl(ch->fds[1], F_SETFL, O_NONBLOCK | O_WRONLY);
+    return 0;
+}
+
+static void pipe_signal(struct wakeup_channel *ch)
+{
+    if (write(ch->fds[1], ch, 1) != 1) perror("write");
+}
+
+static int pipe_wait(struct wakeup_channel *ch)
+{
+    char sig_buf;
+    return read(ch->fds[0], &sig_buf, 1) == 1 ? 1 : -1;
+}
+
+static void pipe_close(struct wakeup_channel *ch)
+{
+    close(ch->fds[0]);
+    close(ch->fds[1]);
+}
+
+static int notifier_init(struct wakeup_channel *ch)
+{
+    return Notifier.init(&ch->notify, 0);
+}
+
+static void notifier_signal(struct wakeup_channel *ch)
+{
+    Notifier.signal(&ch->notify);
+}
+
+static int notifier_wait(struct wakeup_channel *ch)
+{
+    return Notifier.wait(&ch->notify);
+}
+
+static void notifier_close(struct wakeup_channel *ch)
+{
+    Notifier.close(&ch->notify);
+}
+
+/* a ping-pong pair: the main thread wakes `ping`, the task wakes `pong` */
+struct wakeup_bench {
+    struct wakeup_channel ping, pong;
+    int iterations;
+    volatile int64_t sent_at;
+    int64_t *samples;
+};
+
+static void *wakeup_task(void *arg)
+{
+    struct wakeup_bench *b = arg;
+
+    for (int i = 0; i < b->iterations; i++) {
+        if (b->ping.wait(&b->ping) < 0) break;
+        b->samples[i] = now_ns() - b->sent_at;
+        b->pong.signal(&b->pong);
+    }
+    return NULL;
+}
+
+static void wakeup_run(struct wakeup_channel proto, int iterations)
+{
+    struct wakeup_bench b = { .ping = proto, .pong = proto,
+                              .iterations = iterations };
+    pthread_t thr;
+    int64_t sum = 0;
+    int reads = 0, burst = 64;
+    char name[40];
+
+    b.samples = calloc(iterations, sizeof(*b.samples));
+    if (!b.samples || proto.init(&b.ping) || proto.init(&b.pong)) {
+        perror(proto.name);
+        exit(1);
+    }
+    pthread_create(&thr, NULL, wakeup_task, &b);
+    for (int i = 0; i < iterations; i++) {
+        b.sent_at = now_ns();
+        b.ping.signal(&b.ping);
+        b.pong.wait(&b.pong);
+    }
+    pthread_join(thr, NULL);
+
+    /* a burst of redundant wakeups: how many reads until it is drained */
+    for (int i = 0; i < burst; i++)
+        b.ping.signal(&b.ping);
+    for (int pending = burst; pending > 0; reads++) {
+        int r = b.ping.wait(&b.ping);
+        if (r < 0) break;
+        pending -= r;
+    }
+
+    qsort(b.samples, iterations, sizeof(*b.samples), cmp_i64);
+    for (int i = 0; i < iterations; i++)
+        sum += b.samples[i];
+    printf("%-8s wake-to-run ns: min %lld avg %lld p50 %lld p99 %lld"
+           " max %lld | %d-signal burst drained in %d read%s\n",
+           proto.name, (long long)b.samples[0],
+           (long long)(sum / iterations),
+           (long long)b.samples[iterations / 2],
+           (long long)b.samples[iterations * 99 / 100],
+           (long long)b.samples[iterations - 1],
+           burst, reads, reads > 1 ? "s" : "");
+    snprintf(name, sizeof(name), "wakeup.%s.p50", proto.name);
+    result(name, "ns", b.samples[iterations / 2], 1);
+    snprintf(name, sizeof(name), "wakeup.%s.p99", proto.name);
+    result(name, "ns", b.samples[iterations * 99 / 100], 0);
+    proto.close(&b.ping);
+    proto.close(&b.pong);
+    free(b.samples);
+}
+
+static void bench_wakeup(int iterations)
+{
+    wakeup_run((struct wakeup_channel) {
+        .name = "pipe", .init = pipe_init, .signal = pipe_signal,
+        .wait = pipe_wait, .close = pipe_close }, iterations);
+    wakeup_run((struct wakeup_channel) {
+        .name = "eventfd", .init = notifier_init, .signal = notifier_signal,
+        .wait = notifier_wait, .close = notifier_close }, iterations);
+}
+
+/* bursts that fit the thread's trace ring, drained in between */
+#define TRACE_BURST 2048
+
+static void bench_trace(int iterations)
+{
+    char path[] = "/tmp/ring-bench-trace.XXXXXX";
+    struct stats_snapshot *snap = malloc(sizeof(*snap));
+    FILE *null = fopen("/dev/null", "w");
+    struct timespec drain = { .tv_nsec = 20000000 };
+    int64_t traced = 0, printed, start;
+    int fd = mkstemp(path);
+
+    if (fd < 0 || !snap || !null || Trace.open(path, 0)) {
+        perror("trace");
+        exit(1);
+    }
+    close(fd);
+    for (int done = 0; done < iterations; done += TRACE_BURST) {
+        int n = iterations - done < TRACE_BURST ? iterations - done
+                                                : TRACE_BURST;
+        start = now_ns();
+        for (int i = 0; i < n; i++)
+            Trace.event(TRACE_ECHO, done + i, 0);
+        traced += now_ns() - start;
+        nanosleep(&drain, NULL);
+    }
+    Trace.close();
+    Stats.snapshot(snap);
+    start = now_ns();
+    for (int i = 0; i < iterations; i++) {
+        fprintf(null, "%d ", i);
+        fflush(null);
+    }
+    printed = now_ns() - start;
+    printf("trace    ns/event: %.1f (%llu dropped) | printf+fflush %.1f\n",
+           (double)traced / iterations,
+           (unsigned long long)snap->total[STAT_TRACE_DROPPED],
+           (double)printed / iterations);
+    result("trace.event", "ns", (double)traced / iterations, 1);
+    fclose(null);
+    unlink(path);
+    free(snap);
+}
+
+#define JITTER_PERIOD_NS 1000000
+
+static struct {
+    int ticks;
+    int64_t *late;
+    int busy; /* the competitors spin while it is set */
+} jitter;
+
+static void *jitter_task(void *arg)
+{
+    struct timespec next;
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    for (int i = 0; i < jitter.ticks; i++) {
+        next.tv_nsec += JITTER_PERIOD_NS;
+        if (next.tv_nsec >= 1000000000) {
+            next.tv_nsec -= 1000000000;
+            next.tv_sec++;
+        }
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next,
+                               NULL) == EINTR);
+        jitter.late[i] = now_ns() - (next.tv_sec * 1000000000LL +
+                                     next.tv_nsec);
+    }
+    __atomic_store_n(&jitter.busy, 0, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static void *busy_task(void *arg)
+{
+    while (__atomic_load_n(&jitter.busy, __ATOMIC_ACQUIRE));
+    return NULL;
+}
+
+static void jitter_run(const char *name, const struct thread_attr *attr)
+{
+    int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    void *(*tasks[1 + cpus])(void *);
+    const struct thread_attr *attrs[1 + cpus];
+    int64_t sum = 0;
+    ring_p ring;
+    char key[40];
+
+    tasks[0] = jitter_task;
+    attrs[0] = attr;
+    for (int i = 1; i <= cpus; i++) {
+        tasks[i] = busy_task;
+        attrs[i] = NULL;
+    }
+    jitter.busy = 1;
+    ring = Thread.create_attr(1 + cpus, tasks, attrs);
+    if (!ring) {
+        fprintf(stderr, "%s: the threads did not start\n", name);
+        return;
+    }
+    Thread.wait(ring);
+
+    qsort(jitter.late, jitter.ticks, sizeof(*jitter.late), cmp_i64);
+    for (int i = 0; i < jitter.ticks; i++)
+        sum += jitter.late[i];
+    printf("%-8s late us: min %.1f avg %.1f p50 %.1f p99 %.1f max %.1f"
+           " | %d busy thread%s\n", name, jitter.late[0] / 1e3,
+           sum / 1e3 / jitter.ticks, jitter.late[jitter.ticks / 2] / 1e3,
+           jitter.late[jitter.ticks * 99 / 100] / 1e3,
+           jitter.late[jitter.ticks - 1] / 1e3, cpus, cpus > 1 ? "s" : "");
+    snprintf(key, sizeof(key), "jitter.%s.p50", name);
+    result(key, "us", jitter.late[jitter.ticks / 2] / 1e3, 1);
+    snprintf(key, sizeof(key), "jitter.%s.p99", name);
+    result(key, "us", jitter.late[jitter.ticks * 99 / 100] / 1e3, 0);
+}
+
+static void bench_jitter(int ticks)
+{
+    struct thread_attr pinned = { .cpus = 1 };
+    struct thread_attr realtime = { .cpus = 1, .policy = SCHED_FIFO,
+                                    .priority = 50, .lock_memory = 1 };
+
+    jitter.ticks = ticks;
+    jitter.late = calloc(ticks, sizeof(*jitter.late));
+    if (!jitter.late) {
+        perror("jitter");
+        exit(1);
+    }
+    jitter_run("default", NULL);
+    jitter_run("pinned", &pinned);
+    /* last, the memory stays locked */
+    jitter_run("fifo", &realtime);
+    free(jitter.late);
+}
+
+/* Thread.run ping-pong: the task is timed and wakes the main thread */
+static struct {
+    volatile int64_t queued_at;
+    int64_t *samples;
+    int i;
+    struct notifier done;
+} run;
+
+static void run_task(void *arg)
+{
+    run.samples[run.i] = now_ns() - run.queued_at;
+    Notifier.signal(&run.done);
+}
+
+static void bench_run(int iterations)
+{
+    ring_p ring = Thread.create(1, NULL);
+
+    run.samples = calloc(iterations, sizeof(*run.samples));
+    if (!ring || !run.samples || Notifier.init(&run.done, 0)) {
+        perror("run");
+        exit(1);
+    }
+    for (run.i = 0; run.i < iterations; run.i++) {
+        run.queued_at = now_ns();
+        if (Thread.run(ring, run_task, NULL)) break;
+        Notifier.wait(&run.done);
+    }
+    Thread.finish(ring);
+    if (!run.i) {
+        fprintf(stderr, "run: Thread.run failed\n");
+        exit(1);
+    }
+    /* the samples taken, if Thread.run failed on the way */
+    samples_report("run", "ns", 1, run.samples, run.i,
+                   " | Thread.run to an idle worker", 1);
+    Notifier.close(&run.done);
+    free(run.samples);
+}
+
+static void bench_create(int iterations, int threads)
+{
+    int64_t *samples = calloc(iterations, sizeof(*samples));
+    char extra[40];
+
+    if (!samples) {
+        perror("create");
+        exit(1);
+    }
+    for (int i = 0; i < iterations; i++) {
+        int64_t start = now_ns();
+        ring_p ring = Thread.create(threads, NULL);
+
+        if (!ring) {
+            fprintf(stderr, "create: the threads did not start\n");
+            exit(1);
+        }
+        Thread.finish(ring);
+        samples[i] = now_ns() - start;
+    }
+    snprintf(extra, sizeof(extra), " | %d thread%s, create + finish",
+             threads, threads > 1 ? "s" : "");
+    samples_report("create", "us", 1e3, samples, iterations, extra, 1);
+    free(samples);
+}
+
+/* the loopback echo of the socket and connect benches */
+static struct {
+    socket_p sock;
+    int fd;
+    struct sockaddr_in addr;
+    pthread_t thread;
+    int stop;
+    char trace[32]; /* the socket events, printed by default, go here */
+} echo;
+
+static void *echo_task(void *arg)
+{
+    char buff[BUF_SIZE];
+    int fds[1];
+    ssize_t len;
+
+    while (!__atomic_load_n(&echo.stop, __ATOMIC_RELAXED)) {
+        if (Socket.wait(echo.sock, fds, 1, 100) <= 0) continue;
+        echo.sock->len = sizeof(echo.sock->claddr);
+        while ((len = Socket.read(echo.sock, echo.fd, buff, BUF_SIZE,
+                          (struct sockaddr *)&echo.sock->claddr)) > 0) {
+            Socket.write(echo.sock, echo.fd, buff, len,
+                         (struct sockaddr *)&echo.sock->claddr);
+            echo.sock->len = sizeof(echo.sock->claddr);
+        }
+    }
+    return NULL;
+}
+
+static void echo_open(void)
+{
+    socklen_t len = sizeof(echo.addr);
+    int fd;
+
+    strcpy(echo.trace, "/tmp/ring-bench-echo.XXXXXX");
+    if ((fd = mkstemp(echo.trace)) < 0 || Trace.open(echo.trace, 0)) {
+        perror("trace");
+        exit(1);
+    }
+    close(fd);
+    echo.addr.sin_family = AF_INET;
+    echo.addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    echo.fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    echo.sock = Socket.init((struct SocketSettings) { .is_udp_server = 1 },
+                            0);
+    if (echo.fd < 0 || !echo.sock ||
+        bind(echo.fd, (struct sockaddr *)&echo.addr, sizeof(echo.addr)) ||
+        getsockname(echo.fd, (struct sockaddr *)&echo.addr, &len) ||
+        Socket.open(echo.sock) || Socket.add(echo.sock, echo.fd, 1)) {
+        perror("echo");
+        exit(1);
+    }
+    echo.stop = 0;
+    pthread_create(&echo.thread, NULL, echo_task, NULL);
+}
+
+static void echo_close(void)
+{
+    __atomic_store_n(&echo.stop, 1, __ATOMIC_RELAXED);
+    pthread_join(echo.thread, NULL);
+    Socket.close(echo.sock, echo.fd);
+    Socket.destroy(echo.sock);
+    Trace.close();
+    unlink(echo.trace);
+}
+
+static void bench_socket(int iterations)
+{
+    int64_t *samples = calloc(iterations, sizeof(*samples));
+    char buff[BUF_SIZE] = "ring", extra[40];
+    socket_p sock;
+    int fd, fds[1], lost = 0;
+
+    echo_open();
+    fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    sock = Socket.init((struct SocketSettings) { 0 }, 0);
+    if (!samples || fd < 0 || !sock ||
+        connect(fd, (struct sockaddr *)&echo.addr, sizeof(echo.addr)) ||
+        Socket.open(sock) || Socket.add(sock, fd, 1)) {
+        perror("socket");
+        exit(1);
+    }
+    sock->len = sizeof(echo.addr);
+    for (int i = 0; i < iterations; i++) {
+        int64_t start = now_ns();
+
+        Socket.write(sock, fd, buff, 32, NULL);
+        for (;;) {
+            if (Socket.wait(sock, fds, 1, 1000) <= 0) {
+                lost++;
+                break;
+            }
+            if (Socket.read(sock, fd, buff, BUF_SIZE, NULL) > 0) break;
+        }
+        samples[i] = now_ns() - start;
+    }
+    snprintf(extra, sizeof(extra), " | 32 byte round trip, %d lost", lost);
+    samples_report("socket", "us", 1e3, samples, iterations, extra, 1);
+    Socket.close(sock, fd);
+    Socket.destroy(sock);
+    echo_close();
+    free(samples);
+}
+
+static void connect_done(socket_p sock, int fd)
+{
+}
+
+static void connect_run(const char *name, int reconnect, int iterations)
+{
+    int64_t *samples = calloc(iterations, sizeof(*samples));
+    socket_p sock = Socket.init((struct SocketSettings) {
+        .port = ntohs(echo.addr.sin_port),
+        .reconnect = reconnect,
+        .on_data = connect_done,
+        }, BUF_SIZE);
+
+    if (!samples || !sock) {
+        perror(name);
+        exit(1);
+    }
+    for (int i = 0; i < iterations; i++) {
+        int64_t start = now_ns();
+
+        if (Socket.connect(sock)) {
+            fprintf(stderr, "%s: connect failed\n", name);
+            exit(1);
+        }
+        samples[i] = now_ns() - start;
+    }
+    samples_report(name, "us", 1e3, samples, iterations,
+                   reconnect ? " | open, connect and close a socket"
+                             : " | reuse the socket, drop stale datagrams",
+                   1);
+    Socket.destroy(sock);
+    free(samples);
+}
+
+static void bench_connect(int iterations)
+{
+    echo_open();
+    connect_run("connect.new", 1, iterations);
+    connect_run("connect.kept", 0, iterations);
+    echo_close();
+}
+
+#define BLINK_HZ 100
+#define BLINK_DUTY 0.25
+
+/* the edges of the blink bench, written by the Pwm engine */
+static struct {
+    int64_t *at;
+    int edges, n;
+    struct notifier done;
+} blink;
+
+static void blink_write(void *arg, int level)
+{
+    if (blink.n < blink.edges) {
+        blink.at[blink.n] = now_ns();
+        __atomic_store_n(&blink.n, blink.n + 1, __ATOMIC_RELEASE);
+    }
+    if (blink.n == blink.edges) Notifier.signal(&blink.done);
+}
+
+static void bench_blink(int edges)
+{
+    void *(*tasks[])(void *) = { Pwm.task };
+    int64_t high_ns = 1e9 / BLINK_HZ * BLINK_DUTY, *error;
+    struct pwm_channel led;
+    int highs = 0;
+    char extra[48];
+    ring_p ring;
+
+    blink.edges = edges + 1; /* the first one rises */
+    blink.n = 0;
+    blink.at = calloc(blink.edges, sizeof(*blink.at));
+    error = calloc(blink.edges, sizeof(*error));
+    if (!blink.at || !error || Notifier.init(&blink.done, 0) ||
+        !(ring = Thread.create(1, tasks))) {
+        perror("blink");
+        exit(1);
+    }
+    Pwm.add(ring, &led, blink_write, NULL);
+    Pwm.set(ring, &led, BLINK_HZ, BLINK_DUTY);
+    while (__atomic_load_n(&blink.n, __ATOMIC_ACQUIRE) < blink.edges)
+        Notifier.wait(&blink.done);
+    Pwm.set(ring, &led, 0, 0);
+    Thread.finish(ring);
+
+    /* the high times, the edges' lateness is in the channel */
+    for (int i = 0; i + 1 < blink.edges; i += 2)
+        error[highs++] = llabs(blink.at[i + 1] - blink.at[i] - high_ns);
+    snprintf(extra, sizeof(extra), " | %d high times of %.1fms",
+             highs, high_ns / 1e6);
+    samples_report("blink.high_error", "us", 1e3, error, highs, extra, 0);
+    result("blink.late.p50", "us",
+           Histogram.percentile(&led.jitter, 50) / 1e3, 0);
+    result("blink.late.p99", "us",
+           Histogram.percentile(&led.jitter, 99) / 1e3, 0);
+    Histogram.print(&led.jitter, "blink edge lateness", "ns", stdout);
+    Notifier.close(&blink.done);
+    free(blink.at);
+    free(error);
+}
+
+static void bench_one(const char *name, int iterations, int threads)
+{
+    if (!strcmp(name, "wakeup")) bench_wakeup(iterations);
+    else if (!strcmp(name, "run")) bench_run(iterations);
+    else if (!strcmp(name, "create")) bench_create(iterations, threads);
+    else if (!strcmp(name, "socket")) bench_socket(iterations);
+    else if (!strcmp(name, "connect")) bench_connect(iterations);
+    else if (!strcmp(name, "blink")) bench_blink(iterations);
+    else if (!strcmp(name, "trace")) bench_trace(iterations);
+    else bench_jitter(iterations);
+    fflush(stdout);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-n iterations] [-t threads] [-r repeats]"
+            " [-j results]\n"
+            "       [-c baseline] [-T percent]\n"
+            "       [all|wakeup|run|create|socket|connect|blink|trace|"
+            "jitter]...\n"
+            "  -n  iterations of every bench named, by default its own\n"
+            "      (jitter: 1ms ticks, blink: edges)\n"
+            "  -t  pool threads of a ring in create (default 4)\n"
+            "  -r  run every bench `repeats` times, keep the best results\n"
+            "  -j  save the results as JSON\n"
+            "  -c  compare the results with a saved run, exit 1 if one is"
+            " worse\n"
+            "  -T  by more than `percent` (default 25), the medians only\n",
+            prog);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt, iterations = 0, threads = 4, repeats = 1, worse;
+    const char *save = NULL, *baseline = NULL;
+    double percent = 25;
+
+    while ((opt = getopt(argc, argv, "n:t:r:j:c:T:h")) != -1) {
+        switch (opt) {
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'r':
+            repeats = atoi(optarg);
+            break;
+        case 'j':
+            save = optarg;
+            break;
+        case 'c':
+            baseline = optarg;
+            break;
+        case 'T':
+            percent = atof(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    /* check the names before running anything */
+    for (int i = optind; i < argc; i++) {
+        int known = !strcmp(argv[i], "all");
+
+        for (int j = 0; j < sizeof(benches) / sizeof(*benches); j++)
+            known |= !strcmp(argv[i], benches[j].name);
+        if (!known) {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind == argc) {
+        for (int k = 0; k < repeats; k++)
+            bench_one("wakeup", iterations > 0 ? iterations : 100000,
+                      threads);
+        benches[bench_of("wakeup")].ran = 1;
+    }
+    for (int i = optind; i < argc; i++)
+        for (int j = 0; j < sizeof(benches) / sizeof(*benches); j++)
+            if (!strcmp(argv[i], "all") ||
+                !strcmp(argv[i], benches[j].name)) {
+                for (int k = 0; k < repeats; k++)
+                    bench_one(benches[j].name, iterations > 0
+                              ? iterations : benches[j].iterations,
+                              threads);
+                benches[j].ran = 1;
+            }
+    if (save && results_write(save)) return 1;
+    if (!baseline) return 0;
+    worse = results_compare(baseline, percent);
+    if (worse < 0) return 1;
+    if (worse)
+        printf("%d result%s worse than %s or missing\n", worse,
+               worse > 1 ? "s" : "", baseline);
+    return worse > 0;
+}
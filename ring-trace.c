@@ -0,0 +1,34 @@
+#include "ring.h"
+
+/*
+ * Render a trace recorded with `test-ring -T file`: the messages the
+ * events stand for, as test-ring would have printed them, or with -r one
+ * line per event with its time, thread, name and arguments.
+ */
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-r] trace\n"
+            "  -r  raw events: seconds since the first, thread, name,"
+            " arguments\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt, raw = 0;
+
+    while ((opt = getopt(argc, argv, "rh")) != -1) {
+        switch (opt) {
+        case 'r':
+            raw = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    return Trace.decode(argv[optind], stdout, raw) < 0;
+}
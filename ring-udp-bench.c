@@ -0,0 +1,614 @@
+#include <sys/timerfd.h>
+#include <time.h>
+#include "ring.h"
+
+/*
+ * UDP load generator for ring-udp-echo
+ *
+ * Every thread owns a share of the source sockets, each one connect()ed
+ * to the server and watched by the thread's Socket wait set, and a share
+ * of the offered rate.
+ *
+ * open:   a sender thread writes the datagrams on a fixed schedule,
+ *         sleeping until the next one is due with clock_nanosleep
+ *         (TIMER_ABSTIME), whatever the echoes do; a receiver thread
+ *         reads the echoes. A sender that falls behind sends what is due
+ *         at once and keeps the schedule.
+ * closed: one thread keeps one datagram in flight per socket and sends
+ *         the next after its echo, or after a second without one, as
+ *         fast as it can or at most at the offered rate, waking on a
+ *         timerfd for the sends that are due.
+ *
+ * A datagram carries its sequence number, the time the schedule wanted
+ * it sent and the time it was. The latency from the send is what the
+ * server costs; the latency from the intended send also counts the time
+ * a datagram waited behind a slow one, so a server stall shows in every
+ * datagram it delayed rather than only in the few that were in flight
+ * (coordinated omission). In closed loop without a rate both are the
+ * same. The echoes that come back within a second of the end are
+ * counted, the rest of what was sent is lost.
+ */
+#define PROBE_MAGIC 0x72696e67
+/* echoes still counted after the end, and the closed loop timeout */
+#define GRACE_MS 1000
+
+struct probe {
+    uint32_t seq; /* per thread */
+    uint32_t check; /* a hash of the rest, tells a corrupt echo */
+    int64_t intended_ns; /* when the schedule wanted it sent */
+    int64_t sent_ns; /* when it was */
+};
+
+/* closed loop: the datagram in flight on a socket */
+struct flight {
+    int64_t next_ns; /* the intended time of the next one */
+    int64_t sent_ns; /* 0 if none in flight */
+    uint32_t seq;
+};
+
+struct worker {
+    int id;
+    socket_p sock; /* the wait set of the sockets */
+    int *fds;
+    int nfds;
+    int timer; /* closed loop: the timerfd of the next send */
+    struct flight *flights;
+    int64_t interval_ns; /* between sends of the thread, 0 unpaced */
+    pthread_t sender, receiver;
+    /* written by the sender, read by the reports */
+    uint32_t sent;
+    uint64_t unsent; /* the socket buffer was full */
+    /* written by the receiver */
+    uint64_t received, duplicates, corrupt, errors;
+    uint8_t *seen; /* a bit per sequence number, grows in closed loop */
+    size_t seen_bits;
+    struct histogram latency, corrected;
+};
+
+static struct {
+    const char *host;
+    int port;
+    double rate; /* datagrams per second, over all threads */
+    int sockets, threads;
+    int payload;
+    int duration; /* seconds */
+    int closed;
+    int64_t start_ns, end_ns;
+    int stop; /* the receivers leave */
+    char *buff; /* the payload sent, the probe is copied in front */
+} bench = {
+    .host = "localhost",
+    .port = 13469,
+    .rate = 10000,
+    .sockets = 1,
+    .threads = 1,
+    .payload = sizeof(struct probe),
+    .duration = 10,
+};
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void sleep_until(int64_t ns)
+{
+    struct timespec deadline = {
+        .tv_sec = ns / 1000000000,
+        .tv_nsec = ns % 1000000000,
+    };
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+                           &deadline, NULL) == EINTR);
+}
+
+static uint32_t probe_check(const struct probe *p)
+{
+    uint64_t h = p->seq * 0x9e3779b97f4a7c15ULL;
+
+    h ^= p->intended_ns + (h << 6) + (h >> 2);
+    h ^= p->sent_ns + (h << 6) + (h >> 2);
+    return (uint32_t)(h ^ h >> 32) ^ PROBE_MAGIC;
+}
+
+/*
+ * send probe `seq` on the socket `fd`, intended at `intended_ns` or now
+ * if 0, return -1 if it was not sent
+ */
+static int probe_send(struct worker *w, int fd, uint32_t seq,
+                      int64_t intended_ns)
+{
+    char buff[BUF_SIZE];
+    struct probe p = { .seq = seq, .sent_ns = now_ns() };
+
+    p.intended_ns = intended_ns ? intended_ns : p.sent_ns;
+    p.check = probe_check(&p);
+    memcpy(buff, &p, sizeof(p));
+    memcpy(buff + sizeof(p), bench.buff, bench.payload - sizeof(p));
+    if (Socket.write(w->sock, fd, buff, bench.payload, NULL) < 0) {
+        w->unsent++;
+        return -1;
+    }
+    return 0;
+}
+
+/* set the bit of `seq`, return its previous value */
+static int seen_set(struct worker *w, uint32_t seq)
+{
+    uint8_t bit = 1 << (seq & 7), old;
+
+    if (seq >= w->seen_bits) {
+        size_t bits = w->seen_bits ? w->seen_bits : 1 << 16;
+        uint8_t *seen;
+
+        while (bits <= seq) bits *= 2;
+        if (!(seen = realloc(w->seen, bits / 8))) return 0;
+        memset(seen + w->seen_bits / 8, 0, (bits - w->seen_bits) / 8);
+        w->seen = seen;
+        w->seen_bits = bits;
+    }
+    old = w->seen[seq / 8] & bit;
+    w->seen[seq / 8] |= bit;
+    return old != 0;
+}
+
+/*
+ * account an echo, return its sequence number, -1 if it is corrupt or
+ * -2 if it is a duplicate
+ */
+static int64_t probe_echoed(struct worker *w, const void *data, size_t len,
+                            int64_t now)
+{
+    struct probe p;
+
+    if (len != bench.payload) {
+        w->corrupt++;
+        return -1;
+    }
+    memcpy(&p, data, sizeof(p));
+    /* an echo may beat the sender's count, bound it by the schedule */
+    if (p.check != probe_check(&p) ||
+        (!bench.closed && p.seq >= w->seen_bits)) {
+        w->corrupt++;
+        return -1;
+    }
+    if (seen_set(w, p.seq)) {
+        w->duplicates++;
+        return -2;
+    }
+    __atomic_store_n(&w->received, w->received + 1, __ATOMIC_RELAXED);
+    Histogram.record(&w->latency, (now - p.sent_ns) / 1000);
+    Histogram.record(&w->corrected, (now - p.intended_ns) / 1000);
+    return p.seq;
+}
+
+/*
+ * read every echo queued on `fd`, call `done` with the valid ones and
+ * with a sequence number of -1 for the corrupt ones
+ */
+static void read_echoes(struct worker *w, int fd,
+                        void (*done)(struct worker *, int fd, int64_t seq))
+{
+    char buffs[SOCKET_BATCH][BUF_SIZE];
+    struct iovec iov[SOCKET_BATCH];
+    int n;
+
+    for (;;) {
+        for (int i = 0; i < SOCKET_BATCH; i++) {
+            iov[i].iov_base = buffs[i];
+            iov[i].iov_len = BUF_SIZE;
+        }
+        n = Socket.read_batch(w->sock, fd, iov, NULL, SOCKET_BATCH);
+        if (n < 0) w->errors++; /* e.g. refused, no server */
+        if (n <= 0) return;
+        int64_t now = now_ns();
+        for (int i = 0; i < n; i++) {
+            int64_t seq = probe_echoed(w, iov[i].iov_base, iov[i].iov_len,
+                                       now);
+            if (seq >= -1 && done) done(w, fd, seq);
+        }
+    }
+}
+
+static void *open_sender(void *arg)
+{
+    struct worker *w = arg;
+    /* the threads take turns on the schedule */
+    int64_t next = bench.start_ns + w->interval_ns * w->id / bench.threads;
+    uint32_t seq = 0;
+
+    Stats.name("sender");
+    while (next < bench.end_ns) {
+        int64_t now = now_ns();
+
+        if (next > now) {
+            Stats.idle_begin();
+            sleep_until(next);
+            Stats.idle_end();
+            now = now_ns();
+        }
+        /* a late sender catches up, the intended times stay */
+        for (; next <= now && next < bench.end_ns; next += w->interval_ns) {
+            if (!probe_send(w, w->fds[seq % w->nfds], seq, next))
+                __atomic_store_n(&w->sent, ++seq, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+static void *open_receiver(void *arg)
+{
+    struct worker *w = arg;
+    int fds[MAX_EVENTS], n;
+
+    Stats.name("receiver");
+    while (!__atomic_load_n(&bench.stop, __ATOMIC_RELAXED)) {
+        n = Socket.wait(w->sock, fds, MAX_EVENTS, 100);
+        for (int i = 0; i < n; i++)
+            read_echoes(w, fds[i], NULL);
+    }
+    return NULL;
+}
+
+static struct flight *flight_of(struct worker *w, int fd)
+{
+    for (int i = 0; i < w->nfds; i++)
+        if (w->fds[i] == fd) return w->flights + i;
+    return NULL;
+}
+
+/*
+ * closed loop: the socket is free once the echo in flight is back; on a
+ * connected socket a corrupt echo answers the probe in flight as well
+ */
+static void closed_done(struct worker *w, int fd, int64_t seq)
+{
+    struct flight *f = flight_of(w, fd);
+
+    if (f && f->sent_ns && (seq < 0 || f->seq == seq)) f->sent_ns = 0;
+}
+
+static void *closed_loop(void *arg)
+{
+    struct worker *w = arg;
+    int64_t socket_interval = w->interval_ns * w->nfds, armed = -1;
+    int fds[MAX_EVENTS], n;
+
+    Stats.name("closed");
+    for (int i = 0; i < w->nfds; i++)
+        w->flights[i].next_ns = bench.start_ns +
+                                socket_interval * i / w->nfds +
+                                w->interval_ns * w->id / bench.threads;
+    sleep_until(bench.start_ns);
+    for (;;) {
+        int64_t now = now_ns(), wake = -1;
+        int sending = 0;
+
+        for (int i = 0; i < w->nfds; i++) {
+            struct flight *f = w->flights + i;
+
+            /* no echo within the grace, the next one goes */
+            if (f->sent_ns && now - f->sent_ns >= GRACE_MS * 1000000LL)
+                f->sent_ns = 0;
+            if (!f->sent_ns && now < bench.end_ns &&
+                (!socket_interval || f->next_ns <= now)) {
+                if (!probe_send(w, w->fds[i], w->sent,
+                                socket_interval ? f->next_ns : 0)) {
+                    f->seq = w->sent;
+                    f->sent_ns = now;
+                    __atomic_store_n(&w->sent, w->sent + 1,
+                                     __ATOMIC_RELAXED);
+                }
+                f->next_ns += socket_interval;
+            }
+            if (f->sent_ns) {
+                sending = 1;
+                if (wake < 0 || f->sent_ns + GRACE_MS * 1000000LL < wake)
+                    wake = f->sent_ns + GRACE_MS * 1000000LL;
+            } else if (socket_interval && now < bench.end_ns &&
+                       (wake < 0 || f->next_ns < wake)) {
+                wake = f->next_ns;
+            }
+        }
+        if (now >= bench.end_ns && !sending) break;
+        if (now >= bench.end_ns + GRACE_MS * 1000000LL) break;
+        /* the wait counts in ms, the timerfd keeps the sends on time */
+        if (wake > now && wake != armed) {
+            struct itimerspec its = {
+                .it_value.tv_sec = wake / 1000000000,
+                .it_value.tv_nsec = wake % 1000000000,
+            };
+            timerfd_settime(w->timer, TFD_TIMER_ABSTIME, &its, NULL);
+            armed = wake;
+        }
+        /* nothing to wait for when the socket buffers were full */
+        n = Socket.wait(w->sock, fds, MAX_EVENTS, wake < 0 ? 1
+                                                  : wake > now ? -1 : 0);
+        for (int i = 0; i < n; i++) {
+            if (fds[i] == w->timer) {
+                uint64_t expirations;
+                if (read(w->timer, &expirations, sizeof(expirations)) < 0 &&
+                    errno != EAGAIN)
+                    perror("timerfd read");
+                continue;
+            }
+            read_echoes(w, fds[i], closed_done);
+        }
+    }
+    return NULL;
+}
+
+/* the server's address, the local host if it does not resolve */
+static void bench_resolve(struct sockaddr_storage *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    if (Resolver.lookup(bench.host, bench.port, addr, 1000)) {
+        struct sockaddr_in *in = (struct sockaddr_in *)addr;
+
+        fprintf(stderr, "%s: not resolved, using the local host\n",
+                bench.host);
+        in->sin_family = AF_INET;
+        in->sin_port = htons(bench.port);
+        in->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    }
+}
+
+static int worker_open(struct worker *w, int id,
+                       const struct sockaddr_storage *addr)
+{
+    socklen_t len = addr->ss_family == AF_INET6 ? sizeof(struct sockaddr_in6)
+                                                : sizeof(struct sockaddr_in);
+
+    w->id = id;
+    /* the sockets are dealt round robin */
+    w->nfds = bench.sockets / bench.threads +
+              (id < bench.sockets % bench.threads);
+    w->fds = calloc(w->nfds, sizeof(*w->fds));
+    w->flights = calloc(w->nfds, sizeof(*w->flights));
+    w->interval_ns = bench.rate > 0 ? 1e9 * bench.threads / bench.rate : 0;
+    Histogram.init(&w->latency);
+    Histogram.init(&w->corrected);
+    if (!bench.closed) {
+        /* the sender never goes past the schedule, the bitmap is fixed */
+        w->seen_bits = ((size_t)(bench.duration * 1e9 / w->interval_ns) + 8)
+                       & ~(size_t)7;
+        w->seen = calloc(w->seen_bits / 8, 1);
+    }
+    w->sock = Socket.init((struct SocketSettings) {
+        .service = "echo",
+        .port = bench.port,
+        .host = (char *)bench.host,
+        }, 0);
+    if (!w->fds || !w->flights || (!bench.closed && !w->seen) || !w->sock ||
+        Socket.open(w->sock))
+        return -1;
+    w->sock->len = len;
+    for (int i = 0; i < w->nfds; i++) {
+        int fd = socket(addr->ss_family, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+
+        if (fd < 0 || connect(fd, (const struct sockaddr *)addr, len) < 0) {
+            perror("socket");
+            if (fd >= 0) close(fd);
+            return -1;
+        }
+        w->fds[i] = fd;
+        if (Socket.add(w->sock, fd, 1)) return -1;
+    }
+    if (bench.closed &&
+        ((w->timer = timerfd_create(CLOCK_MONOTONIC,
+                                    TFD_NONBLOCK | TFD_CLOEXEC)) < 0 ||
+         Socket.add(w->sock, w->timer, 0))) {
+        perror("timerfd");
+        return -1;
+    }
+    return 0;
+}
+
+static void worker_close(struct worker *w)
+{
+    for (int i = 0; i < w->nfds; i++)
+        if (w->fds[i] > 0) close(w->fds[i]);
+    if (w->timer > 0) close(w->timer);
+    if (w->sock) {
+        w->sock->backend->close(w->sock);
+        Socket.destroy(w->sock);
+    }
+    free(w->fds);
+    free(w->flights);
+    free(w->seen);
+}
+
+static void bench_totals(struct worker *workers, uint64_t *sent,
+                         uint64_t *received)
+{
+    *sent = *received = 0;
+    for (int i = 0; i < bench.threads; i++) {
+        *sent += __atomic_load_n(&workers[i].sent, __ATOMIC_RELAXED);
+        *received += __atomic_load_n(&workers[i].received, __ATOMIC_RELAXED);
+    }
+}
+
+static void bench_report(struct worker *workers, int verbose)
+{
+    struct histogram latency, corrected;
+    uint64_t sent, received, unsent = 0, duplicates = 0, corrupt = 0;
+    uint64_t errors = 0, lost;
+
+    Histogram.init(&latency);
+    Histogram.init(&corrected);
+    bench_totals(workers, &sent, &received);
+    for (int i = 0; i < bench.threads; i++) {
+        struct worker *w = workers + i;
+
+        unsent += w->unsent;
+        duplicates += w->duplicates;
+        corrupt += w->corrupt;
+        errors += w->errors;
+        Histogram.merge(&latency, &w->latency);
+        Histogram.merge(&corrected, &w->corrected);
+    }
+    lost = sent - received;
+    printf("sent %lu (%.0f pps), not sent %lu (socket buffer full)\n",
+           (unsigned long)sent, (double)sent / bench.duration,
+           (unsigned long)unsent);
+    printf("received %lu (%.0f pps), lost %lu (%.3f%%), duplicates %lu,"
+           " corrupt %lu, errors %lu\n",
+           (unsigned long)received, (double)received / bench.duration,
+           (unsigned long)lost, sent ? 100.0 * lost / sent : 0.0,
+           (unsigned long)duplicates, (unsigned long)corrupt,
+           (unsigned long)errors);
+    Histogram.print(&latency, "latency from the send", "us", stdout);
+    Histogram.print(&corrected, "latency from the intended send", "us",
+                    stdout);
+    if (verbose) {
+        struct stats_snapshot *snap = malloc(sizeof(*snap));
+
+        if (!snap) return;
+        Stats.snapshot(snap);
+        Stats.dump(snap, stdout, 0);
+        free(snap);
+    }
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-H host] [-p port] [-r pps] [-c sockets]"
+            " [-t threads] [-l bytes]\n"
+            "       [-d seconds] [-m open|closed] [-s]\n"
+            "  -H  the echo server (default %s), -p its port (default %d)\n"
+            "  -r  datagrams per second offered (default %.0f), 0 in closed"
+            " loop is\n"
+            "      as fast as the echoes come back\n"
+            "  -c  source sockets (default %d), -t threads sharing them"
+            " (default %d)\n"
+            "  -l  datagram size (default and minimum %zu, max %d)\n"
+            "  -d  seconds of load (default %d)\n"
+            "  -m  open loop (default, a fixed schedule) or closed loop (one"
+            " datagram\n"
+            "      in flight per socket)\n"
+            "  -s  print the Stats counters at the end\n",
+            prog, bench.host, bench.port, bench.rate, bench.sockets,
+            bench.threads, sizeof(struct probe), BUF_SIZE, bench.duration);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt, verbose = 0, elapsed = 0;
+    struct sockaddr_storage addr;
+    struct worker *workers;
+    uint64_t sent, received, last_sent = 0, last_received = 0;
+    char name[INET6_ADDRSTRLEN] = "?";
+
+    while ((opt = getopt(argc, argv, "H:p:r:c:t:l:d:m:sh")) != -1) {
+        switch (opt) {
+        case 'H':
+            bench.host = optarg;
+            break;
+        case 'p':
+            bench.port = atoi(optarg);
+            break;
+        case 'r':
+            bench.rate = atof(optarg);
+            break;
+        case 'c':
+            bench.sockets = atoi(optarg);
+            break;
+        case 't':
+            bench.threads = atoi(optarg);
+            break;
+        case 'l':
+            bench.payload = atoi(optarg);
+            break;
+        case 'd':
+            bench.duration = atoi(optarg);
+            break;
+        case 'm':
+            bench.closed = !strcmp(optarg, "closed");
+            if (!bench.closed && strcmp(optarg, "open")) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 's':
+            verbose = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (bench.payload < (int)sizeof(struct probe))
+        bench.payload = sizeof(struct probe);
+    if (bench.payload > BUF_SIZE) bench.payload = BUF_SIZE;
+    if (bench.sockets < 1) bench.sockets = 1;
+    if (bench.threads < 1) bench.threads = 1;
+    if (bench.threads > bench.sockets) bench.threads = bench.sockets;
+    if (bench.duration < 1) bench.duration = 1;
+    if ((bench.rate <= 0 && !bench.closed) || bench.rate < 0) {
+        fprintf(stderr, "an open loop needs a rate\n");
+        return 1;
+    }
+    if (!(bench.buff = calloc(1, BUF_SIZE)) ||
+        !(workers = calloc(bench.threads, sizeof(*workers)))) {
+        perror("calloc");
+        return 1;
+    }
+    for (int i = 0; i < bench.payload; i++)
+        bench.buff[i] = 'a' + i % 26;
+
+    bench_resolve(&addr);
+    getnameinfo((struct sockaddr *)&addr, sizeof(addr), name, sizeof(name),
+                NULL, 0, NI_NUMERICHOST);
+    for (int i = 0; i < bench.threads; i++)
+        if (worker_open(workers + i, i, &addr)) {
+            fprintf(stderr, "can not open the sockets of thread %d\n", i);
+            return 1;
+        }
+    printf("%s:%d, %s loop", name, bench.port,
+           bench.closed ? "closed" : "open");
+    if (bench.rate > 0) printf(" at %.0f pps", bench.rate);
+    printf(" for %ds, %d socket%s on %d thread%s, %d byte datagrams\n",
+           bench.duration, bench.sockets, bench.sockets > 1 ? "s" : "",
+           bench.threads, bench.threads > 1 ? "s" : "", bench.payload);
+    fflush(stdout);
+
+    bench.start_ns = now_ns() + 10000000;
+    bench.end_ns = bench.start_ns + bench.duration * 1000000000LL;
+    for (int i = 0; i < bench.threads; i++) {
+        struct worker *w = workers + i;
+
+        if (bench.closed) {
+            pthread_create(&w->sender, NULL, closed_loop, w);
+        } else {
+            pthread_create(&w->sender, NULL, open_sender, w);
+            pthread_create(&w->receiver, NULL, open_receiver, w);
+        }
+    }
+
+    /* a line per second, then the echoes of the grace period */
+    while (elapsed < bench.duration) {
+        sleep_until(bench.start_ns + ++elapsed * 1000000000LL);
+        bench_totals(workers, &sent, &received);
+        printf("%3ds: sent %lu pps, received %lu pps\n", elapsed,
+               (unsigned long)(sent - last_sent),
+               (unsigned long)(received - last_received));
+        fflush(stdout);
+        last_sent = sent;
+        last_received = received;
+    }
+    sleep_until(bench.end_ns + GRACE_MS * 1000000LL);
+    __atomic_store_n(&bench.stop, 1, __ATOMIC_RELAXED);
+    for (int i = 0; i < bench.threads; i++) {
+        pthread_join(workers[i].sender, NULL);
+        if (!bench.closed) pthread_join(workers[i].receiver, NULL);
+    }
+
+    bench_report(workers, verbose);
+    for (int i = 0; i < bench.threads; i++)
+        worker_close(workers + i);
+    free(workers);
+    free(bench.buff);
+    return 0;
+}
@@ -1,41 +1,237 @@
-#include "ring.h"
-                            
-/* simple echo, the main callback */
-static void on_data(socket_p socket, int srvfd)
-{
-	ssize_t num_read;
-    char buff[BUF_SIZE];
-    int event_counter = 0;
-    /* Receive datagrams and return copies to senders */
-    socket->len = sizeof(struct sockaddr_storage);
-    while ((num_read = Socket.read(socket, srvfd, buff, BUF_SIZE,
-                       (struct sockaddr *)&socket->claddr)) > 0) {
-    	if(event_counter % 20 == 3)
-    	    usleep(600000); /* Triger event of timeout*/
-    	if(event_counter % 20 == 6)
-    	    buff[0] += 1; /* Triger event of error data*/
-    	    
-    	/* since the data is stack allocated, we'll write a copy */
-            Socket.write(socket, srvfd, buff, num_read, 
-                        (struct sockaddr *)&socket->claddr);
-        
-    	if (!memcmp(buff, "bye", 3)) {
-            /* close the connection automatically AFTER buffer was sent */
-            Socket.close(socket, srvfd);
-        }
-        socket->len = sizeof(struct sockaddr_storage);
-        event_counter++;
-    }
-}
-
-int main()
-{
-    printf("Simple UDP Echo Server on \"test.ring.com\" port 13469\n");
-    /* create the echo protocol object with the settings we provide.*/
-	Socket.start_server((struct SocketSettings) {
-	    .is_udp_server = 1, 
-	    .service = "echo",
-	    .port = 13469,
-	    .on_data = on_data,
-	    });
-}
\ No newline at end of file
+#include <time.h>
+#include "ring.h"
+
+/* the state of every peer, per worker as SO_REUSEPORT shards by peer */
+static __thread sessions_p sessions;
+/* fault cadence of the peers left without a session (table full) */
+static __thread int event_counter = 0;
+/* the fault injector of this worker and the socket it replies on */
+static __thread faults_p faults;
+static __thread int server_fd;
+static struct fault_plan plan;
+/* datagrams per recvmmsg()/sendmmsg(), 0 for one syscall per datagram */
+static int batch = 0;
+/* peers kept per worker, and the seconds before an idle one is evicted */
+static int max_peers = 65536;
+static int idle_seconds = 60;
+
+static uint32_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * open the session table and the fault injector of this worker, whose
+ * timerfd joins the wait set, and report the memory reserved up front,
+ * once for all workers
+ */
+static void on_open(socket_p socket, int srvfd)
+{
+    static int reported;
+
+    if (!(sessions = Sessions.create(max_peers, idle_seconds * 1000)))
+        fprintf(stderr, "session table of %d peers: out of memory\n",
+                max_peers);
+    server_fd = srvfd;
+    if ((faults = Faults.create(&plan)) &&
+        Socket.add(socket, Faults.fd(faults), 0)) {
+        Faults.destroy(faults);
+        faults = NULL;
+    }
+    if (__atomic_exchange_n(&reported, 1, __ATOMIC_RELAXED)) return;
+    printf("memory: %zu KB reserved up front, %d packet buffers of %zu bytes"
+           " and %zu KB of sessions for %d peers per worker\n",
+           Arena.reserved(socket->arena) / 1024,
+           socket->settings->buffers, Buffers.size(socket->buffers),
+           Sessions.footprint(max_peers) / 1024, max_peers);
+    fflush(stdout);
+}
+
+/*
+ * Account a datagram of `len` bytes from `addr` to its session and return
+ * its index in the peer's stream, which drives the fault schedules.
+ */
+static int on_packet(const struct sockaddr *addr, const char *buff,
+                     ssize_t len, uint32_t now)
+{
+    struct session *s = sessions ? Sessions.lookup(sessions, addr, now)
+                                 : NULL;
+
+    if (!s) return event_counter++;
+    if (len >= 2) memcpy(&s->last_counter, buff, 2);
+    s->bytes += len;
+    return s->packets++;
+}
+
+/* simple echo, the main callback */
+static void on_data(socket_p socket, int srvfd)
+{
+	ssize_t num_read;
+    char *buff;
+    uint32_t now = now_ms();
+    int n;
+
+    if (faults && srvfd == Faults.fd(faults)) {
+        Faults.dispatch(faults, socket, server_fd);
+        return;
+    }
+    if (!(buff = Buffers.get(socket->buffers))) return;
+    /* Receive datagrams and return copies to senders */
+    socket->len = sizeof(struct sockaddr_storage);
+    while ((num_read = Socket.read(socket, srvfd, buff, BUF_SIZE,
+                       (struct sockaddr *)&socket->claddr)) > 0) {
+        n = on_packet((struct sockaddr *)&socket->claddr, buff, num_read,
+                      now);
+    	/* Triger events of timeout and error data, see Faults.plan */
+    	if (!faults || Faults.filter(faults, n, buff, num_read,
+    	                             (struct sockaddr *)&socket->claddr))
+            Socket.write(socket, srvfd, buff, num_read, 
+                        (struct sockaddr *)&socket->claddr);
+        
+    	if (!memcmp(buff, "bye", 3)) {
+            /* close the connection automatically AFTER buffer was sent */
+            Socket.close(socket, srvfd);
+        }
+        socket->len = sizeof(struct sockaddr_storage);
+    }
+    Buffers.put(socket->buffers, buff);
+}
+
+/*
+ * batched echo: read a burst with one recvmmsg(), apply the same faults
+ * per datagram and flush the replies left with one sendmmsg()
+ */
+static void on_data_batch(socket_p socket, int srvfd)
+{
+    struct iovec iov[SOCKET_BATCH], out[SOCKET_BATCH];
+    struct sockaddr_storage addrs[SOCKET_BATCH];
+    int num_read, count, sent, bye = 0;
+    uint32_t now = now_ms();
+
+    if (faults && srvfd == Faults.fd(faults)) {
+        Faults.dispatch(faults, socket, server_fd);
+        return;
+    }
+    count = Buffers.get_batch(socket->buffers, iov, batch);
+    for (;;) {
+        for (int i = 0; i < count; i++)
+            iov[i].iov_len = Buffers.size(socket->buffers);
+        num_read = Socket.read_batch(socket, srvfd, iov, addrs, count);
+        if (num_read <= 0)
+            break;
+        /* compact the replies to send now to the front of the burst */
+        for (int i = sent = 0; i < num_read; i++) {
+            int n = on_packet((struct sockaddr *)&addrs[i], iov[i].iov_base,
+                              iov[i].iov_len, now);
+            if (!memcmp(iov[i].iov_base, "bye", 3)) bye = 1;
+            if (faults && !Faults.filter(faults, n, iov[i].iov_base,
+                                         iov[i].iov_len,
+                                         (struct sockaddr *)&addrs[i]))
+                continue;
+            out[sent] = iov[i];
+            addrs[sent++] = addrs[i];
+        }
+        if (sent) Socket.write_batch(socket, srvfd, out, addrs, sent);
+        /* close the connection AFTER the burst was sent, as on_data does */
+        if (bye) {
+            Socket.close(socket, srvfd);
+            break;
+        }
+    }
+    Buffers.put_batch(socket->buffers, iov, count);
+}
+
+/* print a JSON line with the Stats counters every `interval` seconds */
+static void *stats_task(void *arg)
+{
+    int interval = *(int *)arg;
+    struct stats_snapshot *snap = malloc(sizeof(*snap));
+
+    if (!snap) return NULL;
+    for (;;) {
+        sleep(interval);
+        Stats.snapshot(snap);
+        Stats.dump(snap, stdout, 1);
+        fflush(stdout);
+    }
+    return NULL;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-u] [-w workers] [-b batch] [-s interval]"
+            " [-p peers] [-i idle] [-f faults]\n"
+            "  -u  use the io_uring backend (default epoll)\n"
+            "  -w  number of SO_REUSEPORT worker threads (default 1)\n"
+            "  -b  echo in bursts of up to `batch` datagrams (max %d)\n"
+            "  -s  dump the stats as JSON every `interval` seconds\n"
+            "  -p  sessions kept per worker (default %d)\n"
+            "  -i  evict the sessions idle for `idle` seconds (default %d)\n"
+            "  -f  faults injected per client: none, classic (default,"
+            " delay reply 3\n"
+            "      and corrupt reply 6 of every 20) or a list of"
+            " drop|delay|reorder|dup|\n"
+            "      corrupt=probability or =every:at, delay_ms=, reorder_ms=,"
+            " queue=, seed=\n",
+            prog, SOCKET_BATCH, max_peers, idle_seconds);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt, workers = 1, interval = 0;
+    const char *spec = "classic";
+    const struct socket_backend *backend = &EpollBackend;
+    pthread_t stats;
+
+    while ((opt = getopt(argc, argv, "uw:b:s:p:i:f:h")) != -1) {
+        switch (opt) {
+        case 'u':
+            backend = &UringBackend;
+            break;
+        case 'w':
+            workers = atoi(optarg);
+            break;
+        case 'b':
+            batch = atoi(optarg);
+            if (batch > SOCKET_BATCH) batch = SOCKET_BATCH;
+            break;
+        case 's':
+            interval = atoi(optarg);
+            break;
+        case 'p':
+            max_peers = atoi(optarg);
+            break;
+        case 'i':
+            idle_seconds = atoi(optarg);
+            break;
+        case 'f':
+            spec = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (Faults.plan(&plan, spec)) {
+        fprintf(stderr, "invalid faults: %s\n", spec);
+        usage(argv[0]);
+        return 1;
+    }
+    printf("Simple UDP Echo Server on \"test.ring.com\" port 13469"
+           " (%d worker%s, %s)\n", workers, workers > 1 ? "s" : "",
+           backend->name);
+    if (interval > 0 && !pthread_create(&stats, NULL, stats_task, &interval))
+        pthread_detach(stats);
+    /* create the echo protocol object with the settings we provide.*/
+	return Socket.start_server((struct SocketSettings) {
+	    .is_udp_server = 1, 
+	    .service = "echo",
+	    .port = 13469,
+	    .workers = workers,
+	    .backend = backend,
+	    .on_open = on_open,
+	    .on_data = batch > 0 ? on_data_batch : on_data,
+	    }) ? 1 : 0;
+}
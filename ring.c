@@ -1,355 +1,1256 @@
-#include <netinet/in.h>
-#include <arpa/inet.h>
-#include <fcntl.h>
-#include "ring.h"
-
-int init_pipe(pipe_p _pipe); 
-
-static int bind_server_socket(struct SocketSettings *setting)
-{
-    int srvfd;
-    /* setup the address */
-    struct addrinfo hints;
-    struct sockaddr_in addr; /* address of this service */
-    
-    memset(&hints, 0, sizeof hints);
-    hints.ai_family = AF_INET;  /* Allows IPv4 or IPv6 */
-    hints.ai_socktype = SOCK_DGRAM;  /* UDP stream sockets */
-
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    addr.sin_port = htons(setting->port);
-     
-    srvfd = socket(hints.ai_family, hints.ai_socktype, 0);
-    if (srvfd <= 0) {
-        perror("socket error");
-        return -1;
-    }
-    
-    /* prevent address from being taken */
-    {
-        int optval = 1;
-        setsockopt(srvfd, SOL_SOCKET, SO_REUSEADDR,
-                   &optval, sizeof(optval));
-    }
-    
-    /* bind() failed: close this socket*/
-    if (bind(srvfd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
-        close(srvfd);
-        return -1;
-    }
-    
-    return srvfd;
-}
-
-
-
-static int start_server(struct SocketSettings settings)
-{
-    socket_p socket = malloc(sizeof(*socket));
-    /* bind the server's socket - if relevant */
-    int srvfd = 0;
-    if (!settings.port)
-        settings.port = 8080;
-    srvfd = bind_server_socket(&settings);
-    /* if we did not get a socket, quit now. */
-    if (srvfd < 0) return -1;
-    if(settings.on_data)
-        settings.on_data(socket, srvfd);
-    free(socket);
-    return 0;
-}
-
-static ssize_t socket_read(socket_p socket, int fd, void *buffer,
-               size_t max_len, struct sockaddr *addr)
-{
-    ssize_t num_read;
-
-    num_read = recvfrom(fd, buffer, max_len, 0, addr, &socket->len);
-    
-    if (num_read > 0) {
-    	/* return data */
-        return num_read;
-    } else {
-        if (num_read && (errno & (EWOULDBLOCK | EAGAIN)))
-            return 0;    	
-    }
-    return -1;
-    
-}
-
-static ssize_t socket_write(socket_p socket, int fd, void *data,
-               size_t data_len, struct sockaddr *addr)
-{
-	/* make sure the socket is alive */
-	if(!fd)	return -1;
-	
-	ssize_t write = 0;
-    if ((write = sendto(fd, (char *)data, data_len, 0, 
-    	         addr, socket->len)) < 0) {
-    	return -1;
-	} 
-	return write;
-}
-
-static int socket_close(socket_p socket, int fd)
-{
-    if(epoll_ctl(socket->epfd, EPOLL_CTL_DEL, fd, &socket->event) == -1)
-        perror("epoll_ctl");
-	close(fd);
-	close(socket->epfd);
-	printf("Close Socket\n");
-	return 0;
-}
-
-static socket_p socket_init(struct SocketSettings settings, int buf_len)
-{
-	socket_p socket = malloc(sizeof(*socket) + buf_len * sizeof(int));
-	struct SocketSettings *setting = malloc(sizeof(*setting));
-	memcpy(setting, &settings, sizeof(*setting));
-    socket->settings = setting;
-    if(init_pipe(&socket->pipe)) {
-        free(socket);
-        free(setting);
-        return NULL;
-    }
-    return socket;
-}
-
-static int connect_server(socket_p sock)
-{
-    int clfd;     /* fd into transport provider */
-    
-    struct sockaddr_in addr;   /* address that client uses */
-
-    /*
-     *  Get a socket into UDP
-     */
-    if ((clfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
-        perror ("socket failed!");
-        return -1;
-    }
-    printf("Open Socket\n");
-    /*
-     * Bind to an arbitrary return address.
-     */
-     
-    bzero((char *)&addr, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    addr.sin_port = htons(0);
-    if (bind(clfd, (struct sockaddr *)&addr, sizeof(addr)) <0) {
-        perror("bind failed!");
-        return -1;
-    }
-    
-    /*
-     * Fill in the server's UDP/IP address
-     */
-    bzero((char *)&sock->servaddr, sizeof(sock->servaddr));
-    sock->servaddr.sin_family = AF_INET;
-    sock->servaddr.sin_port = htons(sock->settings->port);
-	if(sock->settings->on_open)
-        sock->settings->on_open(sock, clfd);
- 	if(sock->settings->on_data) 
-       sock->settings->on_data(sock, clfd);
-    
-    socket_close(sock, clfd);
-    
-    return 0;
-}
-
-/* Socket API gateway */
-const struct __SOCKET_API__ Socket = {
-    .start_server = start_server,
-    .connect = connect_server,
-    .read = socket_read,
-    .write = socket_write,
-    .init = socket_init,
-};
-
-/* suppress compilation warnings */
-static inline ssize_t write_wrapper(int fd, const void *buf, size_t count)
-{
-    ssize_t s;
-    if ((s = write(fd, buf, count)) < count) perror("write");
-    return s;
-}
-
-static void *join_thread(pthread_t thr)
-{
-    void *ret;
-    pthread_join(thr, &ret);
-    return ret;
-}
-
-/** Destroys the ring object, releasing its memory. */
-static void ring_destroy(ring_p ring)
-{
-    pthread_mutex_lock(&ring->lock);
-
-    /* close pipe */
-    if (ring->battery.pipe.in) {
-        close(ring->battery.pipe.in);
-        ring->battery.pipe.in = 0;
-    }
-    if (ring->battery.pipe.out) {
-        close(ring->battery.pipe.out);
-        ring->battery.pipe.out = 0;
-    }
-    if (ring->led.pipe.in) {
-        close(ring->led.pipe.in);
-        ring->led.pipe.in = 0;
-    }
-    if (ring->led.pipe.out) {
-        close(ring->led.pipe.out);
-        ring->led.pipe.out = 0;
-    }
-    if (ring->socket->pipe.in) {
-        close(ring->socket->pipe.in);
-        ring->socket->pipe.in = 0;
-    }
-    if (ring->socket->pipe.out) {
-        close(ring->socket->pipe.out);
-        ring->socket->pipe.out = 0;
-    }
-    if (ring->pipe.in) {
-        close(ring->pipe.in);
-        ring->pipe.in = 0;
-    }
-    if (ring->pipe.out) {
-        close(ring->pipe.out);
-        ring->pipe.out = 0;
-    }
-    pthread_mutex_unlock(&ring->lock);
-    pthread_mutex_destroy(&ring->lock);
-    free(ring);
-}
-
-/* Signal and finish */
-static void ring_signal(ring_p ring)
-{
-    ring->run = 0;
-    /* send `ring->count` number of wakeup signales.
-     * data content is irrelevant. */
-    write_wrapper(ring->battery.pipe.out, ring, ring->count);
-    write_wrapper(ring->led.pipe.out, ring, ring->count);
-    write_wrapper(ring->socket->pipe.out, ring, ring->count);   
-    write_wrapper(ring->pipe.out, ring, ring->count);
-}
-
-static void ring_wait(ring_p ring)
-{
-    if (!ring) return;
-    
-    /* wake threads (just in case) by sending `ring->count`
-     * number of wakeups
-     */
-    if (ring->battery.pipe.out)
-        write_wrapper(ring->battery.pipe.out, ring, ring->count);    
-    if (ring->led.pipe.out)
-    	write_wrapper(ring->led.pipe.out, ring, ring->count);
-    if (ring->socket->pipe.out)	
-    	write_wrapper(ring->socket->pipe.out, ring, ring->count);   
-    if (ring->pipe.out)
-    	write_wrapper(ring->pipe.out, ring, ring->count);
-    
-    /* join threads */
-    for (int i = 0; i < ring->count; i++) {
-        join_thread(ring->threads[i]);
-    }
-    if (!ring->socket) {
-        free(ring->socket->settings);
-        free(ring->socket);
-    }
-    /* release queue memory and resources */
-    ring_destroy(ring);
-}
-
-static void ring_finish(ring_p ring)
-{
-    ring_signal(ring);
-    ring_wait(ring);
-}
-
-static int create_thread(pthread_t *thr,
-                         void *(*thread_func)(void *),
-                         void *ring)
-{
-    return pthread_create(thr, NULL, thread_func, ring);
-}
-
-int init_pipe(pipe_p _pipe)
-{
-    if (pipe((int *)_pipe)) return -1;
-    fcntl(_pipe->out, F_SETFL, O_NONBLOCK | O_WRONLY);	
-    return 0;
-}
-
-static ring_p ring_create(int threads, void *(**tasks)(void *))
-{
-    ring_p ring = malloc(sizeof(*ring) + (threads * sizeof(pthread_t)));
-    ring->led.white_led_on = 0;
-    ring->led.red_led_gpio = 0;
-    ring->led.pipe.in = 0;
-    ring->led.pipe.out = 0;
-    ring->battery.voltage = 4100; /* default 4100mV) */
-    ring->battery.minimum_vol = 3500; /* default 3500mV */
-    ring->battery.charging = 0;
-    ring->battery.pipe.in = 0;
-    ring->battery.pipe.out = 0;
-    ring->pipe.in = 0;
-    ring->pipe.out = 0;
-    ring->press_button = 0;
-        
-    if (pthread_mutex_init(&(ring->lock), NULL)) {
-        free(ring);
-        return NULL;
-    }
- 	if(init_pipe(&ring->battery.pipe)) goto end;
-    if(init_pipe(&ring->led.pipe)) goto end;
-    if(init_pipe(&ring->pipe)) goto end;	
-    ring->run = 1;
-    /* create threads */
-    for (ring->count = 0; ring->count < threads; ring->count++) {
-        if (create_thread(ring->threads + ring->count,
-                          *tasks++, ring)) {
-            /* signal */
-            ring_signal(ring);
-            /* wait for threads and destroy object */
-            ring_wait(ring);
-            /* return error */
-            return NULL;
-        };
-    }
-    return ring;
-end:
-	free(ring);
-    return NULL;    
-}
-
-/* Task Management - add a task and perform all tasks in queue */
-
-static int ring_run(ring_p ring, pipe_p pipe)
-{
-    if (!ring) return -1;
-
-    /* wake up any sleeping threads
-     * any activated threads will ask to require the mutex
-     * as soon as we write.
-     * we need to unlock before we write, or we will have excess
-     * context switches.
-     */
-    write_wrapper(pipe->out, ring, 1);
-    return 0;
-}
-
-
-/* API gateway */
-const struct __THREAD_API__ Thread = {
-    .create = ring_create,
-    .signal = ring_signal,
-    .wait = ring_wait,
-    .finish = ring_finish,
-    .run = ring_run,
-};
+#define _GNU_SOURCE /* recvmmsg() and sendmmsg() */
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <alloca.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include "ring.h"
+
+static int bind_server_socket(struct SocketSettings *setting)
+{
+    int srvfd;
+    /* setup the address */
+    struct addrinfo hints;
+    struct sockaddr_in addr; /* address of this service */
+    
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_INET;  /* Allows IPv4 or IPv6 */
+    hints.ai_socktype = SOCK_DGRAM;  /* UDP stream sockets */
+
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(setting->port);
+     
+    srvfd = socket(hints.ai_family, hints.ai_socktype, 0);
+    if (srvfd <= 0) {
+        perror("socket error");
+        return -1;
+    }
+    
+    /* prevent address from being taken */
+    {
+        int optval = 1;
+        setsockopt(srvfd, SOL_SOCKET, SO_REUSEADDR,
+                   &optval, sizeof(optval));
+        /* let every worker bind its own socket to the same port, the
+         * kernel spreads the clients across them by their 4-tuple hash */
+        if (setting->workers > 1 &&
+            setsockopt(srvfd, SOL_SOCKET, SO_REUSEPORT,
+                       &optval, sizeof(optval))) {
+            perror("SO_REUSEPORT");
+            close(srvfd);
+            return -1;
+        }
+    }
+    
+    /* bind() failed: close this socket*/
+    if (bind(srvfd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(srvfd);
+        return -1;
+    }
+    
+    return srvfd;
+}
+
+
+
+/*
+ * Server worker: owns one SO_REUSEPORT socket and the wait loop of its
+ * backend. The socket is non-blocking, so `on_data` drains whatever is
+ * queued and returns to the loop once Socket.read reports no more data.
+ * Everything that can fail is set up by `serve_open`, on the calling
+ * thread, before any worker runs; `serve_loop` runs until the worker's
+ * notifier is signalled.
+ */
+static int serve_open(socket_p socket)
+{
+    int srvfd = bind_server_socket(socket->settings);
+
+    if (srvfd < 0) {
+        perror("bind worker socket");
+        return -1;
+    }
+    fcntl(srvfd, F_SETFL, fcntl(srvfd, F_GETFL) | O_NONBLOCK);
+
+    if (Socket.open(socket)) {
+        close(srvfd);
+        return -1;
+    }
+    if (Socket.add(socket, srvfd, 1) ||
+        Socket.add(socket, socket->notify.fd, 0)) {
+        socket->backend->close(socket);
+        close(srvfd);
+        return -1;
+    }
+    return srvfd;
+}
+
+static void serve_close(socket_p socket, int srvfd)
+{
+    socket->backend->close(socket);
+    close(srvfd);
+}
+
+static void serve_loop(socket_p socket, int srvfd)
+{
+    int fds[MAX_EVENTS];
+    int n;
+
+    if (socket->settings->on_open)
+        socket->settings->on_open(socket, srvfd);
+
+    Stats.name("server_worker");
+    for (;;) {
+        n = Socket.wait(socket, fds, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("wait");
+            return;
+        }
+        for (int i = 0; i < n; i++) {
+            if (fds[i] == socket->notify.fd) return;
+            if (socket->settings->on_data)
+                socket->settings->on_data(socket, fds[i]);
+        }
+    }
+}
+
+/* a worker of `start_workers`: its socket and the fd bound for it */
+struct server_worker {
+    socket_p socket;
+    int srvfd;
+};
+
+static void *server_worker(void *arg)
+{
+    struct server_worker *w = arg;
+
+    serve_loop(w->socket, w->srvfd);
+    return NULL;
+}
+
+/* a worker's socket and packet buffers, carved from the server arena */
+static socket_p server_socket(arena_p arena, struct SocketSettings *settings)
+{
+    socket_p socket = Arena.alloc(arena, sizeof(*socket));
+
+    if (!socket) return NULL;
+    socket->settings = settings;
+    socket->backend = settings->backend;
+    socket->arena = arena;
+    socket->buffers = Buffers.create(arena, settings->buffers, BUF_SIZE);
+    if (!socket->buffers || Notifier.init(&socket->notify, 0)) return NULL;
+    return socket;
+}
+
+/*
+ * start `settings.workers` server workers and wait for them to finish.
+ * Every worker's socket is bound before the first one starts; a socket
+ * that can not be bound or a thread that does not start stops the ones
+ * started already and fails the server.
+ */
+static int start_workers(arena_p arena, struct SocketSettings *settings)
+{
+    int count = settings->workers;
+    struct server_worker *workers = Arena.alloc(arena,
+                                                count * sizeof(*workers));
+    pthread_t *threads = Arena.alloc(arena, count * sizeof(*threads));
+    int opened = 0, started = 0;
+
+    if (!workers || !threads) return -1;
+    for (; opened < count; opened++) {
+        struct server_worker *w = workers + opened;
+
+        if (!(w->socket = server_socket(arena, settings))) {
+            perror("server worker");
+            break;
+        }
+        if ((w->srvfd = serve_open(w->socket)) < 0) {
+            Notifier.close(&w->socket->notify);
+            break;
+        }
+    }
+    if (opened == count) {
+        for (; started < count; started++)
+            if (pthread_create(threads + started, NULL, server_worker,
+                               workers + started)) {
+                perror("server worker");
+                break;
+            }
+    }
+    /* a worker missing: stop the others */
+    if (started < count)
+        for (int i = 0; i < started; i++)
+            Notifier.signal(&workers[i].socket->notify);
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    for (int i = 0; i < opened; i++) {
+        serve_close(workers[i].socket, workers[i].srvfd);
+        Notifier.close(&workers[i].socket->notify);
+    }
+    return started == count ? 0 : -1;
+}
+
+static int start_server(struct SocketSettings settings)
+{
+    socket_p socket;
+    arena_p arena;
+    int ret = -1;
+    if (!settings.port)
+        settings.port = 8080;
+    if (settings.workers < 1)
+        settings.workers = 1;
+    if (settings.buffers <= 0)
+        settings.buffers = 2 * SOCKET_BATCH;
+    if (!settings.backend)
+        settings.backend = &EpollBackend;
+
+    /* reserve the memory of every worker before the first packet */
+    arena = Arena.create(settings.workers * (sizeof(*socket) +
+                         sizeof(pthread_t) + sizeof(struct server_worker) +
+                         3 * ARENA_ALIGN +
+                         Buffers.footprint(settings.buffers, BUF_SIZE)));
+    if (!arena) return -1;
+    if (settings.workers > 1) {
+        ret = start_workers(arena, &settings);
+        goto end;
+    }
+
+    /* a single worker serves from the calling thread */
+    socket = server_socket(arena, &settings);
+    if (socket) {
+        int srvfd = serve_open(socket);
+
+        if (srvfd >= 0) {
+            serve_loop(socket, srvfd);
+            serve_close(socket, srvfd);
+            ret = 0;
+        }
+        Notifier.close(&socket->notify);
+    }
+end:
+    Arena.destroy(arena);
+    return ret;
+}
+
+/*
+ * epoll backend: readiness from an epoll set, one syscall per datagram
+ * (or per batch) moved.
+ */
+static int ep_open(socket_p socket)
+{
+    socket->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (socket->epfd == -1) {
+        perror("epoll_create");
+        socket->epfd = 0;
+        return -1;
+    }
+    return 0;
+}
+
+static int ep_add(socket_p socket, int fd, int datagrams)
+{
+    struct epoll_event event = { .events = EPOLLIN, .data.fd = fd };
+
+    if (epoll_ctl(socket->epfd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        perror("epoll_ctl");
+        Stats.add(STAT_EPOLL_CTL_FAILURES, 1);
+        return -1;
+    }
+    return 0;
+}
+
+static int ep_wait(socket_p socket, int *fds, int max, int timeout_ms)
+{
+    struct epoll_event events[MAX_EVENTS];
+    int n;
+
+    if (max > MAX_EVENTS) max = MAX_EVENTS;
+    if (timeout_ms) Stats.idle_begin();
+    n = epoll_wait(socket->epfd, events, max, timeout_ms);
+    if (timeout_ms) Stats.idle_end();
+    Stats.add(STAT_SYSCALLS, 1);
+    for (int i = 0; i < n; i++)
+        fds[i] = events[i].data.fd;
+    return n;
+}
+
+static void ep_close(socket_p socket)
+{
+    if (socket->epfd > 0) close(socket->epfd);
+    socket->epfd = 0;
+}
+
+static ssize_t ep_read(socket_p socket, int fd, void *buffer,
+               size_t max_len, struct sockaddr *addr)
+{
+    ssize_t num_read;
+
+    num_read = recvfrom(fd, buffer, max_len, 0, addr, &socket->len);
+    Stats.add(STAT_SYSCALLS, 1);
+    
+    if (num_read > 0) {
+        Stats.add(STAT_PACKETS_READ, 1);
+        Stats.add(STAT_BYTES_READ, num_read);
+    	/* return data */
+        return num_read;
+    } else {
+        if (num_read && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            Stats.add(STAT_EAGAIN, 1);
+            return 0;
+        }
+    }
+    Stats.add(STAT_SOCKET_ERRORS, 1);
+    return -1;
+    
+}
+
+static ssize_t ep_write(socket_p socket, int fd, void *data,
+               size_t data_len, struct sockaddr *addr)
+{
+	/* make sure the socket is alive */
+	if(!fd)	return -1;
+	
+	ssize_t write = 0;
+    Stats.add(STAT_SYSCALLS, 1);
+    if ((write = sendto(fd, (char *)data, data_len, 0, 
+    	         addr, socket->len)) < 0) {
+        Stats.add(errno == EAGAIN || errno == EWOULDBLOCK ?
+                  STAT_EAGAIN : STAT_SOCKET_ERRORS, 1);
+    	return -1;
+	} 
+    Stats.add(STAT_PACKETS_WRITTEN, 1);
+    Stats.add(STAT_BYTES_WRITTEN, write);
+	return write;
+}
+
+static socklen_t sockaddr_len(const struct sockaddr_storage *addr)
+{
+    return addr->ss_family == AF_INET6 ? sizeof(struct sockaddr_in6)
+                                       : sizeof(struct sockaddr_in);
+}
+
+static int ep_read_batch(socket_p socket, int fd, struct iovec *iov,
+               struct sockaddr_storage *addrs, int vlen)
+{
+    struct mmsghdr msgs[SOCKET_BATCH];
+    int num_read;
+
+    if (vlen > SOCKET_BATCH) vlen = SOCKET_BATCH;
+    memset(msgs, 0, vlen * sizeof(*msgs));
+    for (int i = 0; i < vlen; i++) {
+        msgs[i].msg_hdr.msg_iov = iov + i;
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        if (addrs) {
+            msgs[i].msg_hdr.msg_name = addrs + i;
+            msgs[i].msg_hdr.msg_namelen = sizeof(*addrs);
+        }
+    }
+    /* block for the first datagram only, then take whatever is queued */
+    num_read = recvmmsg(fd, msgs, vlen, MSG_WAITFORONE, NULL);
+    Stats.add(STAT_SYSCALLS, 1);
+    if (num_read > 0) {
+        size_t bytes = 0;
+        for (int i = 0; i < num_read; i++)
+            bytes += iov[i].iov_len = msgs[i].msg_len;
+        Stats.add(STAT_PACKETS_READ, num_read);
+        Stats.add(STAT_BYTES_READ, bytes);
+        return num_read;
+    }
+    if (num_read < 0 && (errno == EWOULDBLOCK || errno == EAGAIN)) {
+        Stats.add(STAT_EAGAIN, 1);
+        return 0;
+    }
+    Stats.add(STAT_SOCKET_ERRORS, 1);
+    return -1;
+}
+
+static int ep_write_batch(socket_p socket, int fd, struct iovec *iov,
+               struct sockaddr_storage *addrs, int vlen)
+{
+    struct mmsghdr msgs[SOCKET_BATCH];
+    int sent = 0, num_sent;
+
+    if (!fd) return -1;
+    if (vlen > SOCKET_BATCH) vlen = SOCKET_BATCH;
+    memset(msgs, 0, vlen * sizeof(*msgs));
+    for (int i = 0; i < vlen; i++) {
+        msgs[i].msg_hdr.msg_iov = iov + i;
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        if (addrs) {
+            msgs[i].msg_hdr.msg_name = addrs + i;
+            msgs[i].msg_hdr.msg_namelen = sockaddr_len(addrs + i);
+        }
+    }
+    /* sendmmsg() may stop early, push the remainder until it errors */
+    while (sent < vlen) {
+        num_sent = sendmmsg(fd, msgs + sent, vlen - sent, 0);
+        Stats.add(STAT_SYSCALLS, 1);
+        if (num_sent <= 0) {
+            Stats.add(errno == EAGAIN || errno == EWOULDBLOCK ?
+                      STAT_EAGAIN : STAT_SOCKET_ERRORS, 1);
+            break;
+        }
+        for (int i = sent; i < sent + num_sent; i++)
+            Stats.add(STAT_BYTES_WRITTEN, msgs[i].msg_len);
+        sent += num_sent;
+    }
+    Stats.add(STAT_PACKETS_WRITTEN, sent);
+    return sent ? sent : -1;
+}
+
+/* epoll backend */
+const struct socket_backend EpollBackend = {
+    .name = "epoll",
+    .open = ep_open,
+    .add = ep_add,
+    .wait = ep_wait,
+    .read = ep_read,
+    .write = ep_write,
+    .read_batch = ep_read_batch,
+    .write_batch = ep_write_batch,
+    .close = ep_close,
+};
+
+static int socket_open(socket_p socket)
+{
+    if (!socket->backend->open(socket)) return 0;
+    if (socket->backend == &EpollBackend) return -1;
+    fprintf(stderr, "%s unavailable, falling back to epoll\n",
+            socket->backend->name);
+    socket->backend = &EpollBackend;
+    return socket->backend->open(socket);
+}
+
+static int socket_add(socket_p socket, int fd, int datagrams)
+{
+    return socket->backend->add(socket, fd, datagrams);
+}
+
+static int socket_wait(socket_p socket, int *fds, int max, int timeout_ms)
+{
+    return socket->backend->wait(socket, fds, max, timeout_ms);
+}
+
+static ssize_t socket_read(socket_p socket, int fd, void *buffer,
+               size_t max_len, struct sockaddr *addr)
+{
+    return socket->backend->read(socket, fd, buffer, max_len, addr);
+}
+
+static ssize_t socket_write(socket_p socket, int fd, void *data,
+               size_t data_len, struct sockaddr *addr)
+{
+    return socket->backend->write(socket, fd, data, data_len, addr);
+}
+
+static int socket_read_batch(socket_p socket, int fd, struct iovec *iov,
+               struct sockaddr_storage *addrs, int vlen)
+{
+    return socket->backend->read_batch(socket, fd, iov, addrs, vlen);
+}
+
+static int socket_write_batch(socket_p socket, int fd, struct iovec *iov,
+               struct sockaddr_storage *addrs, int vlen)
+{
+    return socket->backend->write_batch(socket, fd, iov, addrs, vlen);
+}
+
+static int socket_close(socket_p socket, int fd)
+{
+    socket->backend->close(socket);
+	close(fd);
+	Trace.event(TRACE_SOCKET_CLOSE, 0, 0);
+	return 0;
+}
+
+static socket_p socket_init(struct SocketSettings settings, int buf_len)
+{
+    /* `buff` holds `buf_len` bytes, rounded up to whole elements */
+    size_t size = sizeof(struct Socket) + (buf_len + 1) / 2 * sizeof(uint16_t);
+    arena_p arena = Arena.create(size + ARENA_ALIGN + sizeof(settings));
+    socket_p socket;
+
+    if (!arena) return NULL;
+    socket = Arena.alloc(arena, size);
+    if (!socket || !(socket->settings = Arena.alloc(arena,
+                                                    sizeof(settings)))) {
+        Arena.destroy(arena);
+        return NULL;
+    }
+    memcpy(socket->settings, &settings, sizeof(settings));
+    socket->backend = settings.backend ? settings.backend : &EpollBackend;
+    Rto.init(&socket->rto, socket->settings);
+    socket->arena = arena;
+    if(Notifier.init(&socket->notify, 0)) {
+        Arena.destroy(arena);
+        return NULL;
+    }
+    return socket;
+}
+
+static void socket_destroy(socket_p socket)
+{
+    if (!socket) return;
+    if (socket->clfd) socket_close(socket, socket->clfd);
+    Notifier.close(&socket->notify);
+    Arena.destroy(socket->arena);
+}
+
+/* the client socket, connected to the server, and its wait set */
+static int client_open(socket_p sock)
+{
+    int clfd;     /* fd into transport provider */
+    struct SocketSettings *settings = sock->settings;
+
+    /*
+     * Fill in the server's UDP/IP address, from the Resolver cache the
+     * client warmed up with Resolver.prefetch. A host that can not be
+     * resolved falls back to the local host.
+     */
+    bzero((char *)&sock->servaddr, sizeof(sock->servaddr));
+    if (!settings->host ||
+        Resolver.lookup(settings->host, settings->port, &sock->servaddr,
+                        settings->timeout_ms > 0 ? settings->timeout_ms
+                                                 : 500)) {
+        struct sockaddr_in *servaddr = (struct sockaddr_in *)&sock->servaddr;
+        if (settings->host)
+            fprintf(stderr, "%s: not resolved, using the local host\n",
+                    settings->host);
+        servaddr->sin_family = AF_INET;
+        servaddr->sin_port = htons(settings->port);
+    }
+
+    /*
+     *  Get a socket into UDP
+     */
+    if ((clfd = socket(sock->servaddr.ss_family, SOCK_DGRAM, 0)) < 0) {
+        perror ("socket failed!");
+        return -1;
+    }
+    Trace.event(TRACE_SOCKET_OPEN, 0, 0);
+    /*
+     * connect() binds an arbitrary return address, routes once and
+     * filters out the datagrams of any other peer.
+     */
+    if (connect(clfd, (struct sockaddr *)&sock->servaddr,
+                sockaddr_len(&sock->servaddr)) < 0) {
+        perror("connect failed!");
+        close(clfd);
+        return -1;
+    }
+    
+    if (Socket.open(sock)) {
+        close(clfd);
+        return -1;
+    }
+    if (Socket.add(sock, clfd, 1)) {
+        sock->backend->close(sock);
+        close(clfd);
+        return -1;
+    }
+    sock->clfd = clfd;
+	if(sock->settings->on_open)
+        sock->settings->on_open(sock, clfd);
+    return 0;
+}
+
+/*
+ * drop what came in since the last connect, e.g. the late echoes of the
+ * previous one; a datagram per wait, as the socket blocks
+ */
+static void client_drain(socket_p sock)
+{
+    int fds[MAX_EVENTS], n, stale = 0, ready;
+
+    do {
+        n = Socket.wait(sock, fds, MAX_EVENTS, 0);
+        ready = 0;
+        for (int i = 0; i < n; i++)
+            if (fds[i] == sock->clfd) ready = 1;
+        sock->len = sizeof(sock->claddr);
+        if (ready && Socket.read(sock, sock->clfd, sock->buff, BUF_SIZE,
+                                 (struct sockaddr *)&sock->claddr) > 0)
+            stale++;
+    } while (ready);
+    if (stale) Stats.add(STAT_STALE_DATAGRAMS, stale);
+}
+
+static int connect_server(socket_p sock)
+{
+    if (!sock->clfd) {
+        if (client_open(sock)) return -1;
+    } else {
+        client_drain(sock);
+    }
+ 	if(sock->settings->on_data) 
+       sock->settings->on_data(sock, sock->clfd);
+    if (sock->settings->reconnect) {
+        socket_close(sock, sock->clfd);
+        sock->clfd = 0;
+    }
+    return 0;
+}
+
+/* Socket API gateway */
+const struct __SOCKET_API__ Socket = {
+    .start_server = start_server,
+    .connect = connect_server,
+    .open = socket_open,
+    .add = socket_add,
+    .wait = socket_wait,
+    .read = socket_read,
+    .write = socket_write,
+    .read_batch = socket_read_batch,
+    .write_batch = socket_write_batch,
+    .close = socket_close,
+    .init = socket_init,
+    .destroy = socket_destroy,
+};
+
+/*
+ * Notifier
+ *
+ * An eventfd counter: every signal adds to it and a single read takes
+ * all pending wakeups at once, so a burst of signals costs the waiter
+ * one read(). The fd becomes readable while the counter is non-zero and
+ * can be waited on with epoll. In semaphore mode each read takes one
+ * wakeup, which lets several threads share the notifier.
+ */
+static int notifier_init(notifier_p notify, int semaphore)
+{
+    notify->fd = eventfd(0, EFD_CLOEXEC | (semaphore ? EFD_SEMAPHORE : 0));
+    if (notify->fd < 0) {
+        perror("eventfd");
+        notify->fd = 0;
+        return -1;
+    }
+    return 0;
+}
+
+static int notifier_post(notifier_p notify, uint64_t count)
+{
+    if (!notify->fd) return -1;
+    if (write(notify->fd, &count, sizeof(count)) != sizeof(count)) {
+        perror("notifier write");
+        return -1;
+    }
+    return 0;
+}
+
+static int notifier_signal(notifier_p notify)
+{
+    return notifier_post(notify, 1);
+}
+
+static int64_t notifier_drain(notifier_p notify)
+{
+    uint64_t count;
+    ssize_t s;
+
+    while ((s = read(notify->fd, &count, sizeof(count))) < 0 &&
+           errno == EINTR);
+    return s == sizeof(count) ? (int64_t)count : -1;
+}
+
+/* the time a thread sleeps here counts as idle in its Stats */
+static int64_t notifier_wait(notifier_p notify)
+{
+    int64_t count;
+
+    Stats.idle_begin();
+    count = notifier_drain(notify);
+    Stats.idle_end();
+    return count;
+}
+
+static void notifier_close(notifier_p notify)
+{
+    if (notify->fd) {
+        close(notify->fd);
+        notify->fd = 0;
+    }
+}
+
+/* Notifier API gateway */
+const struct __NOTIFIER_API__ Notifier = {
+    .init = notifier_init,
+    .signal = notifier_signal,
+    .wait = notifier_wait,
+    .drain = notifier_drain,
+    .close = notifier_close,
+};
+
+static void *join_thread(pthread_t thr)
+{
+    void *ret;
+    pthread_join(thr, &ret);
+    return ret;
+}
+
+/*
+ * Work-stealing pool
+ *
+ * Every pool worker owns a Chase-Lev deque: the owner pushes and takes
+ * at the bottom without locks while idle workers steal from the top.
+ * Tasks submitted from outside the pool go through the injection queue
+ * guarded by `ring->lock`. Idle workers sleep on the pool notifier.
+ */
+#define DEQUE_SIZE 1024 /* must be a power of 2 */
+
+struct deque {
+    long top __attribute__((aligned(64))); /* advanced by thieves (CAS) */
+    long bottom __attribute__((aligned(64))); /* written by the owner only */
+    struct task slots[DEQUE_SIZE];
+};
+
+struct worker {
+    ring_p ring;
+    unsigned seed; /* victim selection */
+    struct deque deque;
+};
+
+struct pool {
+    struct notifier notify; /* idle workers sleep here (semaphore) */
+    struct task *queue; /* injection queue (ring buffer) */
+    int head, len, cap;
+    long pending; /* tasks submitted but not finished yet */
+    int idle; /* workers sleeping on the notifier */
+    int count; /* number of workers */
+    struct worker *workers[];
+};
+
+/* the pool worker running on this thread, NULL for any other thread */
+static __thread struct worker *current_worker;
+
+static int deque_push(struct deque *q, struct task *task)
+{
+    long b = __atomic_load_n(&q->bottom, __ATOMIC_RELAXED);
+    long t = __atomic_load_n(&q->top, __ATOMIC_ACQUIRE);
+    struct task *slot = q->slots + (b & (DEQUE_SIZE - 1));
+
+    if (b - t >= DEQUE_SIZE) return -1; /* full */
+    __atomic_store_n(&slot->func, task->func, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->arg, task->arg, __ATOMIC_RELAXED);
+    __atomic_store_n(&q->bottom, b + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* owner side: pop the most recently pushed task */
+static int deque_take(struct deque *q, struct task *task)
+{
+    long b = __atomic_load_n(&q->bottom, __ATOMIC_RELAXED) - 1;
+    long t;
+    struct task *slot = q->slots + (b & (DEQUE_SIZE - 1));
+    int found = 1;
+
+    __atomic_store_n(&q->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    t = __atomic_load_n(&q->top, __ATOMIC_RELAXED);
+    if (t > b) { /* empty */
+        __atomic_store_n(&q->bottom, b + 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    task->func = __atomic_load_n(&slot->func, __ATOMIC_RELAXED);
+    task->arg = __atomic_load_n(&slot->arg, __ATOMIC_RELAXED);
+    if (t == b) {
+        /* last task: race the thieves for it */
+        found = __atomic_compare_exchange_n(&q->top, &t, t + 1, 0,
+                    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+        __atomic_store_n(&q->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+    return found;
+}
+
+/* thief side: return 1 on success, 0 if empty, -1 if we lost a race */
+static int deque_steal(struct deque *q, struct task *task)
+{
+    long t = __atomic_load_n(&q->top, __ATOMIC_ACQUIRE);
+    long b;
+    struct task *slot = q->slots + (t & (DEQUE_SIZE - 1));
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    b = __atomic_load_n(&q->bottom, __ATOMIC_ACQUIRE);
+    if (t >= b) return 0;
+    /* the slot may be recycled under us, the CAS then fails */
+    task->func = __atomic_load_n(&slot->func, __ATOMIC_RELAXED);
+    task->arg = __atomic_load_n(&slot->arg, __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&q->top, &t, t + 1, 0,
+                __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return -1;
+    return 1;
+}
+
+static int deque_empty(struct deque *q)
+{
+    return __atomic_load_n(&q->top, __ATOMIC_ACQUIRE) >=
+           __atomic_load_n(&q->bottom, __ATOMIC_ACQUIRE);
+}
+
+static int ring_running(ring_p ring)
+{
+    return __atomic_load_n(&ring->run, __ATOMIC_ACQUIRE);
+}
+
+/* wake up to `n` idle workers */
+static void pool_wake(struct pool *pool, int n)
+{
+    int idle;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    idle = __atomic_load_n(&pool->idle, __ATOMIC_SEQ_CST);
+    if (n > idle) n = idle;
+    if (n > 0 && !notifier_post(&pool->notify, n))
+        Stats.add(STAT_WAKEUPS, n);
+}
+
+static int pool_inject(ring_p ring, struct task *tasks, int n)
+{
+    struct pool *pool = ring->pool;
+    int ret = 0;
+
+    pthread_mutex_lock(&ring->lock);
+    if (pool->len + n > pool->cap) {
+        int cap = pool->cap ? pool->cap : 64;
+        struct task *queue;
+        while (cap < pool->len + n) cap <<= 1;
+        queue = malloc(cap * sizeof(*queue));
+        if (!queue) {
+            ret = -1;
+            goto end;
+        }
+        /* linearize the ring buffer into the new storage */
+        for (int i = 0; i < pool->len; i++)
+            queue[i] = pool->queue[(pool->head + i) % pool->cap];
+        free(pool->queue);
+        pool->queue = queue;
+        pool->head = 0;
+        pool->cap = cap;
+    }
+    for (int i = 0; i < n; i++)
+        pool->queue[(pool->head + pool->len + i) % pool->cap] = tasks[i];
+    __atomic_store_n(&pool->len, pool->len + n, __ATOMIC_RELEASE);
+end:
+    pthread_mutex_unlock(&ring->lock);
+    return ret;
+}
+
+static int pool_dequeue(ring_p ring, struct task *task)
+{
+    struct pool *pool = ring->pool;
+    int found = 0;
+
+    if (!__atomic_load_n(&pool->len, __ATOMIC_ACQUIRE)) return 0;
+    pthread_mutex_lock(&ring->lock);
+    if (pool->len) {
+        *task = pool->queue[pool->head];
+        pool->head = (pool->head + 1) % pool->cap;
+        __atomic_store_n(&pool->len, pool->len - 1, __ATOMIC_RELEASE);
+        found = 1;
+    }
+    pthread_mutex_unlock(&ring->lock);
+    return found;
+}
+
+/* own deque first (LIFO, cache warm), then the injection queue,
+ * then steal the oldest task of a random victim */
+static int pool_next(struct worker *self, struct task *task)
+{
+    struct pool *pool = self->ring->pool;
+    int start, ret;
+
+    if (deque_take(&self->deque, task)) return 1;
+    if (pool_dequeue(self->ring, task)) return 1;
+    start = rand_r(&self->seed) % pool->count;
+    for (int i = 0; i < pool->count; i++) {
+        struct worker *victim = pool->workers[(start + i) % pool->count];
+        if (victim == self) continue;
+        while ((ret = deque_steal(&victim->deque, task)) < 0);
+        if (ret) {
+            Stats.add(STAT_TASKS_STOLEN, 1);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int pool_has_work(struct pool *pool)
+{
+    if (__atomic_load_n(&pool->len, __ATOMIC_ACQUIRE)) return 1;
+    for (int i = 0; i < pool->count; i++)
+        if (!deque_empty(&pool->workers[i]->deque)) return 1;
+    return 0;
+}
+
+static void *pool_worker(void *arg)
+{
+    struct worker *self = arg;
+    ring_p ring = self->ring;
+    struct pool *pool = ring->pool;
+    struct task task;
+
+    current_worker = self;
+    Stats.name("pool_worker");
+    for (;;) {
+        if (pool_next(self, &task)) {
+            task.func(task.arg);
+            Stats.add(STAT_TASKS_RUN, 1);
+            /* the last task of a finishing pool releases the sleepers */
+            if (!__atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST) &&
+                !ring_running(ring))
+                pool_wake(pool, pool->count);
+            continue;
+        }
+        if (!ring_running(ring) &&
+            !__atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST))
+            break;
+        __atomic_add_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+        /* re-check after announcing ourselves idle: a submitter that
+         * did not see us idle has already made its task visible */
+        if (!pool_has_work(pool) &&
+            (ring_running(ring) ||
+             __atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST)))
+            Notifier.wait(&pool->notify);
+        __atomic_sub_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+    }
+    current_worker = NULL;
+    return NULL;
+}
+
+static int pool_submit(ring_p ring, struct task *tasks, int n)
+{
+    struct pool *pool = ring->pool;
+    struct worker *self = current_worker;
+    int queued = 0;
+
+    if (!pool || n <= 0) return -1;
+    if (self && self->ring != ring) self = NULL;
+    /* once signalled, only tasks already in the pool may add work */
+    if (!self && !ring_running(ring)) return -1;
+
+    __atomic_add_fetch(&pool->pending, n, __ATOMIC_SEQ_CST);
+    if (self)
+        while (queued < n && !deque_push(&self->deque, tasks + queued))
+            queued++;
+    if (queued < n && pool_inject(ring, tasks + queued, n - queued)) {
+        __atomic_sub_fetch(&pool->pending, n - queued, __ATOMIC_SEQ_CST);
+        return -1;
+    }
+    Stats.add(STAT_TASKS_QUEUED, n);
+    pool_wake(pool, n);
+    return 0;
+}
+
+/* the ring arena bytes taken by a pool of `workers` */
+static size_t pool_footprint(int workers)
+{
+    return sizeof(struct pool) + workers * sizeof(void *) + ARENA_ALIGN +
+           workers * (sizeof(struct worker) + ARENA_ALIGN);
+}
+
+static struct pool *pool_create(ring_p ring, int workers)
+{
+    struct pool *pool = Arena.alloc(ring->arena,
+                                    sizeof(*pool) + workers * sizeof(void *));
+
+    if (!pool) return NULL;
+    if (Notifier.init(&pool->notify, 1)) return NULL;
+    for (; pool->count < workers; pool->count++) {
+        struct worker *worker = Arena.alloc(ring->arena, sizeof(*worker));
+        if (!worker) break;
+        worker->ring = ring;
+        worker->seed = pool->count + 1;
+        pool->workers[pool->count] = worker;
+    }
+    return pool;
+}
+
+static void pool_destroy(struct pool *pool)
+{
+    if (!pool) return;
+    Notifier.close(&pool->notify);
+    /* the pool and its workers go with the ring arena */
+    free(pool->queue);
+}
+
+/** Destroys the ring object, releasing its memory. */
+static void ring_destroy(ring_p ring)
+{
+    pthread_mutex_lock(&ring->lock);
+
+    /* close notifiers */
+    Notifier.close(&ring->battery.notify);
+    Notifier.close(&ring->led.notify);
+    if (ring->socket)
+        Notifier.close(&ring->socket->notify);
+    Notifier.close(&ring->notify);
+    pool_destroy(ring->pool);
+    ring->pool = NULL;
+    Reactor.close(ring);
+    Pwm.close(ring);
+    Timer.close(ring);
+    if (ring->socket) {
+        Socket.destroy(ring->socket);
+        ring->socket = NULL;
+    }
+    pthread_mutex_unlock(&ring->lock);
+    pthread_mutex_destroy(&ring->lock);
+    Arena.destroy(ring->arena);
+}
+
+/* Signal and finish */
+static void ring_signal(ring_p ring)
+{
+    __atomic_store_n(&ring->run, 0, __ATOMIC_RELEASE);
+    /* wake every task thread, a notifier coalesces the wakeups
+     * so one signal per notifier is enough */
+    Notifier.signal(&ring->battery.notify);
+    Notifier.signal(&ring->led.notify);
+    if (ring->socket)
+        Notifier.signal(&ring->socket->notify);
+    Notifier.signal(&ring->notify);
+    Timer.wake(ring);
+    Pwm.wake(ring);
+    /* pool workers keep draining their queues before they exit */
+    if (ring->pool)
+        pool_wake(ring->pool, ring->pool->count);
+}
+
+static void ring_wait(ring_p ring)
+{
+    if (!ring) return;
+    
+    /* wake threads (just in case) */
+    Notifier.signal(&ring->battery.notify);
+    Notifier.signal(&ring->led.notify);
+    if (ring->socket)
+        Notifier.signal(&ring->socket->notify);
+    Notifier.signal(&ring->notify);
+    
+    /* join threads */
+    for (int i = 0; i < ring->count; i++) {
+        join_thread(ring->threads[i]);
+    }
+    /* release queue memory and resources */
+    ring_destroy(ring);
+}
+
+static void ring_finish(ring_p ring)
+{
+    ring_signal(ring);
+    ring_wait(ring);
+}
+
+/* a thread with locked memory prefaults its stack before the task */
+struct thread_start {
+    void *(*func)(void *);
+    void *arg;
+    size_t prefault;
+};
+
+/* the stack left untouched for the frames of the task itself */
+#define STACK_HEADROOM (64 * 1024)
+/* what is prefaulted of a stack of the default size */
+#define STACK_PREFAULT (256 * 1024)
+
+static __attribute__((noinline)) void prefault_stack(size_t bytes)
+{
+    volatile char *stack = alloca(bytes);
+
+    for (size_t i = 0; i < bytes; i += 4096)
+        stack[i] = 0;
+}
+
+static void *thread_start(void *arg)
+{
+    struct thread_start *start = arg;
+
+    prefault_stack(start->prefault);
+    return start->func(start->arg);
+}
+
+static int create_thread(pthread_t *thr,
+                         void *(*thread_func)(void *), void *arg,
+                         const struct thread_attr *attr,
+                         struct thread_start *start)
+{
+    struct sched_param param = { .sched_priority = attr ? attr->priority
+                                                        : 0 };
+    pthread_attr_t pattr;
+    cpu_set_t cpus;
+    int err = 0;
+
+    if (!attr) return pthread_create(thr, NULL, thread_func, arg);
+    pthread_attr_init(&pattr);
+    if (attr->cpus) {
+        CPU_ZERO(&cpus);
+        for (int cpu = 0; cpu < 64; cpu++)
+            if (attr->cpus >> cpu & 1) CPU_SET(cpu, &cpus);
+        err = pthread_attr_setaffinity_np(&pattr, sizeof(cpus), &cpus);
+    }
+    if (!err && attr->stack_size)
+        err = pthread_attr_setstacksize(&pattr, attr->stack_size);
+    if (!err && attr->policy != SCHED_OTHER) {
+        pthread_attr_setinheritsched(&pattr, PTHREAD_EXPLICIT_SCHED);
+        err = pthread_attr_setschedpolicy(&pattr, attr->policy);
+        if (!err) err = pthread_attr_setschedparam(&pattr, &param);
+    }
+    if (!err && attr->lock_memory) {
+        start->func = thread_func;
+        start->arg = arg;
+        start->prefault = !attr->stack_size ? STACK_PREFAULT :
+                          attr->stack_size > 2 * STACK_HEADROOM ?
+                          attr->stack_size - STACK_HEADROOM :
+                          attr->stack_size / 2;
+        thread_func = thread_start;
+        arg = start;
+    }
+    if (!err) err = pthread_create(thr, &pattr, thread_func, arg);
+    if (err == EPERM && attr->policy != SCHED_OTHER) {
+        fprintf(stderr, "thread: real time scheduling not permitted,"
+                        " using the default policy\n");
+        pthread_attr_setinheritsched(&pattr, PTHREAD_INHERIT_SCHED);
+        err = pthread_create(thr, &pattr, thread_func, arg);
+    }
+    pthread_attr_destroy(&pattr);
+    if (err) fprintf(stderr, "thread: %s\n", strerror(err));
+    return err;
+}
+
+
+/* room left in the ring arena for the timer wheel */
+#define RING_ARENA_SLACK 4096
+
+static ring_p ring_create_attr(int threads, void *(**tasks)(void *),
+                               const struct thread_attr **attrs)
+{
+    ring_p ring;
+    arena_p arena;
+    struct thread_start *starts = NULL;
+    int workers = 0, lock_memory = 0;
+
+    /* a NULL task makes that thread a worker of the task pool */
+    for (int i = 0; i < threads; i++) {
+        if (!tasks || !tasks[i]) workers++;
+        if (attrs && attrs[i] && attrs[i]->lock_memory) lock_memory = 1;
+    }
+    arena = Arena.create(sizeof(*ring) + threads * sizeof(pthread_t) +
+                         (workers ? pool_footprint(workers) : 0) +
+                         (lock_memory ? threads * sizeof(*starts) +
+                                        ARENA_ALIGN : 0) +
+                         RING_ARENA_SLACK);
+    if (!arena) return NULL;
+    ring = Arena.alloc(arena, sizeof(*ring) + threads * sizeof(pthread_t));
+    if (lock_memory) starts = Arena.alloc(arena, threads * sizeof(*starts));
+    if (!ring || (lock_memory && !starts)) {
+        Arena.destroy(arena);
+        return NULL;
+    }
+    ring->arena = arena;
+    ring->socket = NULL;
+    ring->pool = NULL;
+    ring->timers = NULL;
+    ring->reactor = NULL;
+    ring->pwm = NULL;
+    ring->led.notify.fd = 0;
+    ring->battery.minimum_vol = 3500; /* default 3500mV */
+    ring->battery.notify.fd = 0;
+    ring->notify.fd = 0;
+    /* published to the threads by their creation */
+    memset(&ring->device, 0, sizeof(ring->device));
+    ring->device.value[DEVICE_VOLTAGE] = 4100; /* default 4100mV) */
+    ring->red_led_gpio = 0;
+        
+    if (pthread_mutex_init(&(ring->lock), NULL)) {
+        Arena.destroy(arena);
+        return NULL;
+    }
+ 	if(Notifier.init(&ring->battery.notify, 0)) goto end;
+    if(Notifier.init(&ring->led.notify, 0)) goto end;
+    if(Notifier.init(&ring->notify, 0)) goto end;
+    if(Timer.open(ring)) goto end;
+    if(Pwm.open(ring)) goto end;
+    if (workers && !(ring->pool = pool_create(ring, workers))) goto end;
+    /* the pages mapped from now on (stacks included) are locked too */
+    if (lock_memory && mlockall(MCL_CURRENT | MCL_FUTURE))
+        perror("mlockall");
+    ring->run = 1;
+    /* create threads */
+    workers = 0;
+    for (ring->count = 0; ring->count < threads; ring->count++) {
+        void *(*task)(void *) = tasks ? *tasks++ : NULL;
+        void *arg = ring;
+        if (!task) {
+            task = pool_worker;
+            arg = workers < ring->pool->count ?
+                  ring->pool->workers[workers++] : NULL;
+        }
+        if (!arg || create_thread(ring->threads + ring->count, task, arg,
+                                  attrs ? attrs[ring->count] : NULL,
+                                  starts ? starts + ring->count : NULL)) {
+            /* signal */
+            ring_signal(ring);
+            /* wait for threads and destroy object */
+            ring_wait(ring);
+            /* return error */
+            return NULL;
+        };
+    }
+    return ring;
+end:
+    /* the notifiers not opened yet are 0, the rest is not set up yet */
+    ring_destroy(ring);
+    return NULL;    
+}
+
+static ring_p ring_create(int threads, void *(**tasks)(void *))
+{
+    return ring_create_attr(threads, tasks, NULL);
+}
+
+/* Task Management - add a task and perform all tasks in queue */
+
+static int ring_run(ring_p ring, void (*func)(void *), void *arg)
+{
+    struct task task = { .func = func, .arg = arg };
+
+    if (!ring || !func) return -1;
+    return pool_submit(ring, &task, 1);
+}
+
+static int ring_run_batch(ring_p ring, struct task *tasks, int n)
+{
+    if (!ring || !tasks) return -1;
+    return pool_submit(ring, tasks, n);
+}
+
+static int ring_wake(ring_p ring, notifier_p notify)
+{
+    if (!ring) return -1;
+
+    /* wake up any sleeping threads
+     * any activated threads will ask to require the mutex
+     * as soon as we write.
+     * we need to unlock before we write, or we will have excess
+     * context switches.
+     */
+    if (Notifier.signal(notify)) return -1;
+    Stats.add(STAT_WAKEUPS, 1);
+    return 0;
+}
+
+
+/* API gateway */
+const struct __THREAD_API__ Thread = {
+    .running = ring_running,
+    .create = ring_create,
+    .create_attr = ring_create_attr,
+    .signal = ring_signal,
+    .wait = ring_wait,
+    .finish = ring_finish,
+    .run = ring_run,
+    .run_batch = ring_run_batch,
+    .wake = ring_wake,
+};
@@ -1,203 +1,1053 @@
-#ifndef _RING_H
-#define _RING_H
-
-#include <unistd.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <syslog.h>
-#include <sys/socket.h>
-#include <netdb.h>
-#include <string.h>
-#include <errno.h>
-#include <stdint.h>
-#include <sys/epoll.h>
-#include <pthread.h>
-
-/* To get NI_MAXHOST and NI_MAXSERV
-      definitions from <netdb.h> */
-#ifndef _BSD_SOURCE
-#define _BSD_SOURCE             
-#endif 
-
-#define BUF_SIZE 1024
-
-/* Suggested length for string buffer that caller
- * should pass to inetAddressStr(). Must be greater
- * than (NI_MAXHOST + NI_MAXSERV + 4) 
- */
-#define IS_ADDR_STR_LEN 4096
-                                   
-/* a pointer to a RING object */                                   
-typedef struct RING *ring_p;
-
-/* a pointer to a Soecket object */
-typedef struct Socket *socket_p;
-
-/* a pointer to a Soecket object */
-typedef struct pipe *pipe_p;
-
-/** The pipe used for thread wakeup */
-struct pipe {
-    int in;  /**< read incoming data (opaque data), used for wakeup */
-    int out; /**< write opaque data (single byte),
-                  used for wakeup signaling */
-};
- 
-/* The server data object container */
-struct Socket {
-    struct SocketSettings *settings;
-    struct sockaddr_in servaddr; /* the server's full addr */
-    socklen_t len;
-    struct sockaddr_storage claddr; /* the client's addr */
-    int epfd;
-    struct epoll_event event;
-    ring_p ring;
-    struct pipe pipe; /* The pipe used for socket thread wake up*/
-    uint16_t buff[];
-};
-
-/*
- * The Socket Settings
- *
- * These settings will be used to setup socket behavior. Missing settings
- * will be filled in with default values. 
- */
- 
-struct SocketSettings {
-    int is_udp_server; /*server:1 client:0*/
-    char *service; /*a string to identify the socket's service*/
-    int port; /* the port to listen to. default to 8080. */
-    char *host;
-    char *address; /* the address to bind to. Default to NULL
-                        (all localhost addresses). */
-    int timeout_ms;  /**< set the timeout for receiving data.Default to 500ms. */
-    ring_p ring;
-    void (*on_open)(socket_p, int fd); /* called when a connection is opened. */
-    void (*on_data)(socket_p,int fd); /* called when a data is available. */
-    void (*on_close)(socket_p, int fd); /* called when connection was closed. */
-};	
-
-/*
- * A simple thread pool utilizing POSIX threads
- *
- * The thread pool can take any function and split it across a set number
- * of threads. It uses a combination of a pipe (for wakeup signals) and
- * mutexes (for managing the task queue) to give a basic layer of protection
- * to any function implementation.
- *
- */
-extern const struct __THREAD_API__ {
-    /*
-     * Create a new ring object (thread pool)
-     *        a pointer using the Async pointer type.
-     * param1 threads the number of new threads to be initialized, 
-     * param2 array of pointer to function returning pointer to function returning pointer to void
-     */
-    ring_p (*create)(int threads, void *(**tasks)(void *));
-
-    /*
-     * Signal an Thread object to finish up.
-     */
-    void (*signal)(ring_p);
-
-    /*
-     * \brief Waits for an ring object to finish up (joins all the threads
-     *        in the thread pool).
-     *
-     * This function will wait forever or until a signal is received and
-     * all the tasks in the queue have been processed.
-     */
-    void (*wait)(ring_p);
-
-    /*
-     * Schedules a task to be performed by an ring thread pool group.
-     */
-    int (*run)(ring_p, pipe_p);
-
-    /**
-     * Both signals for an ring object to finish up and waits
-     *        for it to finish.
-     *
-     * This is akin to calling both `signal` and `wait` in succession:
-     *   - Async.signal(async);
-     *   - Async.wait(async);
-     *
-     * @return  0 on success.
-     * @return -1 on error.
-     */
-    void (*finish)(ring_p);
-} Thread;
-
-/**
-* Socket API
-*
-* The simple design of Socket API is based on Protocol structure and callbacks,
-* so that we use this to create UDP server or client
-* The API and helper functions described here are accessed using the global
-* `Socket` object.
-*/
-extern const struct __SOCKET_API__ {
-	/* called when the Server starts */ 
-    int (*start_server)(struct SocketSettings);
-    
-    /* connect to server */
-    int (*connect)(socket_p);
-	/*
-     * Read up to `max_len` of data from a socket.
-     *
-     * the data is stored in the `buffer` and the number of bytes received
-     * is returned.
-     *
-     * return -1 if an error was raised and the connection was closed.
-     * return the number of bytes written to the buffer.
-     * return 0 if no data was available.
-     */
-    ssize_t (*read)(socket_p socket, int sockfd, void *buffer,
-              size_t max_len, struct sockaddr *);
-
-    /*
-     * Copy and write data to the socket.
-     *
-     * return 0 on success. success means that the data is in a buffer
-     *           waiting to be written. If the socket is forced to close
-     *           at this point, the buffer will be destroyed.
-     * return -1 on error.
-     */
-    ssize_t (*write)(socket_p socket, int sockfd, void *data, size_t len,
-               struct sockaddr *);
-               
-   /* Close the connection. */ 		
-    int (*close)(socket_p socket, int fd);
-    
-   /* Initialize socket*/
-    socket_p (*init)(struct SocketSettings settings, int buf_len);
-} Socket;
-
-struct RING {
-    struct {
-        int voltage; /* read via ADC. Units read are in units of millivolts. */
-        /*
-         * USB battery charger interface, which may be plugged and unplugged 
-         * at any time to charge or discharge the battery. 
-         * Assume that all battery charging functionality is independent 
-         * and properly working. 
-         */    
-        int charging;
-        int minimum_vol; /* While the battery voltage is < minimum_vol, the system shall be put in a non-functional state */
-	    struct pipe pipe; /* The pipe used for battery thread wake up*/ 
-    } battery;
-    struct {
-        int white_led_on; /* white LED, controllable by GPIO */
-        volatile int red_led_gpio; /* red LED GPIO, controllable by GPIO */
-	    struct pipe pipe; /* The pipe used for led thread wake up*/ 
-    } led;
-    socket_p socket;
-    int press_button; /* spring-loaded button that may be pushed and held by a user. */
-    pthread_mutex_t lock; /**< a mutex for data integrity */
-    struct pipe pipe; /* The pipe used for main func wake up*/
-    int count; /**< the number of initialized threads */    
-    unsigned run : 1; /**< the running flag */
-    pthread_t threads[]; /** the thread pool */
-};
-
-#endif
+#ifndef _RING_H
+#define _RING_H
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netdb.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <pthread.h>
+
+/* To get NI_MAXHOST and NI_MAXSERV
+      definitions from <netdb.h> */
+#ifndef _BSD_SOURCE
+#define _BSD_SOURCE             
+#endif 
+
+#define BUF_SIZE 1024
+
+/* the maximum number of datagrams moved by one batched read/write */
+#define SOCKET_BATCH 64
+
+#ifndef MAX_EVENTS
+#define MAX_EVENTS 32
+#endif
+
+/* Suggested length for string buffer that caller
+ * should pass to inetAddressStr(). Must be greater
+ * than (NI_MAXHOST + NI_MAXSERV + 4) 
+ */
+#define IS_ADDR_STR_LEN 4096
+                                   
+/* a pointer to a RING object */                                   
+typedef struct RING *ring_p;
+
+/* a pointer to a Soecket object */
+typedef struct Socket *socket_p;
+
+/* a pointer to a Notifier object */
+typedef struct notifier *notifier_p;
+
+/* a pointer to a Timer object */
+typedef struct timer *timer_p;
+
+/* a pointer to a Histogram object */
+typedef struct histogram *histogram_p;
+
+/* a pointer to a Stats snapshot */
+typedef struct stats_snapshot *stats_snapshot_p;
+
+/* a pointer to an Rto estimator */
+typedef struct rto *rto_p;
+
+/* a pointer to an Arena */
+typedef struct arena *arena_p;
+
+/* a pointer to a pool of packet Buffers */
+typedef struct packet_pool *packet_pool_p;
+
+/* a pointer to a table of peer Sessions */
+typedef struct sessions *sessions_p;
+
+/* a pointer to a Faults injector */
+typedef struct faults *faults_p;
+
+/* the alignment of every Arena object */
+#define ARENA_ALIGN 64
+
+/* a unit of work for the task pool */
+struct task {
+    void (*func)(void *arg);
+    void *arg;
+};
+
+/*
+ * How a thread of `Thread.create_attr` runs; zeroed fields keep the
+ * defaults of pthread_create().
+ */
+struct thread_attr {
+    uint64_t cpus; /* affinity, bit n for CPU n, 0 for any CPU */
+    int policy; /* SCHED_OTHER (0), SCHED_FIFO or SCHED_RR */
+    int priority; /* sched_priority of SCHED_FIFO/SCHED_RR, 1..99 */
+    size_t stack_size; /* 0 for the default */
+    int lock_memory; /* mlockall() and prefault the thread's stack */
+};
+
+/** The notifier used for thread wakeup */
+struct notifier {
+    int fd; /**< eventfd counter, every signal adds one wakeup and
+                 a single read consumes all pending wakeups */
+};
+ 
+/*
+ * A timer of the ring's timer wheel. The storage belongs to the caller,
+ * the wheel only links it while it is pending.
+ */
+struct timer {
+    void (*func)(void *arg); /* called on the thread dispatching timers */
+    void *arg;
+    uint64_t expires; /* private: tick (ms) of the next expiry */
+    unsigned period; /* private: re-arm period in ms, 0 for one shot */
+    struct timer *next, **pprev; /* private: wheel slot list */
+};
+
+/*
+ * A log-linear latency histogram: 32 linear buckets per power of 2,
+ * HIST_BUCKETS cover every 64-bit value within ~3%.
+ */
+#define HIST_SUB_BITS 5
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+struct histogram {
+    uint64_t count, sum, min, max;
+    uint64_t buckets[HIST_BUCKETS];
+};
+
+/* hot path counters, see the Stats API */
+enum stat_id {
+    STAT_PACKETS_READ,
+    STAT_BYTES_READ,
+    STAT_PACKETS_WRITTEN,
+    STAT_BYTES_WRITTEN,
+    STAT_EAGAIN, /* reads or writes that would block */
+    STAT_SOCKET_ERRORS,
+    STAT_SYSCALLS, /* socket I/O and wait syscalls of the backends */
+    STAT_EPOLL_CTL_FAILURES,
+    STAT_TASKS_QUEUED, /* Thread.run and Thread.run_batch */
+    STAT_TASKS_RUN,
+    STAT_TASKS_STOLEN,
+    STAT_WAKEUPS, /* wakeups posted by Thread.wake and the pool */
+    STAT_TIMERS_FIRED,
+    STAT_SESSIONS_OPENED,
+    STAT_SESSIONS_EVICTED, /* idle sessions removed by the sweep */
+    STAT_SESSIONS_FULL, /* peers without a session, the table was full */
+    STAT_FAULTS_DROPPED, /* replies hit by each injected fault */
+    STAT_FAULTS_DELAYED,
+    STAT_FAULTS_REORDERED,
+    STAT_FAULTS_DUPLICATED,
+    STAT_FAULTS_CORRUPTED,
+    STAT_FAULTS_OVERFLOW, /* held replies sent at once, the queue was full */
+    STAT_TRACE_DROPPED, /* events lost to a full trace ring or file */
+    STAT_STALE_DATAGRAMS, /* client: left over from a previous connect */
+    STAT_BUSY_NS, /* time between waits */
+    STAT_IDLE_NS, /* time blocked in waits */
+    STAT_IDLE_WAKEUPS, /* returns from the waits */
+    STAT_CPU_NS, /* CPU time of the thread, filled in by `snapshot` */
+    STAT_COUNT
+};
+
+#define STATS_THREADS 256 /* threads with a slot of their own */
+#define STATS_NAME_LEN 16
+
+struct stats_snapshot {
+    uint64_t total[STAT_COUNT];
+    int threads;
+    struct {
+        char name[STATS_NAME_LEN];
+        uint64_t counters[STAT_COUNT];
+    } thread[STATS_THREADS];
+};
+
+/* the retransmission timeout of a socket, see the Rto API */
+struct rto {
+    int64_t srtt_us, rttvar_us; /* smoothed RTT and its variation */
+    int rto_us; /* the timeout before backoff */
+    int min_us, max_us;
+    int backoff; /* timeouts since the last sample, the timeout doubles */
+    unsigned samples;
+    int fixed; /* always timeout_ms */
+};
+
+/* The server data object container */
+struct Socket {
+    struct SocketSettings *settings;
+    struct sockaddr_storage servaddr; /* the server's full addr */
+    socklen_t len;
+    struct sockaddr_storage claddr; /* the client's addr */
+    int epfd; /* the epoll backend's wait set */
+    int clfd; /* client: the socket connected to the server, 0 if none */
+    ring_p ring;
+    struct notifier notify; /* The notifier used for socket thread wake up*/
+    const struct socket_backend *backend; /* the I/O backend */
+    struct rto rto; /* client: the retransmission timeout */
+    void *io; /* the state of the backend, after Socket.open */
+    arena_p arena; /* the arena the socket lives in */
+    packet_pool_p buffers; /* server: the packet buffers of this worker */
+    uint16_t buff[];
+};
+
+/*
+ * The Socket Settings
+ *
+ * These settings will be used to setup socket behavior. Missing settings
+ * will be filled in with default values. 
+ */
+ 
+struct SocketSettings {
+    int is_udp_server; /*server:1 client:0*/
+    char *service; /*a string to identify the socket's service*/
+    int port; /* the port to listen to. default to 8080. */
+    char *host;
+    char *address; /* the address to bind to. Default to NULL
+                        (all localhost addresses). */
+    int timeout_ms;  /**< set the timeout for receiving data.Default to 500ms. */
+    int fixed_timeout; /* client: always wait timeout_ms for an echo. By
+                          default the timeout adapts to the measured RTT,
+                          starting at timeout_ms. */
+    int rto_min_ms, rto_max_ms; /* bounds of the adaptive timeout. Default
+                          to 10ms and 3000ms. */
+    int window; /* client: echo counters in flight. Default to 1
+                   (stop-and-wait). */
+    int reconnect; /* client: a new socket and wait set for every
+                      connect, closed when it returns. By default one
+                      connected socket is kept across connects. */
+    int workers; /* number of server worker threads, each one owns a
+                    SO_REUSEPORT socket and an epoll loop. Default to 1
+                    (serve from the calling thread). */
+    int buffers; /* server: packet buffers of BUF_SIZE per worker.
+                    Default to 2 * SOCKET_BATCH. */
+    const struct socket_backend *backend; /* the I/O backend, default to
+                    EpollBackend. */
+    ring_p ring;
+    void (*on_open)(socket_p, int fd); /* called when a connection is opened. */
+    void (*on_data)(socket_p,int fd); /* called when a data is available. */
+    void (*on_close)(socket_p, int fd); /* called when connection was closed. */
+};	
+
+/*
+ * Socket I/O backend
+ *
+ * The syscalls behind the Socket API. `open` creates the wait set of a
+ * socket, `add` puts an fd in it (`datagrams` for the UDP socket itself,
+ * otherwise readability, e.g. a notifier), `wait` fills `fds` with the
+ * ready ones. The read/write calls follow the Socket API.
+ */
+struct socket_backend {
+    const char *name;
+    int (*open)(socket_p socket);
+    int (*add)(socket_p socket, int fd, int datagrams);
+    int (*wait)(socket_p socket, int *fds, int max, int timeout_ms);
+    ssize_t (*read)(socket_p socket, int fd, void *buffer, size_t max_len,
+                    struct sockaddr *addr);
+    ssize_t (*write)(socket_p socket, int fd, void *data, size_t len,
+                     struct sockaddr *addr);
+    int (*read_batch)(socket_p socket, int fd, struct iovec *iov,
+                      struct sockaddr_storage *addrs, int vlen);
+    int (*write_batch)(socket_p socket, int fd, struct iovec *iov,
+                       struct sockaddr_storage *addrs, int vlen);
+    void (*close)(socket_p socket);
+};
+
+/* readiness with epoll and one syscall per read or write (the default) */
+extern const struct socket_backend EpollBackend;
+
+/* multishot recvmsg into provided buffers, writes queued on an io_uring
+ * and submitted with the next wait */
+extern const struct socket_backend UringBackend;
+
+/*
+ * Notifier API
+ *
+ * Coalescing wakeups backed by an eventfd. Signals posted while nobody
+ * waits add up, and the waiter takes all of them with a single read.
+ * `notify->fd` may also be added to an epoll set (readable while signals
+ * are pending), then `drain` consumes them.
+ */
+extern const struct __NOTIFIER_API__ {
+    /*
+     * Initialize a notifier. With `semaphore` set every wait consumes a
+     * single wakeup, so that several threads may share the notifier.
+     *
+     * return 0 on success, -1 on error.
+     */
+    int (*init)(notifier_p, int semaphore);
+
+    /* Post one wakeup. */
+    int (*signal)(notifier_p);
+
+    /*
+     * Block until the notifier is signalled.
+     *
+     * return the number of wakeups consumed, -1 on error.
+     */
+    int64_t (*wait)(notifier_p);
+
+    /* Consume the pending wakeups once epoll reported the fd readable. */
+    int64_t (*drain)(notifier_p);
+
+    /* Release the notifier. */
+    void (*close)(notifier_p);
+} Notifier;
+
+/*
+ * Clock API
+ *
+ * The time of the timer wheel and of the clients: the monotonic clock,
+ * or a virtual clock for deterministic simulations that only moves with
+ * `advance` and `sleep_ms` (a Reactor advances it to the next timer).
+ */
+extern const struct __CLOCK_API__ {
+    int64_t (*now_ns)(void);
+    int64_t (*now_us)(void);
+    int64_t (*now_ms)(void);
+
+    /*
+     * Switch to the virtual clock, seeding `random` with `seed`. Call it
+     * before any ring is created.
+     */
+    void (*virtualize)(uint64_t seed);
+    int (*is_virtual)(void);
+
+    /* Move the virtual clock forward to `ns` (never back). */
+    void (*advance)(int64_t ns);
+
+    /* Sleep `ms`, or advance the virtual clock by `ms`. */
+    void (*sleep_ms)(unsigned ms);
+
+    /* A 64-bit pseudo random number, reproducible on the virtual clock. */
+    uint64_t (*random)(void);
+} Clock;
+
+/*
+ * Timer API
+ *
+ * A hierarchical timer wheel with 1ms ticks per ring object, driven by a
+ * single timerfd that is armed for the next due tick only. Callbacks run
+ * on whichever thread dispatches the wheel: the `Timer.task` thread, or
+ * an event loop that waits on `Timer.fd` and calls `Timer.dispatch`.
+ */
+extern const struct __TIMER_API__ {
+    /* Create and release the ring's timer wheel (done by Thread API). */
+    int (*open)(ring_p);
+    void (*close)(ring_p);
+
+    /* Initialize a timer calling `func(arg)` when it expires. */
+    void (*init)(timer_p, void (*func)(void *arg), void *arg);
+
+    /*
+     * Arm `timer` to expire in `delay_ms` and then every `period_ms`
+     * (0 for a one shot timer). Scheduling a pending timer moves it.
+     *
+     * return 0 on success, -1 on error.
+     */
+    int (*schedule)(ring_p, timer_p, unsigned delay_ms, unsigned period_ms);
+
+    /* Move a timer to expire in `delay_ms`, keeping its period. */
+    int (*rearm)(ring_p, timer_p, unsigned delay_ms);
+
+    /*
+     * Cancel a timer. A callback that is already running on the timer
+     * thread is not waited for.
+     *
+     * return 1 if the timer was pending, 0 otherwise.
+     */
+    int (*cancel)(ring_p, timer_p);
+
+    /* return 1 if the timer is armed and has not expired yet. */
+    int (*pending)(ring_p, timer_p);
+
+    /* Run the callbacks of every expired timer, return how many ran. */
+    int (*dispatch)(ring_p);
+
+    /* The timerfd, readable when `dispatch` has work to do. */
+    int (*fd)(ring_p);
+
+    /* The Clock time the wheel next has work to do, -1 if never. */
+    int64_t (*next)(ring_p);
+
+    /* Wake the thread waiting on the timerfd (e.g. to stop it). */
+    void (*wake)(ring_p);
+
+    /* Thread function dispatching the ring's timers until it stops. */
+    void *(*task)(void *ring);
+} Timer;
+
+/*
+ * Histogram API
+ *
+ * HDR style histograms for latency percentiles. A histogram is recorded
+ * by one thread, any thread may read it meanwhile.
+ */
+extern const struct __HISTOGRAM_API__ {
+    void (*init)(histogram_p);
+
+    /* Record one sample. */
+    void (*record)(histogram_p, uint64_t value);
+
+    /* Add the samples of `src` into `dst`. */
+    void (*merge)(histogram_p dst, histogram_p src);
+
+    /* The value at or below which `percent` of the samples fall. */
+    uint64_t (*percentile)(histogram_p, double percent);
+
+    /* Print count, min, avg, p50, p99, p99.9 and max on one line. */
+    void (*print)(histogram_p, const char *label, const char *unit, FILE *);
+} Histogram;
+
+/*
+ * Rto API
+ *
+ * Adaptive retransmission timeout: SRTT/RTTVAR smoothing of the echo RTT
+ * with exponential backoff on timeouts, clamped to the socket's bounds.
+ */
+extern const struct __RTO_API__ {
+    /* Start from settings->timeout_ms, or stay there if fixed_timeout. */
+    void (*init)(rto_p, const struct SocketSettings *settings);
+
+    /* Feed the RTT of a datagram that was sent only once. */
+    void (*sample)(rto_p, uint32_t rtt_us);
+
+    /* A timeout expired: double the timeout, up to the maximum. */
+    void (*backoff)(rto_p);
+
+    /* The milliseconds to wait for an echo. */
+    int (*timeout)(rto_p);
+} Rto;
+
+/*
+ * Arena API
+ *
+ * One up front allocation for objects that share a lifetime, chained
+ * with a new chunk if the estimate was too small. Objects are zeroed,
+ * aligned to ARENA_ALIGN and released together by `destroy`.
+ */
+extern const struct __ARENA_API__ {
+    /* Create an arena with room for `size` bytes of objects. */
+    arena_p (*create)(size_t size);
+
+    /* Allocate `size` zeroed bytes, NULL if out of memory. */
+    void *(*alloc)(arena_p, size_t size);
+
+    /* Bytes reserved from the system, and handed out so far. */
+    size_t (*reserved)(arena_p);
+    size_t (*used)(arena_p);
+
+    /* Release the arena and every object in it. */
+    void (*destroy)(arena_p);
+} Arena;
+
+/*
+ * Buffers API
+ *
+ * A fixed set of packet buffers carved from an arena, with a freelist.
+ * Borrowing and returning never allocates. A pool belongs to one thread.
+ */
+extern const struct __BUFFERS_API__ {
+    /* Arena bytes needed by a pool of `count` buffers of `size`. */
+    size_t (*footprint)(int count, size_t size);
+
+    /* Carve a pool of `count` buffers of `size` bytes from `arena`. */
+    packet_pool_p (*create)(arena_p arena, int count, size_t size);
+
+    /* Borrow a buffer, NULL if all of them are out. */
+    void *(*get)(packet_pool_p);
+
+    /* Return a borrowed buffer. */
+    void (*put)(packet_pool_p, void *buf);
+
+    /*
+     * Borrow up to `n` buffers into `iov`, with `iov_len` set to the
+     * buffer size. Return the number borrowed.
+     */
+    int (*get_batch)(packet_pool_p, struct iovec *iov, int n);
+
+    /* Return the `n` buffers of `iov`. */
+    void (*put_batch)(packet_pool_p, struct iovec *iov, int n);
+
+    /* The size of a buffer, and the buffers not borrowed. */
+    size_t (*size)(packet_pool_p);
+    int (*available)(packet_pool_p);
+} Buffers;
+
+/* the state kept for a peer, 24 bytes */
+struct session {
+    uint64_t key; /* the peer address and port, 0 if the slot is free */
+    uint32_t last_seen; /* ms, as passed to lookup */
+    uint32_t packets; /* datagrams received from the peer */
+    uint32_t bytes; /* bytes received from the peer, wraps */
+    uint16_t last_counter; /* the last counter the peer sent */
+    uint16_t flags; /* free for the application */
+};
+
+/*
+ * Sessions API
+ *
+ * A fixed capacity hash table of per peer state keyed by source address,
+ * with incremental eviction of the peers idle for longer than `idle_ms`.
+ * The memory is allocated once, a table belongs to one thread.
+ */
+extern const struct __SESSIONS_API__ {
+    /* Bytes used by a table of `max` peers. */
+    size_t (*footprint)(int max);
+
+    /* Create a table for up to `max` peers. */
+    sessions_p (*create)(int max, int idle_ms);
+
+    /*
+     * Find the session of `addr`, or open one. Stamp it with `now_ms`
+     * and sweep a few slots for idle sessions. NULL if the table is full.
+     * The returned pointer is valid until the next lookup or expire.
+     */
+    struct session *(*lookup)(sessions_p, const struct sockaddr *addr,
+                              uint32_t now_ms);
+
+    /* Sweep `budget` slots for idle sessions, return the number evicted. */
+    int (*expire)(sessions_p, uint32_t now_ms, int budget);
+
+    unsigned (*count)(sessions_p);
+    void (*destroy)(sessions_p);
+} Sessions;
+
+/* the faults a reply can be hit by */
+enum fault_kind {
+    FAULT_DROP,
+    FAULT_DELAY, /* held for delay_ms */
+    FAULT_REORDER, /* held 1..reorder_ms, so later replies overtake it */
+    FAULT_DUPLICATE, /* sent twice */
+    FAULT_CORRUPT, /* first byte incremented */
+    FAULT_KINDS
+};
+
+/*
+ * when a fault hits: the reply `at` of every `every` replies of a peer,
+ * and/or at random with `probability` (0..1)
+ */
+struct fault_rule {
+    double probability;
+    int every, at;
+};
+
+struct fault_plan {
+    struct fault_rule rule[FAULT_KINDS];
+    int delay_ms; /* default to 600 */
+    int reorder_ms; /* default to 10 */
+    int queue; /* replies held at once, default to 1024 */
+    uint64_t seed; /* of the random faults, 0 for a random seed */
+};
+
+/*
+ * Faults API
+ *
+ * A fault injection stage for a server's replies. Held (delayed,
+ * reordered, duplicated) replies wait in a queue ordered by due time
+ * behind a timerfd that the server adds to its wait set, so the event
+ * loop never sleeps. An injector belongs to one thread.
+ */
+extern const struct __FAULTS_API__ {
+    /*
+     * Fill `plan` from a preset, "none" or "classic" (delay the reply 3
+     * and corrupt the reply 6 of every 20), or from a list such as
+     * "drop=0.01,delay=20:3,dup=0.001,delay_ms=200,seed=1".
+     *
+     * return 0 on success, -1 if `spec` is invalid.
+     */
+    int (*plan)(struct fault_plan *plan, const char *spec);
+
+    faults_p (*create)(const struct fault_plan *plan);
+
+    /*
+     * Apply the plan to the reply number `n` of a peer, in place.
+     *
+     * return 1 if the caller sends it now, 0 if it was dropped or held.
+     */
+    int (*filter)(faults_p, uint32_t n, void *data, size_t len,
+                  const struct sockaddr *addr);
+
+    /* The timerfd, readable when held replies are due. */
+    int (*fd)(faults_p);
+
+    /* Send the due replies on `fd` of `socket`, return how many. */
+    int (*dispatch)(faults_p, socket_p socket, int fd);
+
+    /* The replies held. */
+    int (*held)(faults_p);
+    void (*destroy)(faults_p);
+} Faults;
+
+/*
+ * Resolver API
+ *
+ * A process wide cache of resolved hosts, refreshed by a background
+ * thread before the entries expire, so a warm lookup does not block.
+ */
+extern const struct __RESOLVER_API__ {
+    /*
+     * Copy the address of `host` with `port` into `addr`, IPv4 if it has
+     * one, else IPv6. A host looked up before is answered from the
+     * cache at once, an expired entry (or failure) too while it is
+     * refreshed in the background; only the first lookup of a host
+     * waits for it, up to `wait_ms`.
+     *
+     * return 0 on success, -1 if the host is not resolved (yet).
+     */
+    int (*lookup)(const char *host, int port, struct sockaddr_storage *addr,
+                  int wait_ms);
+
+    /* Start resolving `host` in the background, to warm the cache. */
+    void (*prefetch)(const char *host, int port);
+
+    /* How long answers and failures are cached, default 60s and 5s. */
+    void (*ttl)(int ttl_ms, int negative_ms);
+
+    /*
+     * Answer the queries with `query` instead of getaddrinfo(), NULL to
+     * go back, for tests. `query` fills `addr` and returns 0, or returns
+     * -1 if `host` does not resolve.
+     */
+    void (*stub)(int (*query)(const char *host, int port,
+                              struct sockaddr_storage *addr));
+} Resolver;
+
+/* a callback for a readable fd of a Reactor */
+struct handler {
+    int fd;
+    void (*func)(void *arg);
+    void *arg;
+};
+
+/*
+ * Reactor API
+ *
+ * Runs everything of a ring created with no threads (`Thread.create(0,
+ * NULL)`) on one thread: readable fds (sockets, notifiers) call their
+ * handler, the timerfd dispatches the timer wheel. The handlers and the
+ * timer callbacks never run concurrently, so they need no locks.
+ */
+extern const struct __REACTOR_API__ {
+    /* Create and release the event loop of `ring`. */
+    int (*open)(ring_p);
+    void (*close)(ring_p);
+
+    /*
+     * Call `func(arg)` whenever `fd` is readable (level triggered), until
+     * the handler is removed. `h` must stay valid until then.
+     *
+     * return 0 on success, -1 on error.
+     */
+    int (*add)(ring_p, struct handler *h, int fd, void (*func)(void *arg),
+               void *arg);
+    int (*remove)(ring_p, struct handler *h);
+
+    /*
+     * Dispatch the handlers and the timers on the calling thread until
+     * `Thread.signal`. On the virtual clock, whenever no fd is ready the
+     * clock jumps to the next timer, and `run` returns once there is
+     * neither.
+     *
+     * return 0 when signaled (or out of events), -1 on error.
+     */
+    int (*run)(ring_p);
+} Reactor;
+
+/* a periodic output of the PWM engine, owned by the caller */
+struct pwm_channel {
+    void (*write)(void *arg, int level); /* drives the GPIO */
+    void *arg;
+    struct histogram jitter; /* lateness of every edge, in ns */
+    /* private: the waveform asked for, taken at the next edge */
+    int64_t period_ns, high_ns;
+    /* private: the waveform being output */
+    int64_t next_ns; /* deadline of the next edge, 0 for a steady level */
+    int level;
+    struct pwm_channel *next;
+};
+typedef struct pwm_channel *pwm_channel_p;
+
+/*
+ * PWM API
+ *
+ * Periodic GPIO waveforms on absolute deadlines, any number of channels
+ * on one thread. `Pwm.task` polls a timerfd armed for the earliest edge
+ * (TFD_TIMER_ABSTIME) and a notifier that `set` signals, so the edges
+ * keep their phase however late a wakeup is; a ring with a Reactor
+ * drives them from the timer wheel instead (ms resolution). Every edge
+ * records how late it came.
+ */
+extern const struct __PWM_API__ {
+    /* Create and release the ring's PWM engine (done by Thread API). */
+    int (*open)(ring_p);
+    void (*close)(ring_p);
+
+    /*
+     * Add a channel calling `write(arg, level)` on the engine's thread
+     * for every edge. It starts steady low.
+     */
+    void (*add)(ring_p, pwm_channel_p, void (*write)(void *arg, int level),
+                void *arg);
+
+    /*
+     * Output `hz` with `duty` (0..1) high; a duty of 0 or 1, or 0 hz,
+     * is a steady level. A running waveform changes at its next edge, a
+     * steady channel starts at once.
+     */
+    void (*set)(ring_p, pwm_channel_p, double hz, double duty);
+
+    /* Wake the engine's thread (e.g. to stop it). */
+    void (*wake)(ring_p);
+
+    /* Thread function running the edges until the ring stops. */
+    void *(*task)(void *ring);
+} Pwm;
+
+/*
+ * Stats API
+ *
+ * Per thread, cache line padded counters updated with relaxed atomics,
+ * cheap enough to stay on in production. The Socket and Thread APIs
+ * count their packets, errors, tasks, wakeups and busy/idle time, an
+ * application may add its own.
+ */
+extern const struct __STATS_API__ {
+    /* Add `n` to counter `id` of the calling thread. */
+    void (*add)(enum stat_id id, uint64_t n);
+
+    /* Label the calling thread in the dumps. */
+    void (*name)(const char *name);
+
+    /*
+     * Mark the calling thread blocked (idle_begin) and running again
+     * (idle_end); the time in between is idle, the rest busy. Every
+     * idle_end counts a wakeup.
+     */
+    void (*idle_begin)(void);
+    void (*idle_end)(void);
+
+    /* Sum every thread's counters, without locks. */
+    void (*snapshot)(stats_snapshot_p);
+
+    /* Print a snapshot as text, or as one line of JSON. */
+    void (*dump)(stats_snapshot_p, FILE *, int json);
+} Stats;
+
+/* the events of the Trace API, their messages are in trace.c */
+enum trace_id {
+    TRACE_ECHO, /* a: counter echoed, reported in order */
+    TRACE_ECHO_TIMEOUT, /* a: timeout ms, b: counter re-sent */
+    TRACE_ECHO_MISMATCH,
+    TRACE_ECHO_OVERFLOW,
+    TRACE_SOCKET_OPEN,
+    TRACE_SOCKET_CLOSE,
+    TRACE_BUTTON_PUSH,
+    TRACE_BUTTON_RELEASE,
+    TRACE_CHARGING_ON,
+    TRACE_CHARGING_OFF,
+    TRACE_BATTERY, /* a: voltage in mV */
+    TRACE_LOW_BATTERY,
+    TRACE_WHITE_LED_ON,
+    TRACE_WHITE_LED_OFF,
+    TRACE_RED_LED_BLINK, /* a: high ms, b: low ms */
+    TRACE_RED_LED_STOP,
+    TRACE_IDS
+};
+
+/* a recorded event, as laid out in the trace file */
+struct trace_event {
+    uint64_t ns; /* Clock.now_ns */
+    uint16_t id;
+    uint16_t thread; /* the recording thread, in order of first event */
+    int32_t a;
+    int64_t b;
+};
+
+/*
+ * Trace API
+ *
+ * Fixed size binary events instead of printf/fflush in the hot paths.
+ * Until `open` the events are printed as they happen; after it each
+ * thread appends to a ring of its own and a background thread moves
+ * them to a mapped file, which `decode` renders as the same messages.
+ */
+extern const struct __TRACE_API__ {
+    /*
+     * Record from now on to `path`, a file of up to `max_bytes` (0 for
+     * 64 MB). return 0 on success, -1 on error.
+     */
+    int (*open)(const char *path, size_t max_bytes);
+
+    /*
+     * Record `id` with its arguments on the calling thread's ring: a
+     * timestamp and a few stores, it never blocks. An event that finds
+     * the ring full is dropped and counted (STAT_TRACE_DROPPED).
+     */
+    void (*event)(enum trace_id id, int32_t a, int64_t b);
+
+    /* Flush the events left and close the file. */
+    void (*close)(void);
+
+    /*
+     * Print the events of a trace file in time order: the messages they
+     * stand for, or one line of time, thread, name and arguments each
+     * if `raw`. return the events read, -1 on error.
+     */
+    long (*decode)(const char *path, FILE *out, int raw);
+} Trace;
+
+/*
+ * A simple thread pool utilizing POSIX threads
+ *
+ * The thread pool can take any function and split it across a set number
+ * of threads. Every pool worker owns a lock-free deque and steals from the
+ * others when it runs dry; tasks submitted from other threads go through
+ * a mutex protected injection queue. Idle workers sleep on a notifier
+ * (for wakeup signals).
+ *
+ */
+extern const struct __THREAD_API__ {
+    /*
+     * Create a new ring object (thread pool)
+     *        a pointer using the Async pointer type.
+     * param1 threads the number of new threads to be initialized, 
+     * param2 array of pointer to function returning pointer to function returning pointer to void
+     *
+     * A NULL entry (or a NULL array) makes that thread a worker of the
+     * task pool that serves `run` and `run_batch`.
+     */
+    ring_p (*create)(int threads, void *(**tasks)(void *));
+
+    /*
+     * `create` with attributes: `attrs[i]` is applied to thread i, a NULL
+     * array or entry keeps the defaults. Memory is locked once, before
+     * the first thread with `lock_memory` starts. A real time policy the
+     * process may not use (EPERM) falls back to the default one with a
+     * warning; any other failure fails the ring.
+     */
+    ring_p (*create_attr)(int threads, void *(**tasks)(void *),
+                          const struct thread_attr **attrs);
+
+    /*
+     * Signal an Thread object to finish up.
+     */
+    void (*signal)(ring_p);
+
+    /*
+     * \brief Waits for an ring object to finish up (joins all the threads
+     *        in the thread pool).
+     *
+     * This function will wait forever or until a signal is received and
+     * all the tasks in the queue have been processed.
+     */
+    void (*wait)(ring_p);
+
+    /*
+     * Schedules a task to be performed by an ring thread pool group.
+     *
+     * `func(arg)` is queued on the calling worker's deque (or on the
+     * injection queue from any other thread) and an idle worker is woken.
+     * Tasks queued before `finish` are all run before `wait` returns.
+     *
+     * return 0 on success.
+     * return -1 if there is no pool or the ring is finishing.
+     */
+    int (*run)(ring_p, void (*func)(void *), void *arg);
+
+    /* Schedules `n` tasks at once, with a single wakeup. */
+    int (*run_batch)(ring_p, struct task *tasks, int n);
+
+    /* Wakes up the task thread sleeping on `notify`. */
+    int (*wake)(ring_p, notifier_p);
+
+    /* 1 until `signal` is called, safe to poll from any thread. */
+    int (*running)(ring_p);
+
+    /**
+     * Both signals for an ring object to finish up and waits
+     *        for it to finish.
+     *
+     * This is akin to calling both `signal` and `wait` in succession:
+     *   - Async.signal(async);
+     *   - Async.wait(async);
+     *
+     * @return  0 on success.
+     * @return -1 on error.
+     */
+    void (*finish)(ring_p);
+} Thread;
+
+/* the fields of the device state, see the Device API */
+enum device_field {
+    DEVICE_VOLTAGE, /* battery voltage read via ADC, in millivolts */
+    DEVICE_CHARGING, /* the USB charger is plugged in */
+    DEVICE_BUTTON, /* the spring-loaded button is pushed and held */
+    DEVICE_WHITE_LED, /* white LED GPIO */
+    DEVICE_RED_LED, /* red LED GPIO */
+    DEVICE_FIELDS
+};
+
+/* a consistent copy of the device state, see `Device.snapshot` */
+struct device_state {
+    int value[DEVICE_FIELDS];
+};
+
+/*
+ * Device state
+ *
+ * The battery, charger, button and LED state that the tasks share. The
+ * fields are atomic and published under a sequence lock: `snapshot`
+ * gives the conditions that read several fields one consistent state
+ * without a lock and without writing to the reader's cache line.
+ */
+extern const struct __DEVICE_API__ {
+    /* The current value of `field`. */
+    int (*get)(ring_p, enum device_field field);
+
+    /* Set `field` to `value`, return the previous value. */
+    int (*set)(ring_p, enum device_field field, int value);
+
+    /* Add `delta` to `field`, return the new value. */
+    int (*add)(ring_p, enum device_field field, int delta);
+
+    /* Copy every field at once, retrying while a writer is active. */
+    void (*snapshot)(ring_p, struct device_state *state);
+} Device;
+
+/**
+* Socket API
+*
+* The simple design of Socket API is based on Protocol structure and callbacks,
+* so that we use this to create UDP server or client
+* The API and helper functions described here are accessed using the global
+* `Socket` object.
+*/
+extern const struct __SOCKET_API__ {
+	/*
+     * Serve until the workers stop. return -1 if a worker's socket could
+     * not be set up (e.g. bind failed) or its thread did not start; the
+     * workers started already are stopped first.
+     */
+    int (*start_server)(struct SocketSettings);
+    
+    /*
+     * Connect to the server and run `on_data` until it returns. The
+     * first call resolves the host, opens a UDP socket connect()ed to
+     * it and the backend's wait set and calls `on_open`; later calls
+     * reuse them (`Socket.clfd`) after dropping the datagrams queued in
+     * between, unless `SocketSettings.reconnect`.
+     */
+    int (*connect)(socket_p);
+
+    /*
+     * Open the wait set of the socket's backend. An io_uring that can not
+     * be set up falls back to epoll.
+     */
+    int (*open)(socket_p);
+
+    /* Watch `fd`: the UDP socket (`datagrams` set) or any readable fd. */
+    int (*add)(socket_p, int fd, int datagrams);
+
+    /*
+     * Wait up to `timeout_ms` (-1 forever) for watched fds to get ready.
+     * return the number of fds stored in `fds`, 0 on timeout.
+     */
+    int (*wait)(socket_p, int *fds, int max, int timeout_ms);
+	/*
+     * Read up to `max_len` of data from a socket.
+     *
+     * the data is stored in the `buffer` and the number of bytes received
+     * is returned.
+     *
+     * return -1 if an error was raised and the connection was closed.
+     * return the number of bytes written to the buffer.
+     * return 0 if no data was available.
+     */
+    ssize_t (*read)(socket_p socket, int sockfd, void *buffer,
+              size_t max_len, struct sockaddr *);
+
+    /*
+     * Copy and write data to the socket.
+     *
+     * return 0 on success. success means that the data is in a buffer
+     *           waiting to be written. If the socket is forced to close
+     *           at this point, the buffer will be destroyed.
+     * return -1 on error.
+     */
+    ssize_t (*write)(socket_p socket, int sockfd, void *data, size_t len,
+               struct sockaddr *);
+
+    /*
+     * Read up to `vlen` (at most SOCKET_BATCH) datagrams with one syscall.
+     *
+     * `iov[i]` is the buffer of message i, on return its `iov_len` holds
+     * the number of bytes received and `addrs[i]` the sender's address.
+     * `addrs` may be NULL for a connected socket.
+     *
+     * return the number of datagrams read.
+     * return 0 if no data was available.
+     * return -1 on error.
+     */
+    int (*read_batch)(socket_p socket, int sockfd, struct iovec *iov,
+              struct sockaddr_storage *addrs, int vlen);
+
+    /*
+     * Write `vlen` (at most SOCKET_BATCH) datagrams with one syscall,
+     * message i is `iov[i]` sent to `addrs[i]`.
+     *
+     * return the number of datagrams sent.
+     * return -1 on error.
+     */
+    int (*write_batch)(socket_p socket, int sockfd, struct iovec *iov,
+              struct sockaddr_storage *addrs, int vlen);
+               
+   /* Close the connection. */ 		
+    int (*close)(socket_p socket, int fd);
+    
+   /*
+    * Initialize a socket with `buf_len` bytes of `buff`. The socket and
+    * its copy of the settings share one arena.
+    */
+    socket_p (*init)(struct SocketSettings settings, int buf_len);
+
+    /* Release a socket made by `init`. */
+    void (*destroy)(socket_p socket);
+} Socket;
+
+/*
+ * The fields written while the tasks run each have a cache line of their
+ * own, so a writer never invalidates the line of a reader that does not
+ * care; everything before them is only written by `create`.
+ */
+struct RING {
+    struct {
+        int minimum_vol; /* While the battery voltage is < minimum_vol, the system shall be put in a non-functional state */
+	    struct notifier notify; /* The notifier used for battery thread wake up*/
+    } battery;
+    struct {
+	    struct notifier notify; /* The notifier used for led thread wake up*/
+    } led;
+    socket_p socket;
+    struct pool *pool; /* the work-stealing task pool, NULL without workers */
+    struct timer_wheel *timers; /* the timer wheel */
+    struct reactor *reactor; /* the event loop of a ring without threads */
+    struct pwm *pwm; /* the PWM engine */
+    arena_p arena; /* holds the ring, its pool and its timer wheel */
+    struct notifier notify; /* The notifier used for main func wake up*/
+    int count; /**< the number of initialized threads */    
+    /* guards the injection queue of the task pool */
+    pthread_mutex_t lock __attribute__((aligned(64)));
+    int run __attribute__((aligned(64))); /**< the running flag, atomic */
+    /* the Device state but the red LED, odd `seq` while being written */
+    struct {
+        unsigned seq;
+        int value[DEVICE_FIELDS];
+    } device __attribute__((aligned(64)));
+    /* the red LED toggles on every blink edge, apart from the rest */
+    int red_led_gpio __attribute__((aligned(64)));
+    pthread_t threads[]; /** the thread pool */
+};
+
+#endif
@@ -0,0 +1,78 @@
+#include "ring.h"
+
+/*
+ * Retransmission timeout estimator (RFC 6298)
+ *
+ * SRTT and RTTVAR are smoothed with gains of 1/8 and 1/4 and the timeout
+ * is SRTT + 4 * RTTVAR (at least one clock tick), clamped to [min, max].
+ * Every timeout doubles it until the next valid sample. Callers only feed
+ * samples of datagrams that were never retransmitted (Karn's rule), as
+ * the echo of a retransmitted one can not be matched to its transmission.
+ * Before the first sample, and in fixed mode, the timeout is timeout_ms.
+ */
+#define RTO_GRANULARITY_US 1000 /* the timers tick in ms */
+#define RTO_MIN_MS 10
+#define RTO_MAX_MS 3000
+
+static int rto_clamp(rto_p rto, int64_t us)
+{
+    if (us < rto->min_us) us = rto->min_us;
+    if (us > rto->max_us) us = rto->max_us;
+    return us;
+}
+
+static void rto_init(rto_p rto, const struct SocketSettings *settings)
+{
+    int timeout_ms = settings->timeout_ms > 0 ? settings->timeout_ms : 500;
+
+    memset(rto, 0, sizeof(*rto));
+    rto->fixed = settings->fixed_timeout;
+    rto->min_us = (settings->rto_min_ms > 0 ? settings->rto_min_ms
+                                            : RTO_MIN_MS) * 1000;
+    rto->max_us = (settings->rto_max_ms > 0 ? settings->rto_max_ms
+                                            : RTO_MAX_MS) * 1000;
+    if (rto->max_us < rto->min_us) rto->max_us = rto->min_us;
+    rto->rto_us = timeout_ms * 1000;
+    if (!rto->fixed) rto->rto_us = rto_clamp(rto, rto->rto_us);
+}
+
+static void rto_sample(rto_p rto, uint32_t rtt_us)
+{
+    int64_t var;
+
+    if (rto->fixed) return;
+    if (!rto->samples++) {
+        rto->srtt_us = rtt_us;
+        rto->rttvar_us = rtt_us / 2;
+    } else {
+        int64_t err = (int64_t)rtt_us - rto->srtt_us;
+        rto->rttvar_us += ((err < 0 ? -err : err) - rto->rttvar_us) / 4;
+        rto->srtt_us += err / 8;
+    }
+    var = 4 * rto->rttvar_us;
+    rto->rto_us = rto_clamp(rto, rto->srtt_us +
+                  (var > RTO_GRANULARITY_US ? var : RTO_GRANULARITY_US));
+    rto->backoff = 0;
+}
+
+static void rto_backoff(rto_p rto)
+{
+    if (!rto->fixed && ((int64_t)rto->rto_us << rto->backoff) < rto->max_us)
+        rto->backoff++;
+}
+
+static int rto_timeout(rto_p rto)
+{
+    int64_t us = (int64_t)rto->rto_us << rto->backoff;
+
+    if (!rto->fixed) us = rto_clamp(rto, us);
+    return (us + 999) / 1000;
+}
+
+/* Rto API gateway */
+const struct __RTO_API__ Rto = {
+    .init = rto_init,
+    .sample = rto_sample,
+    .backoff = rto_backoff,
+    .timeout = rto_timeout,
+};
@@ -0,0 +1,181 @@
+#include <netinet/in.h>
+#include "ring.h"
+
+/*
+ * Session table
+ *
+ * Open addressing with linear probing over 24 byte entries, sized once
+ * for `max` peers at a load factor of at most 3/4, so the memory is
+ * known up front and never grows. Deletion shifts the following entries
+ * back instead of leaving tombstones, so probe chains stay short under
+ * churn. Idle sessions are evicted incrementally: every lookup advances
+ * a sweep cursor over a few slots, a full sweep takes capacity/SWEEP
+ * lookups. A table belongs to one thread (a server worker).
+ *
+ * IPv4 peers are keyed by their exact address and port, IPv6 peers by
+ * a 64-bit hash of them.
+ */
+#define SESSION_SWEEP 2 /* slots swept per lookup */
+#define SESSION_V4 (1ULL << 63) /* tag of the IPv4 keys, 0 is empty */
+
+struct sessions {
+    struct session *slots;
+    uint64_t mask;
+    int bits;
+    unsigned count, max;
+    uint32_t idle_ms;
+    uint64_t cursor; /* next slot of the eviction sweep */
+};
+
+static uint64_t session_mix(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+static uint64_t session_key(const struct sockaddr *addr)
+{
+    if (addr->sa_family == AF_INET6) {
+        const struct sockaddr_in6 *a = (const struct sockaddr_in6 *)addr;
+        uint64_t hi, lo;
+        memcpy(&hi, a->sin6_addr.s6_addr, 8);
+        memcpy(&lo, a->sin6_addr.s6_addr + 8, 8);
+        return (session_mix(hi ^ session_mix(lo ^ a->sin6_port)) &
+                ~SESSION_V4) | 1;
+    }
+    return SESSION_V4 |
+           (uint64_t)((const struct sockaddr_in *)addr)->sin_addr.s_addr
+               << 16 |
+           ((const struct sockaddr_in *)addr)->sin_port;
+}
+
+static uint64_t session_home(struct sessions *t, uint64_t key)
+{
+    return session_mix(key) >> (64 - t->bits);
+}
+
+static int sessions_bits(int max)
+{
+    int bits = 4;
+
+    /* at least 4/3 slots per peer */
+    while ((1ULL << bits) * 3 < (uint64_t)max * 4) bits++;
+    return bits;
+}
+
+static size_t sessions_footprint(int max)
+{
+    return sizeof(struct sessions) +
+           (sizeof(struct session) << sessions_bits(max));
+}
+
+static sessions_p sessions_create(int max, int idle_ms)
+{
+    struct sessions *t = calloc(1, sizeof(*t));
+
+    if (!t || max <= 0) {
+        free(t);
+        return NULL;
+    }
+    t->bits = sessions_bits(max);
+    t->mask = (1ULL << t->bits) - 1;
+    t->max = max;
+    t->idle_ms = idle_ms;
+    /* untouched pages of a large table are not backed until used */
+    t->slots = calloc(t->mask + 1, sizeof(*t->slots));
+    if (!t->slots) {
+        free(t);
+        return NULL;
+    }
+    return t;
+}
+
+static void sessions_destroy(sessions_p t)
+{
+    if (!t) return;
+    free(t->slots);
+    free(t);
+}
+
+/* empty slot `i`, moving back the entries that probed past it */
+static void session_remove(struct sessions *t, uint64_t i)
+{
+    uint64_t j = i;
+
+    for (;;) {
+        uint64_t home;
+        j = (j + 1) & t->mask;
+        if (!t->slots[j].key) break;
+        home = session_home(t, t->slots[j].key);
+        /* stays if its home lies cyclically in (i, j] */
+        if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+            continue;
+        t->slots[i] = t->slots[j];
+        i = j;
+    }
+    memset(t->slots + i, 0, sizeof(t->slots[i]));
+    t->count--;
+}
+
+static int sessions_expire(sessions_p t, uint32_t now_ms, int budget)
+{
+    int evicted = 0;
+
+    while (budget-- > 0 && t->count) {
+        struct session *s = t->slots + t->cursor;
+        if (s->key && now_ms - s->last_seen > t->idle_ms) {
+            /* an entry may shift into this slot, look at it again */
+            session_remove(t, t->cursor);
+            evicted++;
+            continue;
+        }
+        t->cursor = (t->cursor + 1) & t->mask;
+    }
+    if (evicted) Stats.add(STAT_SESSIONS_EVICTED, evicted);
+    return evicted;
+}
+
+static struct session *sessions_lookup(sessions_p t,
+                                       const struct sockaddr *addr,
+                                       uint32_t now_ms)
+{
+    uint64_t key = session_key(addr);
+    uint64_t i;
+
+    sessions_expire(t, now_ms, SESSION_SWEEP);
+    for (i = session_home(t, key); ; i = (i + 1) & t->mask) {
+        struct session *s = t->slots + i;
+        if (s->key == key) {
+            s->last_seen = now_ms;
+            return s;
+        }
+        if (!s->key) break;
+    }
+    if (t->count >= t->max) {
+        Stats.add(STAT_SESSIONS_FULL, 1);
+        return NULL;
+    }
+    t->count++;
+    t->slots[i].key = key;
+    t->slots[i].last_seen = now_ms;
+    Stats.add(STAT_SESSIONS_OPENED, 1);
+    return t->slots + i;
+}
+
+static unsigned sessions_count(sessions_p t)
+{
+    return t->count;
+}
+
+/* Sessions API gateway */
+const struct __SESSIONS_API__ Sessions = {
+    .footprint = sessions_footprint,
+    .create = sessions_create,
+    .lookup = sessions_lookup,
+    .expire = sessions_expire,
+    .count = sessions_count,
+    .destroy = sessions_destroy,
+};
@@ -0,0 +1,271 @@
+#include <time.h>
+#include "ring.h"
+
+/*
+ * Hot path counters
+ *
+ * Every thread gets its own cache line aligned slot on first use, so an
+ * update is a relaxed load and store to a line no other thread writes.
+ * A thread that exits leaves its slot on a free list, its counters stay
+ * in the report until a new thread takes the slot over and moves them
+ * to the `retired` totals. Only when every other slot belongs to a live
+ * thread do the threads share the last slot, with atomic adds and no
+ * busy/idle accounting, since they have no single last transition.
+ * `snapshot` sums the slots with relaxed loads, without any lock; a
+ * snapshot taken while a slot is taken over may miss its old counters.
+ * The CPU time costs nothing on the hot path: `snapshot` reads the clock
+ * of a live thread, and a thread leaves its total behind when it exits.
+ */
+struct stats_slot {
+    uint64_t counters[STAT_COUNT];
+    int64_t last_ns; /* last busy/idle transition of the thread */
+    char name[STATS_NAME_LEN];
+    clockid_t cpu_clock; /* the thread's CPU time clock */
+    int live; /* the thread runs, its cpu_clock is valid */
+} __attribute__((aligned(64)));
+
+static struct stats_slot slots[STATS_THREADS];
+static struct stats_slot retired; /* the counters of reused slots */
+static int used; /* slots handed out */
+static int free_slots[STATS_THREADS]; /* of exited threads, to reuse */
+static int nfree;
+static pthread_mutex_t slot_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct stats_slot *local;
+static pthread_key_t exit_key; /* calls stats_exit() with the slot */
+static pthread_once_t exit_once = PTHREAD_ONCE_INIT;
+
+static const char *const stat_names[STAT_COUNT] = {
+    [STAT_PACKETS_READ] = "packets_read",
+    [STAT_BYTES_READ] = "bytes_read",
+    [STAT_PACKETS_WRITTEN] = "packets_written",
+    [STAT_BYTES_WRITTEN] = "bytes_written",
+    [STAT_EAGAIN] = "eagain",
+    [STAT_SOCKET_ERRORS] = "socket_errors",
+    [STAT_SYSCALLS] = "syscalls",
+    [STAT_EPOLL_CTL_FAILURES] = "epoll_ctl_failures",
+    [STAT_TASKS_QUEUED] = "tasks_queued",
+    [STAT_TASKS_RUN] = "tasks_run",
+    [STAT_TASKS_STOLEN] = "tasks_stolen",
+    [STAT_WAKEUPS] = "wakeups",
+    [STAT_TIMERS_FIRED] = "timers_fired",
+    [STAT_SESSIONS_OPENED] = "sessions_opened",
+    [STAT_SESSIONS_EVICTED] = "sessions_evicted",
+    [STAT_SESSIONS_FULL] = "sessions_full",
+    [STAT_FAULTS_DROPPED] = "faults_dropped",
+    [STAT_FAULTS_DELAYED] = "faults_delayed",
+    [STAT_FAULTS_REORDERED] = "faults_reordered",
+    [STAT_FAULTS_DUPLICATED] = "faults_duplicated",
+    [STAT_FAULTS_CORRUPTED] = "faults_corrupted",
+    [STAT_FAULTS_OVERFLOW] = "faults_overflow",
+    [STAT_TRACE_DROPPED] = "trace_dropped",
+    [STAT_STALE_DATAGRAMS] = "stale_datagrams",
+    [STAT_BUSY_NS] = "busy_ns",
+    [STAT_IDLE_NS] = "idle_ns",
+    [STAT_IDLE_WAKEUPS] = "idle_wakeups",
+    [STAT_CPU_NS] = "cpu_ns",
+};
+
+static int64_t monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int64_t cpu_ns(clockid_t clock)
+{
+    struct timespec ts;
+
+    if (clock_gettime(clock, &ts)) return -1;
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* a thread with a slot of its own exits, keep its CPU time */
+static void stats_exit(void *arg)
+{
+    struct stats_slot *s = arg;
+    int64_t ns = cpu_ns(CLOCK_THREAD_CPUTIME_ID);
+
+    if (ns >= 0) __atomic_store_n(&s->counters[STAT_CPU_NS], ns,
+                                  __ATOMIC_RELAXED);
+    __atomic_store_n(&s->live, 0, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&slot_lock);
+    free_slots[nfree++] = s - slots;
+    pthread_mutex_unlock(&slot_lock);
+    /* a later destructor of this thread may still count, atomically */
+    local = slots + STATS_THREADS - 1;
+}
+
+/* move the counters an exited thread left in a slot to the retired ones */
+static void stats_retire(struct stats_slot *s)
+{
+    for (int id = 0; id < STAT_COUNT; id++)
+        __atomic_fetch_add(&retired.counters[id],
+            __atomic_exchange_n(&s->counters[id], 0, __ATOMIC_RELAXED),
+            __ATOMIC_RELAXED);
+    for (int c = 0; c < STATS_NAME_LEN; c++)
+        __atomic_store_n(&s->name[c], 0, __ATOMIC_RELAXED);
+}
+
+static void stats_key(void)
+{
+    pthread_key_create(&exit_key, stats_exit);
+}
+
+static struct stats_slot *stats_slot(void)
+{
+    int i;
+
+    if (local) return local;
+    pthread_mutex_lock(&slot_lock);
+    if (used < STATS_THREADS - 1) {
+        i = used;
+        __atomic_store_n(&used, i + 1, __ATOMIC_RELAXED);
+    } else if (nfree) {
+        i = free_slots[--nfree];
+        stats_retire(slots + i);
+    } else {
+        i = STATS_THREADS - 1;
+        __atomic_store_n(&used, STATS_THREADS, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&slot_lock);
+    local = slots + i;
+    __atomic_store_n(&local->last_ns, monotonic_ns(), __ATOMIC_RELAXED);
+    pthread_once(&exit_once, stats_key);
+    if (i < STATS_THREADS - 1 &&
+        !pthread_getcpuclockid(pthread_self(), &local->cpu_clock) &&
+        !pthread_setspecific(exit_key, local))
+        __atomic_store_n(&local->live, 1, __ATOMIC_RELEASE);
+    return local;
+}
+
+static void stats_add(enum stat_id id, uint64_t n)
+{
+    struct stats_slot *s = stats_slot();
+
+    if (s == slots + STATS_THREADS - 1)
+        __atomic_fetch_add(&s->counters[id], n, __ATOMIC_RELAXED);
+    else
+        __atomic_store_n(&s->counters[id],
+            __atomic_load_n(&s->counters[id], __ATOMIC_RELAXED) + n,
+            __ATOMIC_RELAXED);
+}
+
+static void stats_name(const char *name)
+{
+    struct stats_slot *s = stats_slot();
+
+    if (s == slots + STATS_THREADS - 1) return; /* shared */
+    for (int i = 0; i < STATS_NAME_LEN - 1; i++) {
+        __atomic_store_n(&s->name[i], name[i], __ATOMIC_RELAXED);
+        if (!name[i]) return;
+    }
+}
+
+/* account the time since the last transition as busy (or idle) */
+static void stats_transition(enum stat_id id)
+{
+    struct stats_slot *s = stats_slot();
+    int64_t now = monotonic_ns();
+
+    if (s == slots + STATS_THREADS - 1) return; /* shared */
+    stats_add(id, now - __atomic_load_n(&s->last_ns, __ATOMIC_RELAXED));
+    __atomic_store_n(&s->last_ns, now, __ATOMIC_RELAXED);
+}
+
+static void stats_idle_begin(void)
+{
+    stats_transition(STAT_BUSY_NS);
+}
+
+static void stats_idle_end(void)
+{
+    stats_transition(STAT_IDLE_NS);
+    stats_add(STAT_IDLE_WAKEUPS, 1);
+}
+
+static void stats_snapshot(stats_snapshot_p snap)
+{
+    int count = __atomic_load_n(&used, __ATOMIC_RELAXED);
+
+    if (count > STATS_THREADS) count = STATS_THREADS;
+    memset(snap, 0, sizeof(*snap));
+    snap->threads = count;
+    for (int id = 0; id < STAT_COUNT; id++)
+        snap->total[id] = __atomic_load_n(&retired.counters[id],
+                                          __ATOMIC_RELAXED);
+    for (int i = 0; i < count; i++) {
+        for (int c = 0; c < STATS_NAME_LEN - 1; c++)
+            snap->thread[i].name[c] =
+                __atomic_load_n(&slots[i].name[c], __ATOMIC_RELAXED);
+        for (int id = 0; id < STAT_COUNT; id++) {
+            uint64_t v = __atomic_load_n(&slots[i].counters[id],
+                                         __ATOMIC_RELAXED);
+            /* a thread that just exited fails the clock, its total is in */
+            if (id == STAT_CPU_NS &&
+                __atomic_load_n(&slots[i].live, __ATOMIC_ACQUIRE)) {
+                int64_t ns = cpu_ns(slots[i].cpu_clock);
+                if (ns >= 0) v = ns;
+            }
+            snap->thread[i].counters[id] = v;
+            snap->total[id] += v;
+        }
+    }
+}
+
+static const char *stats_label(stats_snapshot_p snap, int i, char *buf)
+{
+    if (snap->thread[i].name[0]) return snap->thread[i].name;
+    sprintf(buf, "thread%d", i);
+    return buf;
+}
+
+static void stats_dump(stats_snapshot_p snap, FILE *out, int json)
+{
+    char buf[32];
+
+    if (json) {
+        fprintf(out, "{\"total\":{");
+        for (int id = 0; id < STAT_COUNT; id++)
+            fprintf(out, "%s\"%s\":%lu", id ? "," : "", stat_names[id],
+                    (unsigned long)snap->total[id]);
+        fprintf(out, "},\"threads\":[");
+        for (int i = 0; i < snap->threads; i++) {
+            fprintf(out, "%s{\"name\":\"%s\"", i ? "," : "",
+                    stats_label(snap, i, buf));
+            for (int id = 0; id < STAT_COUNT; id++)
+                if (snap->thread[i].counters[id])
+                    fprintf(out, ",\"%s\":%lu", stat_names[id],
+                            (unsigned long)snap->thread[i].counters[id]);
+            fprintf(out, "}");
+        }
+        fprintf(out, "]}\n");
+        return;
+    }
+    for (int id = 0; id < STAT_COUNT; id++)
+        if (id != STAT_BUSY_NS && id != STAT_IDLE_NS && id != STAT_CPU_NS)
+            fprintf(out, "%-20s %lu\n", stat_names[id],
+                    (unsigned long)snap->total[id]);
+    for (int i = 0; i < snap->threads; i++) {
+        uint64_t busy = snap->thread[i].counters[STAT_BUSY_NS];
+        uint64_t idle = snap->thread[i].counters[STAT_IDLE_NS];
+        uint64_t wakeups = snap->thread[i].counters[STAT_IDLE_WAKEUPS];
+        if (!busy && !idle) continue;
+        fprintf(out, "%-20s busy %.3fs idle %.3fs (%.1f%% busy)"
+                " cpu %.3fs, %lu wakeups (%.2f/s)\n",
+                stats_label(snap, i, buf), busy / 1e9, idle / 1e9,
+                100.0 * busy / (busy + idle),
+                snap->thread[i].counters[STAT_CPU_NS] / 1e9,
+                (unsigned long)wakeups, wakeups * 1e9 / (busy + idle));
+    }
+}
+
+/* Stats API gateway */
+const struct __STATS_API__ Stats = {
+    .add = stats_add,
+    .name = stats_name,
+    .idle_begin = stats_idle_begin,
+    .idle_end = stats_idle_end,
+    .snapshot = stats_snapshot,
+    .dump = stats_dump,
+};
@@ -1,261 +1,1571 @@
-#include <sched.h>
-#include "ring.h"
-
-#ifndef MAX_EVENTS
-#define MAX_EVENTS 32
-#endif
-
-
-static void on_open(socket_p socket, int srvfd)
-{
-	memset(socket->buff,0, BUF_SIZE);
-	socket->epfd = epoll_create1(0);
-    if(socket->epfd == -1) perror("epoll_create");
-    socket->event.data.fd = srvfd;
-    socket->event.events = EPOLLIN; /* Only interested in input events */
-    
-    if(epoll_ctl(socket->epfd, EPOLL_CTL_ADD, srvfd, &socket->event) == -1)
-        perror("epoll_ctl");
-}
-/*
- * For every 2-byte UDP packet sent to the server, 
- * the server shall return back a 2-byte packet on 
- * the same port echoing the counter. 
- * If no echo is received within 500ms or the value 
- * returned from the server is not equal to the value sent from the device, 
- * the device shall re-send the current value. 
- * This shall continue until the correct value is received from the server, 
- * at which point the device will increment the counter and proceed as normal.
- */
-static void on_data(socket_p socket, int srvfd)
-{
-    /* the device shall send a packet of 2 bytes to the server with a counter */
-    ssize_t num_rw = 2; 
-    uint16_t w_data = 0, *buff = socket->buff;
-    /* Receive datagrams and return copies to senders */
-	ring_p ring = socket->ring;
-    while (ring->battery.voltage >= ring->battery.minimum_vol && ring->press_button && ring->run == 1) {
-        socket->len = sizeof(socket->servaddr);	
-    	/* Write data to Server */
-    	if (num_rw != Socket.write(socket, srvfd, &w_data,
-    		          2, (struct sockaddr*)&socket->servaddr)) {
-    		perror("write cnt != 2");
-    		continue;
-        }
-        
-        if(epoll_wait(socket->epfd, &socket->event, MAX_EVENTS,
-                      socket->settings->timeout_ms) <= 0) {
-            printf("\n500ms timeout to re-send package\n");
-       	    /* Empty buff */
-    	    Socket.read(socket, srvfd, buff, 
-    		          2, (struct sockaddr*)&socket->servaddr);
-            continue;
-        }
-        
-        /* Read data from Server */
-    	if (num_rw != Socket.read(socket, srvfd, buff, 
-    		          2, (struct sockaddr*)&socket->servaddr)) {
-    		perror("read cnt != 2");
-    		continue;
-    	}
-    	
-    	printf("%d ",(uint16_t)*buff);
-    	fflush(stdout);
-        
-        /* Compare 2 bytes data */
-    	if(*buff == w_data) {
-    	    w_data++;
-    	} else {
-    	    printf("\ncompare failed, re-send value\n");
-    	    continue;
-    	}
-    	
-    	if(w_data == 65535) printf("\ncounter overflow\n");
-    	sleep(1);/* send a packet of 2 bytes */
-    }
-    
-}
-
-static void * network_task(void *arg)
-{
-    /* setup signal and thread's local-storage async variable. */
-    ring_p ring = arg;
-    char sig_buf;
-    
-    /* pause for signal for as long as we're active. */
-    while (ring->run && (read(ring->socket->pipe.in, &sig_buf, 1) >= 0)) {
-        if(ring->battery.voltage >= ring->battery.minimum_vol)
-            Socket.connect(ring->socket);
-        sched_yield();
-    }
-    
-    return NULL;
-}
-
-static void on_close(socket_p socket, int sockfd)
-{
-    
-}
-
-/* In order to test, suppose charging increased by 100mV per second 
- * Maximum voltage: 4200mV, Minimum voltage: 3200mV
- * While current voltage is as low as minimum voltage, 
- * program will close all the threads and exit itself. 
- */
-static void * battery_task(void *arg)
-{
-    /* setup signal and thread's local-storage async variable. */
-    ring_p ring = arg;
-    char sig_buf;
-
-    /* pause for signal for as long as we're active. */
-    while (ring->run && (read(ring->battery.pipe.in, &sig_buf, 1) >= 0)) {
-        while( 3200 < ring->battery.voltage && (ring->battery.voltage < 4200 || !ring->battery.charging)) {
-            if(ring->battery.charging)
-                ring->battery.voltage += 100;
-            else        
-                ring->battery.voltage -= 100;
-            printf("Battery voltage:%dmV\n",ring->battery.voltage);
-            if(ring->battery.voltage < ring->battery.minimum_vol) { /* wake up socket and led tasks */
-                Thread.run(ring,&(ring->led.pipe));
-	            Thread.run(ring,&(ring->socket->pipe));
-            }
-            sleep(1);
-        }
-        if(ring->battery.voltage <= 3200) {/* shutdown device */
-            printf("Low battery, power off device\n");
-            Thread.finish(ring);
-        }
-        fflush(stdout);
-        sched_yield();
-    }
-    printf("%s exit\n",__func__);
-    return NULL;
-}
-
-void red_led_blink(ring_p ring, int hz, float duty)
-{
-    float hi = duty / hz; /* calculate pull-up time */
-    float low = (1 - duty) / hz; /* calculate pull-down time */
-    printf("Red LED is blinking.\n");
-    printf("GPIO for red LED is in a cycle of %.3fs high and %.3fs low.\n", hi, low);
-    do {
-        ring->led.red_led_gpio = 1;
-        usleep(hi * 1000); // sleep ms
-        ring->led.red_led_gpio = 0;
-        usleep(low * 1000); // sleep ms
-    } while(ring->battery.voltage < ring->battery.minimum_vol && ring->run == 1);
-    printf("Red LED stops blinking\n");
-}
-
-/*
- * While the battery voltage is <3.5V,  white LED shall not illuminate, 
- * even if the button is pushed. While the battery voltage is <3.5V, 
- * the red LED shall blink at a rate of 2Hz with a 25% duty cycle.
- */
-
-static void * led_task(void *arg)
-{
-    /* setup signal and thread's local-storage async variable. */
-    ring_p ring = arg;
-    char sig_buf;
-    int old_stae = 0;
-    /* pause for signal for as long as we're active. */
-    
-    while (ring->run && (read(ring->led.pipe.in, &sig_buf, 1) >= 0)) {
-        if(ring->battery.voltage < ring->battery.minimum_vol) {
-            ring->led.white_led_on = 0;
-            red_led_blink(ring, 2, 0.25);            
-        } 
-        if(ring->press_button) {
-            ring->led.white_led_on = 1;
-            if(old_stae != ring->led.white_led_on)
-                printf("White LED illuminated\n");
-        } else {
-            ring->led.white_led_on = 0;
-            if(old_stae != ring->led.white_led_on)
-                printf("White LED didn't illuminate\n");
-        }
-        old_stae = ring->led.white_led_on;
-        fflush(stdout);
-        sched_yield();
-        //printf("ring->press_button:%d\n",ring->press_button);
-    }
-    printf("%s exit\n",__func__);
-    return NULL;
-}
-
-void press_button(ring_p ring)
-{    
-    ring->press_button = 1;
-    printf("\nPush button\n");
-	Thread.run(ring,&(ring->led.pipe));
-	Thread.run(ring,&(ring->socket->pipe));
-	
-}
-
-void release_button(ring_p ring)
-{    
-    ring->press_button = 0;
-    printf("\nRelease button\n");
-    Thread.run(ring,&(ring->led.pipe));
-	Thread.run(ring,&(ring->socket->pipe));
-}
-
-void charge_on(ring_p ring, int on)
-{
-    ring->battery.charging = on;
-    printf("charging %s\n", on ? "on" : "off");
-    Thread.run(ring,&(ring->battery.pipe));
-}
-static void * event_task(void *arg)
-{
-    /* setup signal and thread's local-storage async variable. */
-    ring_p ring = arg;
-    
-    /* pause for signal for as long as we're active. */
-    while (ring->run) {
-        charge_on(ring, 1);
-		press_button(ring);
-		sleep(5);
-		release_button(ring);
-		
-		charge_on(ring, 0);
-		
-		sleep(3);
-		press_button(ring);
-		sleep(4);
-		release_button(ring);
-		sleep(2);
-    }
-    printf("%s exit\n",__func__);
-    return NULL;
-}
-
-
-int main()
-{
-	socket_p socket = 
-	Socket.init((struct SocketSettings) {
-	            .port = 13469,
-	            .host = "test.ring.com",
-	            .on_open = on_open,
-	            .on_data = on_data,
-	            .on_close = on_close,
-	            .timeout_ms = 500,
-	            }, BUF_SIZE);
-	        
-    void * (*worker_thread_func[])(void *arg) = { 
-        network_task, battery_task, led_task, event_task} ;
-    ring_p ring = Thread.create(sizeof(worker_thread_func)/ sizeof(void *), 
-                  worker_thread_func);
-    ring->socket = socket;
-    socket->ring = ring;
-    
-    {
-        char sig_buf;
-        while(ring->run && read(ring->pipe.in, &sig_buf, 1) >= 0);
-        printf("Bye\n");
-    }
-    return 0;
-}
+#include <sched.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "ring.h"
+
+static void on_open(socket_p socket, int srvfd)
+{
+	memset(socket->buff,0, BUF_SIZE);
+    /* button and battery events wake the client in the middle of a wait */
+    Socket.add(socket, socket->notify.fd, 0);
+}
+/* the most counters a window may keep in flight, a power of 2 */
+#define ECHO_WINDOW_MAX 256
+/* stop-and-wait sends one counter per second */
+#define ECHO_INTERVAL_MS 1000
+/* echoes of the previous press may still come in on the kept socket for
+ * this long, the echo server holds some back for 600ms */
+#define ECHO_STALE_MS 1000
+
+/* a counter value in flight */
+struct echo_slot {
+    int64_t deadline; /* retransmit time, in ms */
+    uint32_t sent_us; /* first transmission, in us (wraps) */
+    uint16_t value;
+    uint8_t acked;
+    uint8_t retransmitted; /* no RTT sample from its echo (Karn) */
+};
+
+/* protocol counters, shared by the windows of one thread */
+struct echo_stats {
+    uint64_t sent; /* datagrams written, including retransmits */
+    uint64_t echoed; /* counters acknowledged */
+    uint64_t timeouts; /* retransmits after a timeout */
+    uint64_t mismatches; /* retransmits after a failed compare */
+    uint64_t stale; /* late echoes of a previous press, ignored */
+    struct histogram rtt; /* first transmission to echo, in us */
+    struct histogram first_packet; /* button press to first counter, us */
+};
+
+#define ECHO_COUNT(w, field) \
+    do { if ((w)->stats) \
+        __atomic_fetch_add(&(w)->stats->field, 1, __ATOMIC_RELAXED); \
+    } while (0)
+
+/*
+ * The client side of the echo protocol.
+ *
+ * Counters in [base, next) are in flight, at most `size` of them. Each
+ * one has its own retransmit deadline, so a lost or corrupted echo only
+ * re-sends that value. The counters are reported in order as `base`
+ * advances, a window of 1 is the classic stop-and-wait protocol.
+ * The slots are sized to the window, so a stop-and-wait window stays
+ * small enough to simulate many devices.
+ */
+struct echo_window {
+    uint16_t base; /* oldest unacknowledged counter */
+    uint16_t next; /* next counter to send */
+    uint16_t size; /* counters allowed in flight */
+    uint16_t mask; /* slot index mask */
+    int interval_ms; /* pause after each echo (stop-and-wait only) */
+    int verbose; /* print the counters and the retransmits */
+    int64_t send_at; /* earliest time to send `next` */
+    int64_t stale_until; /* unknown echoes before this are stale, in ms */
+    int64_t pressed_us; /* the press served, until the first counter */
+    struct rto *rto; /* the retransmission timeout of the socket */
+    struct echo_stats *stats; /* optional */
+    struct echo_slot slots[];
+};
+
+/* the Clock, so that -v runs the protocol on virtual time */
+static int64_t now_ms(void)
+{
+    return Clock.now_ms();
+}
+
+static int64_t now_us(void)
+{
+    return Clock.now_us();
+}
+
+static int echo_clamp(int size)
+{
+    if (size < 1) size = 1;
+    if (size > ECHO_WINDOW_MAX) size = ECHO_WINDOW_MAX;
+    return size;
+}
+
+/* bytes needed by a window of `size` counters */
+static size_t echo_window_size(int size)
+{
+    int slots = 1;
+
+    size = echo_clamp(size);
+    while (slots < size) slots <<= 1;
+    return sizeof(struct echo_window) + slots * sizeof(struct echo_slot);
+}
+
+/* (re)start the counter at 0 in storage of echo_window_size(size) bytes */
+static void echo_init(struct echo_window *w, int size)
+{
+    struct echo_stats *stats = w->stats;
+    struct rto *rto = w->rto;
+    int verbose = w->verbose;
+
+    size = echo_clamp(size);
+    memset(w, 0, echo_window_size(size));
+    w->size = size;
+    w->mask = (echo_window_size(size) - sizeof(*w)) / sizeof(w->slots[0]) - 1;
+    w->interval_ms = size > 1 ? 0 : ECHO_INTERVAL_MS;
+    w->stats = stats;
+    w->rto = rto;
+    w->verbose = verbose;
+}
+
+static struct echo_slot *echo_slot(struct echo_window *w, uint16_t value)
+{
+    return w->slots + (value & w->mask);
+}
+
+/* whether `value` is in flight, i.e. in [base, next) */
+static int echo_in_flight(struct echo_window *w, uint16_t value)
+{
+    return (uint16_t)(value - w->base) < (uint16_t)(w->next - w->base);
+}
+
+static void echo_send(socket_p socket, int fd, struct echo_window *w,
+                      uint16_t value, int64_t now)
+{
+    struct echo_slot *slot = echo_slot(w, value);
+
+    /* re-arm first: a failed write is retried like a lost packet */
+    slot->deadline = now + Rto.timeout(w->rto);
+    socket->len = sizeof(socket->servaddr);
+    /* the connected socket needs no address */
+    if (Socket.write(socket, fd, &value, 2, fd == socket->clfd ? NULL :
+                     (struct sockaddr*)&socket->servaddr) != 2) {
+        if (w->verbose) perror("write cnt != 2");
+        return;
+    }
+    ECHO_COUNT(w, sent);
+    if (w->pressed_us) {
+        if (w->stats)
+            Histogram.record(&w->stats->first_packet,
+                             now_us() - w->pressed_us);
+        w->pressed_us = 0;
+    }
+}
+
+/* send new counters while the window has room */
+static void echo_fill(socket_p socket, int fd, struct echo_window *w,
+                      int64_t now)
+{
+    while ((uint16_t)(w->next - w->base) < w->size && w->send_at <= now) {
+        struct echo_slot *slot = echo_slot(w, w->next);
+        slot->value = w->next;
+        slot->acked = 0;
+        slot->retransmitted = 0;
+        slot->sent_us = now_us();
+        echo_send(socket, fd, w, w->next++, now);
+    }
+}
+
+/* re-send every counter whose echo is overdue, with a backed off timeout */
+static void echo_expire(socket_p socket, int fd, struct echo_window *w,
+                        int64_t now)
+{
+    int timeout = Rto.timeout(w->rto), expired = 0;
+
+    for (uint16_t v = w->base; v != w->next; v++) {
+        struct echo_slot *slot = echo_slot(w, v);
+        if (slot->acked || slot->deadline > now) continue;
+        if (!expired++) Rto.backoff(w->rto);
+        if (w->verbose) Trace.event(TRACE_ECHO_TIMEOUT, timeout, v);
+        ECHO_COUNT(w, timeouts);
+        slot->retransmitted = 1;
+        echo_send(socket, fd, w, v, now);
+    }
+}
+
+/*
+ * Handle an echo. Echoes of counters that were already reported are
+ * stale duplicates (e.g. the late echo of a re-sent value). Anything
+ * else that is not in flight failed the compare, and the oldest counter
+ * in flight is re-sent. A corrupted echo that happens to equal another
+ * counter in flight acknowledges that one, whose real echo then arrives
+ * as a duplicate while the corrupted value times out.
+ */
+static void echo_recv(socket_p socket, int fd, struct echo_window *w,
+                      uint16_t value, int64_t now)
+{
+    struct echo_slot *slot;
+    uint32_t rtt;
+
+    if (echo_in_flight(w, value)) {
+        if (echo_slot(w, value)->acked) return; /* duplicate */
+    } else if ((uint16_t)(w->base - value - 1) < ECHO_WINDOW_MAX) {
+        return; /* duplicate of a counter already reported */
+    } else if (now < w->stale_until) {
+        ECHO_COUNT(w, stale); /* the previous press, on the kept socket */
+        return;
+    } else {
+        if (w->verbose) Trace.event(TRACE_ECHO_MISMATCH, 0, 0);
+        ECHO_COUNT(w, mismatches);
+        if (w->base != w->next) {
+            echo_slot(w, w->base)->retransmitted = 1;
+            echo_send(socket, fd, w, w->base, now);
+        }
+        return;
+    }
+    slot = echo_slot(w, value);
+    slot->acked = 1;
+    ECHO_COUNT(w, echoed);
+    rtt = (uint32_t)now_us() - slot->sent_us;
+    if (!slot->retransmitted)
+        Rto.sample(w->rto, rtt);
+    if (w->stats)
+        Histogram.record(&w->stats->rtt, rtt);
+    /* report the counters in order */
+    while (w->base != w->next && echo_slot(w, w->base)->acked) {
+        if (w->verbose) Trace.event(TRACE_ECHO, w->base, 0);
+        if (++w->base == 65535 && w->verbose)
+            Trace.event(TRACE_ECHO_OVERFLOW, 0, 0);
+        w->send_at = now + w->interval_ms;
+    }
+}
+
+/* milliseconds until the next retransmit or send is due */
+static int echo_timeout(struct echo_window *w, int64_t now)
+{
+    int64_t next = -1;
+
+    if ((uint16_t)(w->next - w->base) < w->size)
+        next = w->send_at;
+    for (uint16_t v = w->base; v != w->next; v++) {
+        struct echo_slot *slot = echo_slot(w, v);
+        if (!slot->acked && (next < 0 || slot->deadline < next))
+            next = slot->deadline;
+    }
+    if (next < 0) return -1;
+    return next > now ? next - now : 0;
+}
+
+static void echo_stats_print(struct echo_stats *stats)
+{
+    uint64_t sent = __atomic_load_n(&stats->sent, __ATOMIC_RELAXED);
+    uint64_t timeouts = __atomic_load_n(&stats->timeouts, __ATOMIC_RELAXED);
+    uint64_t mismatches = __atomic_load_n(&stats->mismatches,
+                                          __ATOMIC_RELAXED);
+
+    printf("\necho: %lu sent, %lu echoed, %lu timeouts, %lu mismatches"
+           " (%.2f%% retransmitted)\n", (unsigned long)sent,
+           (unsigned long)__atomic_load_n(&stats->echoed, __ATOMIC_RELAXED),
+           (unsigned long)timeouts, (unsigned long)mismatches,
+           sent ? 100.0 * (timeouts + mismatches) / sent : 0);
+    if (stats->stale)
+        printf("stale: %lu late echoes of a previous press ignored\n",
+               (unsigned long)__atomic_load_n(&stats->stale,
+                                              __ATOMIC_RELAXED));
+    Histogram.print(&stats->rtt, "rtt", "us", stdout);
+    if (stats->first_packet.count)
+        Histogram.print(&stats->first_packet, "press to first packet", "us",
+                        stdout);
+}
+
+/* the device's protocol statistics, across button presses */
+static struct echo_stats client_stats;
+
+/* -f: wait timeout_ms for every echo instead of the adaptive timeout */
+static int fixed_timeout;
+
+/* -c: a new socket per press, instead of one kept connected */
+static int reconnect;
+
+/* the last button press, in us, and the end of the last echo session */
+static int64_t pressed_us;
+static int64_t session_end_ms;
+
+/* start a session of the echo window for the latest press */
+static void echo_session(struct echo_window *w)
+{
+    w->pressed_us = __atomic_load_n(&pressed_us, __ATOMIC_ACQUIRE);
+    if (session_end_ms) w->stale_until = session_end_ms + ECHO_STALE_MS;
+}
+
+/* -H: the echo server, resolved through the Resolver cache */
+static char *host = "test.ring.com";
+
+/* the echo server's address from the Resolver cache, waiting up to
+ * `wait_ms` on a cold one; the local host if it does not resolve */
+static void server_address(socket_p socket, int wait_ms)
+{
+    struct sockaddr_in *servaddr = (struct sockaddr_in *)&socket->servaddr;
+
+    if (!Resolver.lookup(host, socket->settings->port, &socket->servaddr,
+                         wait_ms))
+        return;
+    fprintf(stderr, "%s: not resolved, using the local host\n", host);
+    memset(&socket->servaddr, 0, sizeof(socket->servaddr));
+    servaddr->sin_family = AF_INET;
+    servaddr->sin_port = htons(socket->settings->port);
+}
+
+static void rto_print(struct rto *rto)
+{
+    printf("rto: %dms (srtt %.2fms rttvar %.2fms, %u samples%s)\n",
+           Rto.timeout(rto), rto->srtt_us / 1000.0, rto->rttvar_us / 1000.0,
+           rto->samples, rto->fixed ? ", fixed" : "");
+}
+
+/* the echo client runs while the button is held on a good battery */
+static int device_active(ring_p ring)
+{
+    struct device_state state;
+
+    Device.snapshot(ring, &state);
+    return state.value[DEVICE_VOLTAGE] >= ring->battery.minimum_vol &&
+           state.value[DEVICE_BUTTON] && Thread.running(ring);
+}
+
+/*
+ * For every 2-byte UDP packet sent to the server, 
+ * the server shall return back a 2-byte packet on 
+ * the same port echoing the counter. 
+ * If no echo is received within 500ms or the value 
+ * returned from the server is not equal to the value sent from the device, 
+ * the device shall re-send the current value. 
+ * This shall continue until the correct value is received from the server, 
+ * at which point the device will increment the counter and proceed as normal.
+ *
+ * With `SocketSettings.window` > 1 up to that many counters are in flight.
+ */
+static void on_data(socket_p socket, int srvfd)
+{
+    struct echo_window *window = calloc(1,
+                     echo_window_size(socket->settings->window));
+    int fds[MAX_EVENTS];
+    uint16_t *buff = socket->buff;
+	ring_p ring = socket->ring;
+    int n;
+
+    if (!window) {
+        perror("echo window");
+        return;
+    }
+    window->verbose = 1;
+    window->stats = &client_stats;
+    window->rto = &socket->rto;
+    echo_init(window, socket->settings->window);
+    echo_session(window);
+    while (device_active(ring)) {
+        int64_t now = now_ms();
+
+        echo_expire(socket, srvfd, window, now);
+        echo_fill(socket, srvfd, window, now);
+        n = Socket.wait(socket, fds, MAX_EVENTS, echo_timeout(window, now));
+        for (int i = 0; i < n; i++) {
+            if (fds[i] == socket->notify.fd) {
+                /* state changed, re-check the loop condition */
+                Notifier.drain(&socket->notify);
+                continue;
+            }
+            /* Read data from Server */
+            socket->len = sizeof(socket->claddr);
+            if (2 != Socket.read(socket, srvfd, buff,
+                          2, (struct sockaddr*)&socket->claddr)) {
+                perror("read cnt != 2");
+                continue;
+            }
+            echo_recv(socket, srvfd, window, *buff, now_ms());
+        }
+    }
+    /* the client reports its own counters, they are written here */
+    echo_stats_print(&client_stats);
+    rto_print(&socket->rto);
+    session_end_ms = now_ms();
+    free(window);
+}
+
+/* the tasks start running before main() attaches the socket; sleep,
+ * a SCHED_FIFO task (-R) yielding would never let main() run */
+static void wait_socket(ring_p ring)
+{
+    while (!__atomic_load_n(&ring->socket, __ATOMIC_ACQUIRE))
+        Clock.sleep_ms(1);
+}
+
+static void * network_task(void *arg)
+{
+    /* setup signal and thread's local-storage async variable. */
+    ring_p ring = arg;
+
+    Stats.name("network_task");
+    wait_socket(ring);
+    
+    /* pause for signal for as long as we're active. */
+    while (Thread.running(ring) &&
+           (Notifier.wait(&ring->socket->notify) >= 0)) {
+        if(Device.get(ring, DEVICE_VOLTAGE) >= ring->battery.minimum_vol)
+            Socket.connect(ring->socket);
+    }
+    
+    return NULL;
+}
+
+static void on_close(socket_p socket, int sockfd)
+{
+    
+}
+
+/* In order to test, suppose charging increased by 100mV per second 
+ * Maximum voltage: 4200mV, Minimum voltage: 3200mV
+ * While current voltage is as low as minimum voltage, 
+ * program will close all the threads and exit itself. 
+ */
+static struct timer battery_timer;
+
+static int battery_in_range(ring_p ring)
+{
+    struct device_state state;
+
+    Device.snapshot(ring, &state);
+    return 3200 < state.value[DEVICE_VOLTAGE] &&
+           (state.value[DEVICE_VOLTAGE] < 4200 ||
+            !state.value[DEVICE_CHARGING]);
+}
+
+/* charge or drain the battery, every second on the timer thread */
+static void battery_tick(void *arg)
+{
+    ring_p ring = arg;
+    int voltage, delta;
+
+    if (!battery_in_range(ring)) {
+        Timer.cancel(ring, &battery_timer);
+        /* let the battery task decide about the shutdown */
+        Thread.wake(ring, &ring->battery.notify);
+        return;
+    }
+    delta = Device.get(ring, DEVICE_CHARGING) ? 100 : -100;
+    voltage = Device.add(ring, DEVICE_VOLTAGE, delta);
+    Trace.event(TRACE_BATTERY, voltage, 0);
+    /* only a crossing of the minimum concerns the other tasks */
+    if ((voltage < ring->battery.minimum_vol) ==
+        (voltage - delta < ring->battery.minimum_vol))
+        return;
+    /* the red LED starts or stops blinking */
+    Thread.wake(ring, &ring->led.notify);
+    /* the echo client stops */
+    if (voltage < ring->battery.minimum_vol)
+        Thread.wake(ring, &ring->socket->notify);
+}
+
+/* -r: run every handler on one reactor thread instead of a thread each */
+static int reactor_mode;
+
+/* react to a charger or voltage change */
+static void battery_event(ring_p ring)
+{
+    if (battery_in_range(ring)) {
+        if (!Timer.pending(ring, &battery_timer))
+            Timer.schedule(ring, &battery_timer, 0, 1000);
+    } else if(Device.get(ring, DEVICE_VOLTAGE) <= 3200) {/* shutdown device */
+        Trace.event(TRACE_LOW_BATTERY, 0, 0);
+        Timer.cancel(ring, &battery_timer);
+        /* the reactor is on this very thread, it returns to main() */
+        if (reactor_mode)
+            Thread.signal(ring);
+        else
+            Thread.finish(ring);
+    }
+}
+
+static void * battery_task(void *arg)
+{
+    /* setup signal and thread's local-storage async variable. */
+    ring_p ring = arg;
+
+    Stats.name("battery_task");
+    wait_socket(ring);
+    Timer.init(&battery_timer, battery_tick, ring);
+
+    /* pause for signal for as long as we're active. */
+    while (Thread.running(ring) &&
+           (Notifier.wait(&ring->battery.notify) >= 0)) {
+        battery_event(ring);
+    }
+    printf("%s exit\n",__func__);
+    return NULL;
+}
+
+/* the LEDs are channels of the PWM engine, the white one steady */
+static struct {
+    struct pwm_channel red, white;
+    int blinking; /* the red LED, only touched by led_event() */
+} leds;
+
+static void red_led_write(void *arg, int level)
+{
+    Device.set(arg, DEVICE_RED_LED, level);
+}
+
+static void white_led_write(void *arg, int level)
+{
+    Device.set(arg, DEVICE_WHITE_LED, level);
+}
+
+/* before the first led_event() */
+static void leds_init(ring_p ring)
+{
+    Pwm.add(ring, &leds.red, red_led_write, ring);
+    Pwm.add(ring, &leds.white, white_led_write, ring);
+}
+
+/* start blinking until the battery voltage is back, unless it already is */
+void red_led_blink(ring_p ring, int hz, float duty)
+{
+    if (leds.blinking) return;
+    leds.blinking = 1;
+    /* pull-up and pull-down time */
+    Trace.event(TRACE_RED_LED_BLINK, 1000 * duty / hz,
+                1000 * (1 - duty) / hz);
+    Pwm.set(ring, &leds.red, hz, duty);
+}
+
+/* stop blinking at the next edge */
+static void red_led_stop(ring_p ring)
+{
+    if (!leds.blinking) return;
+    leds.blinking = 0;
+    Pwm.set(ring, &leds.red, 0, 0);
+    Trace.event(TRACE_RED_LED_STOP, 0, 0);
+}
+
+static void led_jitter_print(void)
+{
+    if (leds.red.jitter.count)
+        Histogram.print(&leds.red.jitter, "red LED edge lateness", "ns",
+                        stdout);
+}
+
+/*
+ * While the battery voltage is <3.5V,  white LED shall not illuminate, 
+ * even if the button is pushed. While the battery voltage is <3.5V, 
+ * the red LED shall blink at a rate of 2Hz with a 25% duty cycle.
+ */
+
+/* react to a button or voltage change */
+static void led_event(ring_p ring)
+{
+    static int old_stae = 0;
+    struct device_state state;
+    int on;
+
+    Device.snapshot(ring, &state);
+    if(state.value[DEVICE_VOLTAGE] < ring->battery.minimum_vol)
+        red_led_blink(ring, 2, 0.25);
+    else
+        red_led_stop(ring);
+    on = state.value[DEVICE_BUTTON] &&
+         state.value[DEVICE_VOLTAGE] >= ring->battery.minimum_vol;
+    Pwm.set(ring, &leds.white, 0, on);
+    if(old_stae != on)
+        Trace.event(on ? TRACE_WHITE_LED_ON : TRACE_WHITE_LED_OFF, 0, 0);
+    old_stae = on;
+}
+
+static void * led_task(void *arg)
+{
+    /* setup signal and thread's local-storage async variable. */
+    ring_p ring = arg;
+
+    Stats.name("led_task");
+    leds_init(ring);
+    /* pause for signal for as long as we're active. */
+    
+    while (Thread.running(ring) &&
+           (Notifier.wait(&ring->led.notify) >= 0)) {
+        led_event(ring);
+    }
+    printf("%s exit\n",__func__);
+    return NULL;
+}
+
+void press_button(ring_p ring)
+{    
+    __atomic_store_n(&pressed_us, now_us(), __ATOMIC_RELEASE);
+    Device.set(ring, DEVICE_BUTTON, 1);
+    Trace.event(TRACE_BUTTON_PUSH, 0, 0);
+	Thread.wake(ring,&(ring->led.notify));
+	Thread.wake(ring,&(ring->socket->notify));
+	
+}
+
+void release_button(ring_p ring)
+{    
+    Device.set(ring, DEVICE_BUTTON, 0);
+    Trace.event(TRACE_BUTTON_RELEASE, 0, 0);
+    Thread.wake(ring,&(ring->led.notify));
+	Thread.wake(ring,&(ring->socket->notify));
+}
+
+void charge_on(ring_p ring, int on)
+{
+    Device.set(ring, DEVICE_CHARGING, on);
+    Trace.event(on ? TRACE_CHARGING_ON : TRACE_CHARGING_OFF, 0, 0);
+    Thread.wake(ring,&(ring->battery.notify));
+}
+/* the next step of the simulated user, return the ms until the one after */
+static unsigned event_step(ring_p ring)
+{
+    static int step;
+
+    switch (step++ % 4) {
+    case 0:
+        charge_on(ring, 1);
+		press_button(ring);
+		return 5000;
+    case 1:
+		release_button(ring);
+		charge_on(ring, 0);
+		return 3000;
+    case 2:
+		press_button(ring);
+		return 4000;
+    default:
+		release_button(ring);
+		return 2000;
+    }
+}
+
+static void * event_task(void *arg)
+{
+    /* setup signal and thread's local-storage async variable. */
+    ring_p ring = arg;
+
+    Stats.name("event_task");
+    wait_socket(ring);
+    
+    /* pause for signal for as long as we're active. */
+    while (Thread.running(ring))
+        Clock.sleep_ms(event_step(ring));
+    printf("%s exit\n",__func__);
+    return NULL;
+}
+
+
+/*
+ * Mass device simulation (test-ring -s devices)
+ *
+ * Every simulated doorbell is a compact device state: button, battery,
+ * its own UDP socket and the echo window of the client protocol above.
+ * A once a second timer of every device plays the user of event_step(),
+ * pressed on the charger, released, pressed, released, and charges or
+ * drains its battery; the echo client runs while the button is held on
+ * a good battery and a new press restarts the counter at 0. The devices
+ * start at different points of the script and with different voltages.
+ * The devices are spread over a few event loop threads. Each loop owns a
+ * ring object for its timer wheel and one epoll set with the sockets of
+ * its devices, and drives the same echo_fill/echo_expire/echo_recv
+ * state machine that on_data() runs for the real device.
+ */
+struct device {
+    struct timer timer; /* next send or retransmit */
+    struct timer user; /* the simulated user and battery, every second */
+    struct sim_loop *loop;
+    int fd;
+    uint16_t voltage; /* in mV */
+    uint8_t press_button;
+    uint8_t second; /* of the user script */
+    struct rto rto; /* the device's own retransmission timeout */
+    struct echo_window window; /* must be last, slots follow */
+};
+
+struct sim_loop {
+    ring_p ring; /* timer wheel of the loop */
+    socket_p socket; /* settings and server address of the devices */
+    int epfd;
+    int stop;
+    int count;
+    size_t stride; /* bytes per device */
+    char *devices;
+    struct echo_stats stats;
+    uint64_t presses; /* the echo client started */
+    uint64_t low_battery; /* stopped by a low battery, button held */
+    pthread_t thread;
+};
+
+static size_t device_size(int window)
+{
+    return sizeof(struct device) - sizeof(struct echo_window) +
+           echo_window_size(window);
+}
+
+static struct device *sim_device(struct sim_loop *loop, int i)
+{
+    return (struct device *)(loop->devices + i * loop->stride);
+}
+
+/* the user script of a device, one step per second (see event_step) */
+#define SIM_SCRIPT_S 14
+
+/* the button is held from 0s to 5s, on the charger, and from 8s to 12s */
+static void device_script(struct device *dev)
+{
+    dev->press_button = dev->second < 5 || (dev->second >= 8 &&
+                                            dev->second < 12);
+}
+
+/* the echo client runs while the button is held on a good battery */
+static int sim_active(struct device *dev)
+{
+    return dev->voltage >= dev->loop->ring->battery.minimum_vol &&
+           dev->press_button;
+}
+
+/* send what is due and sleep until the next deadline */
+static void device_run(struct device *dev)
+{
+    struct sim_loop *loop = dev->loop;
+    int64_t now = now_ms();
+    int timeout;
+
+    if (!sim_active(dev)) return;
+    echo_expire(loop->socket, dev->fd, &dev->window, now);
+    echo_fill(loop->socket, dev->fd, &dev->window, now);
+    timeout = echo_timeout(&dev->window, now);
+    if (timeout >= 0)
+        Timer.schedule(loop->ring, &dev->timer, timeout, 0);
+}
+
+static void device_tick(void *arg)
+{
+    device_run(arg);
+}
+
+/* the next second of the user script: press, release, charge, drain */
+static void device_user(void *arg)
+{
+    struct device *dev = arg;
+    struct sim_loop *loop = dev->loop;
+    int active = sim_active(dev);
+    int charging = dev->second < 5;
+    int64_t stale;
+
+    /* charge 100mV/s, drain 50mV/s, within 3200..4200mV */
+    dev->voltage += charging ? 100 : -50;
+    if (dev->voltage > 4200) dev->voltage = 4200;
+    if (dev->voltage < 3200) dev->voltage = 3200;
+    dev->second = (dev->second + 1) % SIM_SCRIPT_S;
+    device_script(dev);
+    if (active == sim_active(dev)) return;
+    if (active) {
+        /* released or low: stop, the late echoes of this press are stale */
+        if (dev->press_button)
+            __atomic_fetch_add(&loop->low_battery, 1, __ATOMIC_RELAXED);
+        Timer.cancel(loop->ring, &dev->timer);
+        dev->window.stale_until = now_ms() + ECHO_STALE_MS;
+        return;
+    }
+    __atomic_fetch_add(&loop->presses, 1, __ATOMIC_RELAXED);
+    stale = dev->window.stale_until;
+    echo_init(&dev->window, loop->socket->settings->window);
+    dev->window.stale_until = stale;
+    device_run(dev);
+}
+
+static void device_readable(struct device *dev)
+{
+    struct sim_loop *loop = dev->loop;
+    uint16_t value;
+
+    loop->socket->len = sizeof(loop->socket->claddr);
+    while (Socket.read(loop->socket, dev->fd, &value, 2,
+                       (struct sockaddr *)&loop->socket->claddr) == 2) {
+        /* a released device drops the echoes still coming in */
+        if (sim_active(dev))
+            echo_recv(loop->socket, dev->fd, &dev->window, value, now_ms());
+    }
+    device_run(dev);
+}
+
+/* the ephemeral port range only covers ~28k sockets per address, large
+ * simulations spread the devices over 127.0.0.0/8 source addresses */
+#define SIM_PORTS_PER_ADDR 16384
+
+static int device_open(struct device *dev, int index, int total)
+{
+    struct sockaddr_storage addr = {
+        .ss_family = dev->loop->socket->servaddr.ss_family,
+    };
+    socklen_t len = addr.ss_family == AF_INET6 ? sizeof(struct sockaddr_in6)
+                                               : sizeof(struct sockaddr_in);
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = dev };
+
+    dev->fd = socket(addr.ss_family, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (dev->fd < 0) return -1;
+    if (addr.ss_family == AF_INET)
+        ((struct sockaddr_in *)&addr)->sin_addr.s_addr =
+            htonl(total > SIM_PORTS_PER_ADDR ?
+                  INADDR_LOOPBACK + index / SIM_PORTS_PER_ADDR : INADDR_ANY);
+    if (bind(dev->fd, (struct sockaddr *)&addr, len) < 0 ||
+        epoll_ctl(dev->loop->epfd, EPOLL_CTL_ADD, dev->fd, &event) < 0) {
+        close(dev->fd);
+        return -1;
+    }
+    return 0;
+}
+
+static void *sim_loop_task(void *arg)
+{
+    struct sim_loop *loop = arg;
+    struct epoll_event events[MAX_EVENTS];
+    uint64_t expirations;
+
+    Stats.name("sim_loop");
+    for (int i = 0; i < loop->count; i++) {
+        struct device *dev = sim_device(loop, i);
+
+        if (sim_active(dev))
+            __atomic_fetch_add(&loop->presses, 1, __ATOMIC_RELAXED);
+        device_run(dev);
+        /* the users of a loop spread their steps over the second */
+        Timer.schedule(loop->ring, &dev->user, 1000 * i / loop->count,
+                       1000);
+    }
+    while (!__atomic_load_n(&loop->stop, __ATOMIC_ACQUIRE)) {
+        int n;
+
+        Stats.idle_begin();
+        n = epoll_wait(loop->epfd, events, MAX_EVENTS, -1);
+        Stats.idle_end();
+        for (int i = 0; i < n; i++) {
+            if (!events[i].data.ptr) {
+                if (read(Timer.fd(loop->ring), &expirations,
+                         sizeof(expirations)) < 0)
+                    perror("timerfd read");
+                Timer.dispatch(loop->ring);
+                continue;
+            }
+            device_readable(events[i].data.ptr);
+        }
+    }
+    return NULL;
+}
+
+static int sim_loop_init(struct sim_loop *loop, int first, int count,
+                         int total, int window)
+{
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+
+    loop->ring = Thread.create(0, NULL);
+    loop->socket = Socket.init((struct SocketSettings) {
+                        .port = 13469,
+                        .host = host,
+                        .timeout_ms = 500,
+                        .fixed_timeout = fixed_timeout,
+                        .window = window,
+                        }, 0);
+    loop->epfd = epoll_create1(0);
+    loop->stride = (device_size(window) + 7) & ~(size_t)7;
+    loop->devices = calloc(count, loop->stride);
+    if (!loop->ring || !loop->socket || loop->epfd < 0 || !loop->devices)
+        return -1;
+    loop->socket->ring = loop->ring;
+    server_address(loop->socket, 1000);
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, Timer.fd(loop->ring), &event))
+        return -1;
+    for (; loop->count < count; loop->count++) {
+        struct device *dev = sim_device(loop, loop->count);
+        dev->loop = loop;
+        /* every device at its own point of the script and battery */
+        dev->second = (first + loop->count) % SIM_SCRIPT_S;
+        dev->voltage = 3300 + (first + loop->count) * 100 % 1000;
+        device_script(dev);
+        dev->window.stats = &loop->stats;
+        dev->window.rto = &dev->rto;
+        Rto.init(&dev->rto, loop->socket->settings);
+        echo_init(&dev->window, window);
+        Timer.init(&dev->timer, device_tick, dev);
+        Timer.init(&dev->user, device_user, dev);
+        if (device_open(dev, first + loop->count, total)) {
+            perror("device socket");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void sim_loop_destroy(struct sim_loop *loop)
+{
+    for (int i = 0; i < loop->count; i++)
+        close(sim_device(loop, i)->fd);
+    if (loop->epfd >= 0) close(loop->epfd);
+    free(loop->devices);
+    if (loop->ring) Thread.finish(loop->ring);
+    Socket.destroy(loop->socket);
+}
+
+static struct echo_stats sim_totals(struct sim_loop *loops, int threads)
+{
+    struct echo_stats t = { 0 };
+
+    for (int i = 0; i < threads; i++) {
+        t.sent += __atomic_load_n(&loops[i].stats.sent, __ATOMIC_RELAXED);
+        t.echoed += __atomic_load_n(&loops[i].stats.echoed, __ATOMIC_RELAXED);
+        t.timeouts += __atomic_load_n(&loops[i].stats.timeouts,
+                                      __ATOMIC_RELAXED);
+        t.mismatches += __atomic_load_n(&loops[i].stats.mismatches,
+                                        __ATOMIC_RELAXED);
+    }
+    return t;
+}
+
+static double ratio(uint64_t part, uint64_t whole)
+{
+    return whole ? 100.0 * part / whole : 0;
+}
+
+/* dump the Stats counters of every thread, as text or JSON (-j) */
+static int stats_json;
+
+static void stats_print(void)
+{
+    struct stats_snapshot *snap = malloc(sizeof(*snap));
+
+    if (!snap) return;
+    Stats.snapshot(snap);
+    Stats.dump(snap, stdout, stats_json);
+    free(snap);
+}
+
+static int simulate(int devices, int threads, int seconds, int window)
+{
+    struct sim_loop *loops = calloc(threads, sizeof(*loops));
+    struct echo_stats last = { 0 }, t;
+    struct rlimit rl;
+    size_t per_device = (device_size(window) + 7) & ~(size_t)7;
+    int ret = 1;
+
+    /* one socket per device */
+    if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur < devices + 64) {
+        rl.rlim_cur = rl.rlim_max < devices + 64 ? rl.rlim_max : devices + 64;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    printf("Simulating %d devices on %d threads for %ds, window %d\n",
+           devices, threads, seconds, echo_clamp(window));
+    printf("device state: %zu bytes/device (%.1f MB total)\n",
+           per_device, (double)per_device * devices / (1 << 20));
+    for (int i = 0, first = 0; i < threads; i++) {
+        int count = devices / threads + (i < devices % threads);
+        loops[i].epfd = -1;
+        if (sim_loop_init(loops + i, first, count, devices, window)) {
+            fprintf(stderr, "cannot set up devices, raise `ulimit -n`?\n");
+            threads = i + 1;
+            goto end;
+        }
+        first += count;
+    }
+    for (int i = 0; i < threads; i++)
+        pthread_create(&loops[i].thread, NULL, sim_loop_task, loops + i);
+
+    for (int s = 1; s <= seconds; s++) {
+        Clock.sleep_ms(1000);
+        t = sim_totals(loops, threads);
+        printf("%3ds: %8lu pps out %8lu pps in, retries %.2f%%"
+               " (timeouts %lu, mismatches %lu)\n", s,
+               (unsigned long)(t.sent - last.sent),
+               (unsigned long)(t.echoed - last.echoed),
+               ratio(t.timeouts + t.mismatches - last.timeouts -
+                     last.mismatches, t.sent - last.sent),
+               (unsigned long)(t.timeouts - last.timeouts),
+               (unsigned long)(t.mismatches - last.mismatches));
+        last = t;
+    }
+    for (int i = 0; i < threads; i++) {
+        __atomic_store_n(&loops[i].stop, 1, __ATOMIC_RELEASE);
+        Timer.wake(loops[i].ring);
+        pthread_join(loops[i].thread, NULL);
+    }
+    t = sim_totals(loops, threads);
+    printf("total: %lu sent, %lu echoed, %.0f pps, retry rate %.2f%%"
+           " (timeouts %lu, mismatches %lu)\n",
+           (unsigned long)t.sent, (unsigned long)t.echoed,
+           (double)(t.sent + t.echoed) / seconds,
+           ratio(t.timeouts + t.mismatches, t.sent),
+           (unsigned long)t.timeouts, (unsigned long)t.mismatches);
+    {
+        uint64_t presses = 0, low = 0;
+
+        for (int i = 0; i < threads; i++) {
+            presses += loops[i].presses;
+            low += loops[i].low_battery;
+        }
+        printf("presses: %lu, %lu stopped by a low battery\n",
+               (unsigned long)presses, (unsigned long)low);
+    }
+    {
+        struct histogram *rtt = malloc(sizeof(*rtt));
+        if (rtt) {
+            Histogram.init(rtt);
+            for (int i = 0; i < threads; i++)
+                Histogram.merge(rtt, &loops[i].stats.rtt);
+            Histogram.print(rtt, "rtt", "us", stdout);
+            free(rtt);
+        }
+    }
+    stats_print();
+    ret = 0;
+end:
+    for (int i = 0; i < threads; i++)
+        sim_loop_destroy(loops + i);
+    free(loops);
+    return ret;
+}
+
+/*
+ * Reactor mode (test-ring -r)
+ *
+ * The same device on one thread. The ring has no threads: the battery,
+ * LED and socket notifiers are Reactor handlers running the bodies of
+ * the tasks above, the battery, red LED and user script run on the timer
+ * wheel, and the echo client is driven by its socket and a retransmit
+ * timer, like a simulated device, instead of blocking in on_data().
+ */
+static struct {
+    struct handler battery, led, network, socket;
+    struct timer echo_timer, script_timer;
+    struct echo_window *window; /* NULL while the button is released */
+    int fd; /* the socket, kept connected across presses */
+} solo = { .fd = -1 };
+
+static void solo_run(ring_p ring)
+{
+    int64_t now = now_ms();
+    int timeout;
+
+    echo_expire(ring->socket, solo.fd, solo.window, now);
+    echo_fill(ring->socket, solo.fd, solo.window, now);
+    timeout = echo_timeout(solo.window, now);
+    if (timeout >= 0)
+        Timer.schedule(ring, &solo.echo_timer, timeout, 0);
+}
+
+static void solo_tick(void *arg)
+{
+    solo_run(arg);
+}
+
+static void solo_readable(void *arg)
+{
+    ring_p ring = arg;
+    socket_p socket = ring->socket;
+    uint16_t value;
+
+    socket->len = sizeof(socket->claddr);
+    while (Socket.read(socket, solo.fd, &value, 2,
+                       (struct sockaddr *)&socket->claddr) == 2) {
+        if (solo.window)
+            echo_recv(socket, solo.fd, solo.window, value, now_ms());
+        else
+            Stats.add(STAT_STALE_DATAGRAMS, 1);
+    }
+    if (solo.window) solo_run(ring);
+}
+
+/* the socket connected to the echo server, made on the first press */
+static int solo_connect(ring_p ring)
+{
+    socket_p sock = ring->socket;
+
+    /* the echo peer needs no socket, any fd will do */
+    if (Clock.is_virtual()) {
+        solo.fd = 0;
+        goto connected;
+    }
+    server_address(sock, sock->settings->timeout_ms);
+    solo.fd = socket(sock->servaddr.ss_family,
+                     SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (solo.fd < 0 ||
+        connect(solo.fd, (struct sockaddr *)&sock->servaddr,
+                sock->servaddr.ss_family == AF_INET6
+                    ? sizeof(struct sockaddr_in6)
+                    : sizeof(struct sockaddr_in)) < 0 ||
+        Reactor.add(ring, &solo.socket, solo.fd, solo_readable, ring)) {
+        perror("echo client");
+        if (solo.fd >= 0) close(solo.fd);
+        solo.fd = -1;
+        return -1;
+    }
+connected:
+    sock->clfd = solo.fd;
+    Trace.event(TRACE_SOCKET_OPEN, 0, 0);
+    return 0;
+}
+
+static void solo_disconnect(ring_p ring)
+{
+    if (!Clock.is_virtual()) {
+        Reactor.remove(ring, &solo.socket);
+        close(solo.fd);
+    }
+    ring->socket->clfd = 0;
+    solo.fd = -1;
+}
+
+static int solo_open(ring_p ring)
+{
+    socket_p sock = ring->socket;
+
+    if (solo.fd < 0 && solo_connect(ring)) return -1;
+    solo.window = calloc(1, echo_window_size(sock->settings->window));
+    if (!solo.window) {
+        perror("echo window");
+        return -1;
+    }
+    solo.window->verbose = 1;
+    solo.window->stats = &client_stats;
+    solo.window->rto = &sock->rto;
+    echo_init(solo.window, sock->settings->window);
+    echo_session(solo.window);
+    solo_run(ring);
+    return 0;
+}
+
+static void solo_close(ring_p ring)
+{
+    echo_stats_print(&client_stats);
+    rto_print(&ring->socket->rto);
+    Timer.cancel(ring, &solo.echo_timer);
+    session_end_ms = now_ms();
+    free(solo.window);
+    solo.window = NULL;
+    if (reconnect) solo_disconnect(ring);
+}
+
+/* network_task: the echo client runs while the button is held */
+static void solo_network(void *arg)
+{
+    ring_p ring = arg;
+    int active = device_active(ring);
+
+    Notifier.drain(&ring->socket->notify);
+    if (active && !solo.window)
+        solo_open(ring);
+    else if (!active && solo.window)
+        solo_close(ring);
+}
+
+static void solo_battery(void *arg)
+{
+    ring_p ring = arg;
+
+    Notifier.drain(&ring->battery.notify);
+    battery_event(ring);
+}
+
+static void solo_led(void *arg)
+{
+    ring_p ring = arg;
+
+    Notifier.drain(&ring->led.notify);
+    led_event(ring);
+}
+
+/* event_task */
+static void solo_script(void *arg)
+{
+    ring_p ring = arg;
+
+    Timer.schedule(ring, &solo.script_timer, event_step(ring), 0);
+}
+
+/*
+ * The echo server of -v, on the virtual clock. A write is echoed after
+ * 1-3ms, with the faults of ring-udp-echo's classic preset (reply 3 of
+ * every 20 delayed 600ms, reply 6 corrupted) and 1% loss, all drawn from
+ * the seeded Clock.random. A timer moves the due echoes to the inbox and
+ * hands them to solo_readable(), which reads them through this backend.
+ */
+#define PEER_QUEUE 1024
+
+static struct {
+    struct timer timer;
+    uint32_t replies;
+    int queued, ready;
+    struct {
+        int64_t due_ms;
+        uint16_t value;
+    } queue[PEER_QUEUE]; /* in flight, by due time */
+    uint16_t inbox[PEER_QUEUE];
+} peer;
+
+static void peer_deliver(void *arg)
+{
+    ring_p ring = arg;
+    int64_t now = now_ms();
+    int due = 0;
+
+    while (due < peer.queued && peer.queue[due].due_ms <= now) {
+        if (solo.window && peer.ready < PEER_QUEUE)
+            peer.inbox[peer.ready++] = peer.queue[due].value;
+        due++;
+    }
+    peer.queued -= due;
+    memmove(peer.queue, peer.queue + due, peer.queued * sizeof(peer.queue[0]));
+    if (peer.queued)
+        Timer.schedule(ring, &peer.timer, peer.queue[0].due_ms - now, 0);
+    if (peer.ready) solo_readable(ring);
+}
+
+static ssize_t peer_write(socket_p socket, int fd, void *data, size_t len,
+                          struct sockaddr *addr)
+{
+    uint32_t n = peer.replies++;
+    int64_t due = now_ms() + 1 + Clock.random() % 3;
+    uint16_t value;
+    int i;
+
+    if (len != 2) return -1;
+    Stats.add(STAT_PACKETS_WRITTEN, 1);
+    if (Clock.random() % 100 == 0 || peer.queued == PEER_QUEUE)
+        return len; /* lost */
+    memcpy(&value, data, 2);
+    if (n % 20 == 3) due += 600;
+    if (n % 20 == 6) ((uint8_t *)&value)[0] += 1;
+    /* keep the queue in due order, FIFO among equals */
+    for (i = peer.queued; i > 0 && peer.queue[i - 1].due_ms > due; i--)
+        peer.queue[i] = peer.queue[i - 1];
+    peer.queue[i].due_ms = due;
+    peer.queue[i].value = value;
+    if (!peer.queued++ || i == 0)
+        Timer.schedule(socket->ring, &peer.timer, due - now_ms(), 0);
+    return len;
+}
+
+static ssize_t peer_read(socket_p socket, int fd, void *buffer, size_t len,
+                         struct sockaddr *addr)
+{
+    if (!peer.ready || len < 2) return 0;
+    memcpy(buffer, peer.inbox, 2);
+    memmove(peer.inbox, peer.inbox + 1, --peer.ready * sizeof(uint16_t));
+    Stats.add(STAT_PACKETS_READ, 1);
+    return 2;
+}
+
+static int peer_open(socket_p socket)
+{
+    return 0;
+}
+
+static int peer_add(socket_p socket, int fd, int datagrams)
+{
+    return 0;
+}
+
+static int peer_wait(socket_p socket, int *fds, int max, int timeout_ms)
+{
+    return 0;
+}
+
+static int peer_batch(socket_p socket, int fd, struct iovec *iov,
+                      struct sockaddr_storage *addrs, int vlen)
+{
+    return -1;
+}
+
+static void peer_close(socket_p socket)
+{
+}
+
+static const struct socket_backend PeerBackend = {
+    .name = "virtual echo peer",
+    .open = peer_open,
+    .add = peer_add,
+    .wait = peer_wait,
+    .read = peer_read,
+    .write = peer_write,
+    .read_batch = peer_batch,
+    .write_batch = peer_batch,
+    .close = peer_close,
+};
+
+static int run_reactor(socket_p socket)
+{
+    ring_p ring = Thread.create(0, NULL);
+
+    if (!ring || Reactor.open(ring)) {
+        perror("reactor");
+        return 1;
+    }
+    socket->ring = ring;
+    ring->socket = socket;
+    printf("memory: ring %zu bytes, socket %zu bytes reserved up front\n",
+           Arena.reserved(ring->arena), Arena.reserved(socket->arena));
+    Timer.init(&battery_timer, battery_tick, ring);
+    Timer.init(&solo.echo_timer, solo_tick, ring);
+    Timer.init(&solo.script_timer, solo_script, ring);
+    Timer.init(&peer.timer, peer_deliver, ring);
+    leds_init(ring);
+    if (Reactor.add(ring, &solo.battery, ring->battery.notify.fd,
+                    solo_battery, ring) ||
+        Reactor.add(ring, &solo.led, ring->led.notify.fd, solo_led, ring) ||
+        Reactor.add(ring, &solo.network, socket->notify.fd, solo_network,
+                    ring)) {
+        perror("reactor handlers");
+        return 1;
+    }
+    Timer.schedule(ring, &solo.script_timer, 0, 0);
+    Reactor.run(ring);
+    if (solo.window) solo_close(ring);
+    if (solo.fd >= 0) solo_disconnect(ring);
+    echo_stats_print(&client_stats);
+    led_jitter_print();
+    /* the busy/idle times are wall time, they would differ run to run */
+    if (!Clock.is_virtual()) stats_print();
+    printf("Bye\n");
+    Thread.wait(ring);
+    return 0;
+}
+
+/*
+ * Resolver checks: `localhost` from /etc/hosts through the cache, then a
+ * stub resolver that fails a host until it is told to answer, to see the
+ * negative entry served without blocking and refreshed after its TTL.
+ */
+#define CHECK_NEGATIVE_MS 200
+
+static struct {
+    int answer; /* the stub host resolves */
+    int queries;
+} stub;
+
+static int stub_query(const char *host, int port,
+                      struct sockaddr_storage *addr)
+{
+    struct sockaddr_in *in = (struct sockaddr_in *)addr;
+
+    __atomic_add_fetch(&stub.queries, 1, __ATOMIC_RELAXED);
+    if (strcmp(host, "stub.ring.test") ||
+        !__atomic_load_n(&stub.answer, __ATOMIC_RELAXED))
+        return -1;
+    in->sin_family = AF_INET;
+    in->sin_port = htons(port);
+    in->sin_addr.s_addr = htonl(0x7f000002);
+    return 0;
+}
+
+static int check(int ok, const char *what)
+{
+    printf("%s: %s\n", ok ? "ok" : "FAILED", what);
+    return !ok;
+}
+
+/* a lookup that does not wait, and how long it took in ms */
+static int stub_lookup(struct sockaddr_storage *addr, int64_t *took_ms)
+{
+    int64_t start = Clock.now_ms();
+    int ret = Resolver.lookup("stub.ring.test", 13469, addr, 0);
+
+    *took_ms = Clock.now_ms() - start;
+    return ret;
+}
+
+/* poll the cache until the stub host resolves, or give up after 1s */
+static int stub_wait(struct sockaddr_storage *addr)
+{
+    int64_t took;
+
+    for (int i = 0; i < 100; i++) {
+        if (!stub_lookup(addr, &took)) return 0;
+        Clock.sleep_ms(10);
+    }
+    return -1;
+}
+
+static int resolver_check(void)
+{
+    struct sockaddr_storage addr;
+    struct sockaddr_in *in = (struct sockaddr_in *)&addr;
+    int64_t took;
+    int failed = 0, ret;
+
+    memset(&addr, 0, sizeof(addr));
+    ret = Resolver.lookup("localhost", 13469, &addr, 2000);
+    failed += check(!ret && (addr.ss_family == AF_INET ||
+                             addr.ss_family == AF_INET6),
+                    "localhost resolves");
+    failed += check(!ret && ntohs(in->sin_port) == 13469,
+                    "localhost has the port asked for");
+    memset(&addr, 0, sizeof(addr));
+    failed += check(!Resolver.lookup("localhost", 13469, &addr, 0) &&
+                    addr.ss_family, "localhost is answered from the cache");
+
+    Resolver.stub(stub_query);
+    Resolver.ttl(CHECK_NEGATIVE_MS, CHECK_NEGATIVE_MS);
+    failed += check(Resolver.lookup("stub.ring.test", 13469, &addr, 1000)
+                    && stub.queries == 1, "a failure is reported");
+    failed += check(stub_lookup(&addr, &took) && stub.queries == 1,
+                    "the failure is cached");
+
+    /* the host comes up, the negative entry has to expire first */
+    __atomic_store_n(&stub.answer, 1, __ATOMIC_RELAXED);
+    Clock.sleep_ms(CHECK_NEGATIVE_MS + 50);
+    failed += check(stub_lookup(&addr, &took) && took < 50,
+                    "an expired failure is served without waiting");
+    failed += check(!stub_wait(&addr) && stub.queries == 2 &&
+                    ntohl(in->sin_addr.s_addr) == 0x7f000002,
+                    "the failure is refreshed after its TTL");
+
+    /* the host goes down: the stale address is kept */
+    __atomic_store_n(&stub.answer, 0, __ATOMIC_RELAXED);
+    Clock.sleep_ms(CHECK_NEGATIVE_MS + 50);
+    memset(&addr, 0, sizeof(addr));
+    failed += check(!stub_lookup(&addr, &took) && took < 50 &&
+                    ntohl(in->sin_addr.s_addr) == 0x7f000002,
+                    "an expired address is served without waiting");
+    Clock.sleep_ms(50);
+    failed += check(stub.queries == 3 && !stub_lookup(&addr, &took),
+                    "a failed refresh keeps the address");
+    Resolver.stub(NULL);
+    return failed ? 1 : 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-C] [-f] [-c] [-j] [-r] [-R prio] [-v seed]"
+            " [-u] [-H host]"
+            " [-w window]"
+            " [-T trace] [-s devices [-t threads] [-d seconds]]\n"
+            "  -C  check the Resolver cache and exit\n"
+            "  -f  fixed 500ms echo timeout (default adaptive)\n"
+            "  -c  a new socket for every press (default one kept connected)\n"
+            "  -j  print the stats dump as JSON\n"
+            "  -r  run the device on one reactor thread (default a thread"
+            " per task)\n"
+            "  -R  run the network, LED, timer and PWM tasks SCHED_FIFO at"
+            " `prio`\n"
+            "      on CPU 0 with locked memory\n"
+            "  -v  run -r on a virtual clock against an in-process echo peer,"
+            " the same\n"
+            "      `seed` gives the same run, as fast as the CPU allows\n"
+            "  -u  use the io_uring backend for the client (default epoll,"
+            " not with -r)\n"
+            "  -H  the echo server's host (default test.ring.com, the local"
+            " host\n"
+            "      if it does not resolve)\n"
+            "  -w  echo counters in flight (default 1, stop-and-wait)\n"
+            "  -T  record the events to the `trace` file instead of printing"
+            " them,\n"
+            "      see ring-trace\n"
+            "  -s  simulate `devices` doorbells against the echo server"
+            " (not with -v)\n"
+            "  -t  event loop threads of the simulation (default 1)\n"
+            "  -d  duration of the simulation (default 10s)\n",
+            prog);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt, window = 1, devices = 0, threads = 1, seconds = 10;
+    const struct socket_backend *backend = &EpollBackend;
+    struct thread_attr realtime = { .cpus = 1, .policy = SCHED_FIFO,
+                                    .lock_memory = 1 };
+
+    while ((opt = getopt(argc, argv, "CfcjrR:v:uH:w:T:s:t:d:h")) != -1) {
+        switch (opt) {
+        case 'C':
+            return resolver_check();
+        case 'f':
+            fixed_timeout = 1;
+            break;
+        case 'c':
+            reconnect = 1;
+            break;
+        case 'u':
+            backend = &UringBackend;
+            break;
+        case 'j':
+            stats_json = 1;
+            break;
+        case 'r':
+            reactor_mode = 1;
+            break;
+        case 'R':
+            realtime.priority = atoi(optarg);
+            break;
+        case 'v':
+            Clock.virtualize(strtoull(optarg, NULL, 0));
+            reactor_mode = 1;
+            break;
+        case 'H':
+            host = optarg;
+            break;
+        case 'w':
+            window = atoi(optarg);
+            break;
+        case 'T':
+            if (Trace.open(optarg, 0)) return 1;
+            /* whichever way main() returns */
+            atexit(Trace.close);
+            break;
+        case 's':
+            devices = atoi(optarg);
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'd':
+            seconds = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    /* the simulation runs real sockets, its timers need the real clock */
+    if (devices > 0 && Clock.is_virtual()) {
+        fprintf(stderr, "%s: -v does not go with -s\n", argv[0]);
+        return 1;
+    }
+    /* resolve in the background, the first press finds the address warm */
+    if (!Clock.is_virtual())
+        Resolver.prefetch(host, 13469);
+    if (devices > 0) {
+        if (threads < 1) threads = 1;
+        if (threads > devices) threads = devices;
+        if (seconds < 1) seconds = 1;
+        return simulate(devices, threads, seconds, window);
+    }
+
+	socket_p socket = 
+	Socket.init((struct SocketSettings) {
+	            .port = 13469,
+	            .host = host,
+	            .on_open = on_open,
+	            .on_data = on_data,
+	            .on_close = on_close,
+	            .timeout_ms = 500,
+	            .fixed_timeout = fixed_timeout,
+	            .reconnect = reconnect,
+	            .window = window,
+	            .backend = Clock.is_virtual() ? &PeerBackend :
+	                       reactor_mode ? &EpollBackend : backend,
+	            }, BUF_SIZE);
+	        
+    if (reactor_mode)
+        return run_reactor(socket);
+    void * (*worker_thread_func[])(void *arg) = { 
+        network_task, battery_task, led_task, event_task, Timer.task,
+        Pwm.task} ;
+    /* the timing critical ones, when asked for */
+    const struct thread_attr *attrs[] = {
+        &realtime, NULL, &realtime, NULL, &realtime, &realtime };
+    ring_p ring = Thread.create_attr(sizeof(worker_thread_func)/ sizeof(void *),
+                  worker_thread_func, realtime.priority ? attrs : NULL);
+    if (!ring) return 1;
+    socket->ring = ring;
+    printf("memory: ring %zu bytes, socket %zu bytes reserved up front\n",
+           Arena.reserved(ring->arena), Arena.reserved(socket->arena));
+    __atomic_store_n(&ring->socket, socket, __ATOMIC_RELEASE);
+    
+    {
+        Stats.name("main");
+        while(Thread.running(ring) && Notifier.wait(&ring->notify) >= 0);
+        echo_stats_print(&client_stats);
+        led_jitter_print();
+        stats_print();
+        printf("Bye\n");
+    }
+    return 0;
+}
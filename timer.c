@@ -0,0 +1,336 @@
+#include <sys/timerfd.h>
+#include <time.h>
+#include "ring.h"
+
+/*
+ * Hierarchical timer wheel
+ *
+ * Time is counted in ticks of 1 ms since the wheel was opened. Level 0
+ * holds the timers due in the next 64 ticks, one slot per tick, and every
+ * further level is 64 times coarser. When a lower level wraps around, the
+ * matching slot of the level above is cascaded down. A single timerfd is
+ * armed for the next tick that has work to do (an expiry or a cascade),
+ * so an idle wheel does not wake anybody up. Time comes from the Clock;
+ * on the virtual clock the timerfd is left alone and the owner advances
+ * the clock to `Timer.next` instead.
+ */
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 4
+#define WHEEL_NEVER UINT64_MAX
+#define WHEEL_KICKED (UINT64_MAX - 1)
+
+#define LEVEL_SHIFT(level) ((level) * WHEEL_BITS)
+
+struct timer_wheel {
+    pthread_mutex_t lock;
+    int fd; /* timerfd */
+    int64_t base; /* Clock ns of tick 0 */
+    uint64_t now; /* next tick to process */
+    uint64_t armed; /* tick the timerfd is armed for */
+    struct timer *expired; /* due timers, fired one by one */
+    struct timer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+static uint64_t wheel_ticks(struct timer_wheel *w)
+{
+    return (Clock.now_ns() - w->base) / 1000000;
+}
+
+static void timer_link(struct timer **head, struct timer *t)
+{
+    t->next = *head;
+    if (t->next) t->next->pprev = &t->next;
+    t->pprev = head;
+    *head = t;
+}
+
+static void timer_unlink(struct timer *t)
+{
+    if (!t->pprev) return;
+    *t->pprev = t->next;
+    if (t->next) t->next->pprev = t->pprev;
+    t->next = NULL;
+    t->pprev = NULL;
+}
+
+static void wheel_insert(struct timer_wheel *w, struct timer *t)
+{
+    uint64_t delta;
+    int level;
+
+    if (t->expires < w->now) t->expires = w->now;
+    delta = t->expires - w->now;
+    for (level = 0; level < WHEEL_LEVELS; level++) {
+        if (delta < 1ULL << LEVEL_SHIFT(level + 1)) {
+            timer_link(&w->slots[level][(t->expires >> LEVEL_SHIFT(level))
+                                        & WHEEL_MASK], t);
+            return;
+        }
+    }
+    /* beyond the wheel: park in the farthest top slot, cascade again */
+    level = WHEEL_LEVELS - 1;
+    timer_link(&w->slots[level][((w->now >> LEVEL_SHIFT(level)) + WHEEL_MASK)
+                                & WHEEL_MASK], t);
+}
+
+/* the first tick >= now that expires timers or cascades a slot */
+static uint64_t wheel_next(struct timer_wheel *w)
+{
+    uint64_t next = WHEEL_NEVER;
+
+    for (int i = 0; i < WHEEL_SLOTS; i++) {
+        if (w->slots[0][(w->now + i) & WHEEL_MASK]) {
+            next = w->now + i;
+            break;
+        }
+    }
+    for (int level = 1; level < WHEEL_LEVELS; level++) {
+        int shift = LEVEL_SHIFT(level);
+        uint64_t start = (w->now + (1ULL << shift) - 1) >> shift;
+        for (int idx = 0; idx < WHEEL_SLOTS; idx++) {
+            uint64_t tick;
+            if (!w->slots[level][idx]) continue;
+            tick = (start + ((idx - start) & WHEEL_MASK)) << shift;
+            if (tick < next) next = tick;
+        }
+    }
+    return next;
+}
+
+/* process every tick with work up to and including `target` */
+static void wheel_advance(struct timer_wheel *w, uint64_t target)
+{
+    uint64_t tick;
+
+    while ((tick = wheel_next(w)) <= target) {
+        /* cascade the coarse levels first, their timers may land
+         * in the slots cascaded right after them */
+        for (int level = WHEEL_LEVELS - 1; level > 0; level--) {
+            int shift = LEVEL_SHIFT(level);
+            struct timer *t, **slot;
+            if (tick & ((1ULL << shift) - 1)) continue;
+            slot = &w->slots[level][(tick >> shift) & WHEEL_MASK];
+            w->now = tick;
+            while ((t = *slot)) {
+                timer_unlink(t);
+                wheel_insert(w, t);
+            }
+        }
+        {
+            struct timer *t, **slot = &w->slots[0][tick & WHEEL_MASK];
+            while ((t = *slot)) {
+                timer_unlink(t);
+                timer_link(&w->expired, t);
+            }
+        }
+        w->now = tick + 1;
+    }
+    if (w->now <= target) w->now = target + 1;
+}
+
+/* arm the timerfd for the next tick with work, or disarm it */
+static void wheel_arm(struct timer_wheel *w)
+{
+    uint64_t next = w->expired ? w->now : wheel_next(w);
+    struct itimerspec its = { 0 };
+
+    if (next == w->armed) return;
+    w->armed = next;
+    if (Clock.is_virtual()) return;
+    if (next != WHEEL_NEVER) {
+        int64_t at = w->base + (int64_t)next * 1000000;
+        its.it_value.tv_sec = at / 1000000000;
+        its.it_value.tv_nsec = at % 1000000000;
+        if (!its.it_value.tv_sec && !its.it_value.tv_nsec)
+            its.it_value.tv_nsec = 1;
+    }
+    if (timerfd_settime(w->fd, TFD_TIMER_ABSTIME, &its, NULL))
+        perror("timerfd_settime");
+}
+
+static void timer_init(timer_p timer, void (*func)(void *), void *arg)
+{
+    memset(timer, 0, sizeof(*timer));
+    timer->func = func;
+    timer->arg = arg;
+}
+
+static int timer_schedule(ring_p ring, timer_p timer, unsigned delay_ms,
+                          unsigned period_ms)
+{
+    struct timer_wheel *w = ring->timers;
+
+    if (!w || !timer->func) return -1;
+    pthread_mutex_lock(&w->lock);
+    timer_unlink(timer);
+    timer->period = period_ms;
+    timer->expires = wheel_ticks(w) + delay_ms;
+    wheel_insert(w, timer);
+    wheel_arm(w);
+    pthread_mutex_unlock(&w->lock);
+    return 0;
+}
+
+static int timer_rearm(ring_p ring, timer_p timer, unsigned delay_ms)
+{
+    return timer_schedule(ring, timer, delay_ms, timer->period);
+}
+
+static int timer_cancel(ring_p ring, timer_p timer)
+{
+    struct timer_wheel *w = ring->timers;
+    int pending;
+
+    if (!w) return 0;
+    pthread_mutex_lock(&w->lock);
+    pending = timer->pprev != NULL;
+    timer_unlink(timer);
+    wheel_arm(w);
+    pthread_mutex_unlock(&w->lock);
+    return pending;
+}
+
+static int timer_pending(ring_p ring, timer_p timer)
+{
+    struct timer_wheel *w = ring->timers;
+    int pending;
+
+    if (!w) return 0;
+    pthread_mutex_lock(&w->lock);
+    pending = timer->pprev != NULL;
+    pthread_mutex_unlock(&w->lock);
+    return pending;
+}
+
+static int timer_dispatch(ring_p ring)
+{
+    struct timer_wheel *w = ring->timers;
+    struct timer *t;
+    int fired = 0;
+
+    if (!w) return 0;
+    pthread_mutex_lock(&w->lock);
+    wheel_advance(w, wheel_ticks(w));
+    while ((t = w->expired)) {
+        void (*func)(void *) = t->func;
+        void *arg = t->arg;
+
+        timer_unlink(t);
+        /* re-insert periodic timers before the callback runs, so that
+         * it may cancel or re-arm its own timer */
+        if (t->period) {
+            t->expires += t->period;
+            wheel_insert(w, t);
+        }
+        pthread_mutex_unlock(&w->lock);
+        func(arg);
+        fired++;
+        Stats.add(STAT_TIMERS_FIRED, 1);
+        pthread_mutex_lock(&w->lock);
+    }
+    w->armed = WHEEL_KICKED; /* the timerfd expired, arm it again */
+    wheel_arm(w);
+    pthread_mutex_unlock(&w->lock);
+    return fired;
+}
+
+static int timer_fd(ring_p ring)
+{
+    return ring->timers ? ring->timers->fd : -1;
+}
+
+static int64_t timer_next(ring_p ring)
+{
+    struct timer_wheel *w = ring->timers;
+    uint64_t next;
+
+    if (!w) return -1;
+    pthread_mutex_lock(&w->lock);
+    next = w->expired ? w->now : wheel_next(w);
+    pthread_mutex_unlock(&w->lock);
+    return next == WHEEL_NEVER ? -1 : w->base + (int64_t)next * 1000000;
+}
+
+/* expire the timerfd right away, so that the timer thread wakes up */
+static void timer_wake(ring_p ring)
+{
+    struct timer_wheel *w = ring->timers;
+    struct itimerspec its = { .it_value.tv_nsec = 1 };
+
+    if (!w) return;
+    pthread_mutex_lock(&w->lock);
+    w->armed = WHEEL_KICKED;
+    if (timerfd_settime(w->fd, 0, &its, NULL))
+        perror("timerfd_settime");
+    pthread_mutex_unlock(&w->lock);
+}
+
+static void *timer_task(void *arg)
+{
+    ring_p ring = arg;
+    uint64_t expirations;
+
+    Stats.name("timer_task");
+    while (Thread.running(ring)) {
+        ssize_t s;
+
+        Stats.idle_begin();
+        s = read(timer_fd(ring), &expirations, sizeof(expirations));
+        Stats.idle_end();
+        if (s < 0 && errno != EINTR && errno != EAGAIN) {
+            perror("timerfd read");
+            break;
+        }
+        timer_dispatch(ring);
+    }
+    return NULL;
+}
+
+static int timer_open(ring_p ring)
+{
+    /* the wheel lives as long as the ring, in the ring arena */
+    struct timer_wheel *w = Arena.alloc(ring->arena, sizeof(*w));
+
+    if (!w) return -1;
+    w->fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (w->fd < 0) {
+        perror("timerfd_create");
+        return -1;
+    }
+    if (pthread_mutex_init(&w->lock, NULL)) {
+        close(w->fd);
+        return -1;
+    }
+    w->base = Clock.now_ns();
+    w->armed = WHEEL_NEVER;
+    ring->timers = w;
+    return 0;
+}
+
+static void timer_close(ring_p ring)
+{
+    struct timer_wheel *w = ring->timers;
+
+    if (!w) return;
+    ring->timers = NULL;
+    close(w->fd);
+    pthread_mutex_destroy(&w->lock);
+}
+
+/* Timer API gateway */
+const struct __TIMER_API__ Timer = {
+    .open = timer_open,
+    .close = timer_close,
+    .init = timer_init,
+    .schedule = timer_schedule,
+    .rearm = timer_rearm,
+    .cancel = timer_cancel,
+    .pending = timer_pending,
+    .dispatch = timer_dispatch,
+    .fd = timer_fd,
+    .next = timer_next,
+    .wake = timer_wake,
+    .task = timer_task,
+};
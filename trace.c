@@ -0,0 +1,378 @@
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "ring.h"
+
+/*
+ * Event tracer
+ *
+ * Every thread gets a single producer, single consumer ring of events
+ * on its first event, like a Stats slot: recording is a Clock read, the
+ * stores of one event and a store of the head, on lines only that
+ * thread writes. A flusher thread drains the rings every TRACE_FLUSH_MS
+ * into a MAP_SHARED file behind a small header whose count it bumps
+ * after each drain, so the file is readable up to the last flush even
+ * if the process dies. With every ring empty the flusher parks on a
+ * notifier instead of polling, and the next event wakes it. The head
+ * store and the load of the parked flag may pass each other (making
+ * them sequentially consistent costs every event a locked instruction),
+ * a wakeup missed that way waits out TRACE_PARK_MS. The rings are
+ * drained one after another; `decode` puts the events back in time
+ * order. Rings are never released, an event racing with `close` may be
+ * lost.
+ */
+#define TRACE_THREADS 64 /* threads that may record */
+#define TRACE_RING 4096 /* events per thread, a power of two */
+#define TRACE_FLUSH_MS 10
+#define TRACE_PARK_MS 1000 /* a parked flusher looks again after that */
+#define TRACE_FILE_BYTES (64 << 20)
+#define TRACE_MAGIC "RINGTRC1"
+
+struct trace_header {
+    char magic[8];
+    uint64_t count; /* events written after the header */
+    uint64_t dropped;
+};
+
+struct trace_ring {
+    /* written by the recording thread */
+    uint64_t head __attribute__((aligned(64)));
+    uint64_t tail_seen; /* its copy of `tail`, read again when full */
+    uint64_t dropped;
+    int index;
+    /* written by the flusher */
+    uint64_t tail __attribute__((aligned(64)));
+    struct trace_event events[TRACE_RING];
+};
+
+enum trace_args { ARGS_NONE, ARGS_A, ARGS_AB, ARGS_SECONDS };
+
+static const struct {
+    const char *name;
+    const char *format;
+    enum trace_args args;
+} trace_formats[TRACE_IDS] = {
+    [TRACE_ECHO] = {"echo", "%d ", ARGS_A},
+    [TRACE_ECHO_TIMEOUT] = {"echo_timeout",
+                            "\n%dms timeout to re-send %u\n", ARGS_AB},
+    [TRACE_ECHO_MISMATCH] = {"echo_mismatch",
+                             "\ncompare failed, re-send value\n"},
+    [TRACE_ECHO_OVERFLOW] = {"echo_overflow", "\ncounter overflow\n"},
+    [TRACE_SOCKET_OPEN] = {"socket_open", "Open Socket\n"},
+    [TRACE_SOCKET_CLOSE] = {"socket_close", "Close Socket\n"},
+    [TRACE_BUTTON_PUSH] = {"button_push", "\nPush button\n"},
+    [TRACE_BUTTON_RELEASE] = {"button_release", "\nRelease button\n"},
+    [TRACE_CHARGING_ON] = {"charging_on", "charging on\n"},
+    [TRACE_CHARGING_OFF] = {"charging_off", "charging off\n"},
+    [TRACE_BATTERY] = {"battery", "Battery voltage:%dmV\n", ARGS_A},
+    [TRACE_LOW_BATTERY] = {"low_battery", "Low battery, power off device\n"},
+    [TRACE_WHITE_LED_ON] = {"white_led_on", "White LED illuminated\n"},
+    [TRACE_WHITE_LED_OFF] = {"white_led_off", "White LED didn't illuminate\n"},
+    [TRACE_RED_LED_BLINK] = {"red_led_blink", "Red LED is blinking.\n"
+                             "GPIO for red LED is in a cycle of %.3fs high"
+                             " and %.3fs low.\n", ARGS_SECONDS},
+    [TRACE_RED_LED_STOP] = {"red_led_stop", "Red LED stops blinking\n"},
+};
+
+static struct {
+    int on;
+    int stop;
+    int parked; /* the flusher waits on `notify` for the next event */
+    struct notifier notify;
+    int fd;
+    size_t size;
+    struct trace_header *header; /* the mapping, the events follow it */
+    uint64_t capacity; /* events the file holds */
+    uint64_t lost; /* events that found the file full */
+    pthread_t flusher;
+    struct trace_ring *rings[TRACE_THREADS];
+    int used; /* rings handed out */
+} trace = { .fd = -1 };
+static __thread struct trace_ring *local;
+static __thread int local_failed;
+
+static void trace_print(FILE *out, const struct trace_event *e)
+{
+    const char *format = e->id < TRACE_IDS ? trace_formats[e->id].format
+                                           : NULL;
+
+    if (!format) return;
+    switch (trace_formats[e->id].args) {
+    case ARGS_NONE:
+        fputs(format, out);
+        break;
+    case ARGS_A:
+        fprintf(out, format, e->a);
+        break;
+    case ARGS_AB:
+        fprintf(out, format, e->a, (unsigned)e->b);
+        break;
+    case ARGS_SECONDS:
+        fprintf(out, format, e->a / 1000.0, e->b / 1000.0);
+        break;
+    }
+}
+
+static struct trace_ring *trace_ring(void)
+{
+    struct trace_ring *r;
+    int i;
+
+    if (local || local_failed) return local;
+    i = __atomic_fetch_add(&trace.used, 1, __ATOMIC_RELAXED);
+    if (i >= TRACE_THREADS || posix_memalign((void **)&r, 64, sizeof(*r))) {
+        local_failed = 1;
+        return NULL;
+    }
+    memset(r, 0, sizeof(*r));
+    r->index = i;
+    __atomic_store_n(&trace.rings[i], r, __ATOMIC_RELEASE);
+    return local = r;
+}
+
+static void trace_event(enum trace_id id, int32_t a, int64_t b)
+{
+    struct trace_ring *r;
+    struct trace_event *e;
+    uint64_t head;
+
+    if (!__atomic_load_n(&trace.on, __ATOMIC_ACQUIRE)) {
+        struct trace_event now = {.id = id, .a = a, .b = b};
+        trace_print(stdout, &now);
+        fflush(stdout);
+        return;
+    }
+    if (!(r = trace_ring())) {
+        Stats.add(STAT_TRACE_DROPPED, 1);
+        return;
+    }
+    head = r->head;
+    if (head - r->tail_seen == TRACE_RING) {
+        r->tail_seen = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        if (head - r->tail_seen == TRACE_RING) {
+            __atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+            Stats.add(STAT_TRACE_DROPPED, 1);
+            return;
+        }
+    }
+    e = r->events + (head & (TRACE_RING - 1));
+    e->ns = Clock.now_ns();
+    e->id = id;
+    e->thread = r->index;
+    e->a = a;
+    e->b = b;
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+    if (__atomic_load_n(&trace.parked, __ATOMIC_RELAXED) &&
+        __atomic_exchange_n(&trace.parked, 0, __ATOMIC_ACQ_REL))
+        Notifier.signal(&trace.notify);
+}
+
+/* move the recorded events to the file, on the flusher or in `close` */
+static void trace_drain(void)
+{
+    struct trace_event *out = (struct trace_event *)(trace.header + 1);
+    uint64_t count = trace.header->count, dropped = 0, lost = trace.lost;
+    int used = __atomic_load_n(&trace.used, __ATOMIC_RELAXED);
+
+    if (used > TRACE_THREADS) used = TRACE_THREADS;
+    for (int i = 0; i < used; i++) {
+        struct trace_ring *r = __atomic_load_n(&trace.rings[i],
+                                               __ATOMIC_ACQUIRE);
+        uint64_t tail, head;
+
+        if (!r) continue;
+        tail = r->tail;
+        head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        for (; tail != head; tail++) {
+            if (count < trace.capacity)
+                out[count++] = r->events[tail & (TRACE_RING - 1)];
+            else
+                trace.lost++;
+        }
+        __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+        dropped += __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+    }
+    if (trace.lost > lost) Stats.add(STAT_TRACE_DROPPED, trace.lost - lost);
+    trace.header->dropped = dropped + trace.lost;
+    __atomic_store_n(&trace.header->count, count, __ATOMIC_RELEASE);
+}
+
+/* return 1 if a ring holds events the flusher has not moved yet */
+static int trace_pending(void)
+{
+    int used = __atomic_load_n(&trace.used, __ATOMIC_RELAXED);
+
+    if (used > TRACE_THREADS) used = TRACE_THREADS;
+    for (int i = 0; i < used; i++) {
+        struct trace_ring *r = __atomic_load_n(&trace.rings[i],
+                                               __ATOMIC_ACQUIRE);
+        if (r && __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) != r->tail)
+            return 1;
+    }
+    return 0;
+}
+
+static void *trace_flusher(void *arg)
+{
+    struct timespec ts = { .tv_nsec = TRACE_FLUSH_MS * 1000000L };
+
+    Stats.name("trace_flusher");
+    while (!__atomic_load_n(&trace.stop, __ATOMIC_ACQUIRE)) {
+        Stats.idle_begin();
+        if (!trace_pending()) {
+            struct pollfd park = { .fd = trace.notify.fd, .events = POLLIN };
+
+            __atomic_store_n(&trace.parked, 1, __ATOMIC_SEQ_CST);
+            if (!trace_pending() && poll(&park, 1, TRACE_PARK_MS) > 0)
+                Notifier.drain(&trace.notify);
+            __atomic_store_n(&trace.parked, 0, __ATOMIC_RELAXED);
+        }
+        /* the events of a burst come together */
+        if (!__atomic_load_n(&trace.stop, __ATOMIC_ACQUIRE))
+            nanosleep(&ts, NULL);
+        Stats.idle_end();
+        trace_drain();
+    }
+    return NULL;
+}
+
+static int trace_open(const char *path, size_t max_bytes)
+{
+    size_t size = max_bytes ? max_bytes : TRACE_FILE_BYTES;
+
+    if (trace.header ||
+        size < sizeof(struct trace_header) + sizeof(struct trace_event))
+        return -1;
+    trace.fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (trace.fd < 0 || ftruncate(trace.fd, size))
+        goto fail;
+    /* a sparse file, only the pages written are backed */
+    trace.header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                        trace.fd, 0);
+    if (trace.header == MAP_FAILED) {
+        trace.header = NULL;
+        goto fail;
+    }
+    memcpy(trace.header->magic, TRACE_MAGIC, sizeof(trace.header->magic));
+    trace.size = size;
+    trace.capacity = (size - sizeof(struct trace_header)) /
+                     sizeof(struct trace_event);
+    trace.lost = 0;
+    trace.stop = 0;
+    trace.parked = 0;
+    if (Notifier.init(&trace.notify, 0)) {
+        munmap(trace.header, size);
+        trace.header = NULL;
+        goto fail;
+    }
+    if (pthread_create(&trace.flusher, NULL, trace_flusher, NULL)) {
+        Notifier.close(&trace.notify);
+        munmap(trace.header, size);
+        trace.header = NULL;
+        goto fail;
+    }
+    __atomic_store_n(&trace.on, 1, __ATOMIC_RELEASE);
+    return 0;
+fail:
+    perror(path);
+    if (trace.fd >= 0) close(trace.fd);
+    trace.fd = -1;
+    return -1;
+}
+
+static void trace_close(void)
+{
+    size_t bytes;
+
+    if (!trace.header) return;
+    /* the events from here on are printed again */
+    __atomic_store_n(&trace.on, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&trace.stop, 1, __ATOMIC_RELEASE);
+    Notifier.signal(&trace.notify);
+    pthread_join(trace.flusher, NULL);
+    Notifier.close(&trace.notify);
+    trace_drain();
+    bytes = sizeof(struct trace_header) +
+            trace.header->count * sizeof(struct trace_event);
+    munmap(trace.header, trace.size);
+    if (ftruncate(trace.fd, bytes)) perror("trace");
+    close(trace.fd);
+    trace.header = NULL;
+    trace.fd = -1;
+}
+
+/* time order, the file order (per thread order) among equal times */
+static int trace_cmp(const void *x, const void *y)
+{
+    const struct trace_event *a = *(const struct trace_event **)x;
+    const struct trace_event *b = *(const struct trace_event **)y;
+
+    if (a->ns != b->ns) return a->ns < b->ns ? -1 : 1;
+    return (a > b) - (a < b);
+}
+
+static long trace_decode(const char *path, FILE *out, int raw)
+{
+    const struct trace_header *header;
+    const struct trace_event *events, **order = NULL;
+    struct stat st;
+    uint64_t count;
+    long ret = -1;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0 || fstat(fd, &st) ||
+        (header = mmap(NULL, st.st_size ? st.st_size : 1, PROT_READ,
+                       MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        perror(path);
+        goto out;
+    }
+    if ((size_t)st.st_size < sizeof(*header)) {
+        fprintf(stderr, "%s: not a trace\n", path);
+        goto unmap;
+    }
+    if (memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic))) {
+        fprintf(stderr, "%s: not a trace\n", path);
+        goto unmap;
+    }
+    events = (const struct trace_event *)(header + 1);
+    count = header->count;
+    if (count > (st.st_size - sizeof(*header)) / sizeof(*events))
+        count = (st.st_size - sizeof(*header)) / sizeof(*events);
+    if (count && !(order = malloc(count * sizeof(*order)))) {
+        perror(path);
+        goto unmap;
+    }
+    for (uint64_t i = 0; i < count; i++) order[i] = events + i;
+    qsort(order, count, sizeof(*order), trace_cmp);
+    for (uint64_t i = 0; i < count; i++) {
+        const struct trace_event *e = order[i];
+        if (!raw) {
+            trace_print(out, e);
+            continue;
+        }
+        fprintf(out, "%12.6f t%-3u %-16s %d %lld\n",
+                (e->ns - order[0]->ns) / 1e9, e->thread,
+                e->id < TRACE_IDS ? trace_formats[e->id].name : "?",
+                e->a, (long long)e->b);
+    }
+    if (header->dropped)
+        fprintf(stderr, "%s: %llu events dropped\n", path,
+                (unsigned long long)header->dropped);
+    free(order);
+    ret = count;
+unmap:
+    munmap((void *)header, st.st_size ? st.st_size : 1);
+out:
+    if (fd >= 0) close(fd);
+    return ret;
+}
+
+/* Trace API gateway */
+const struct __TRACE_API__ Trace = {
+    .open = trace_open,
+    .event = trace_event,
+    .close = trace_close,
+    .decode = trace_decode,
+};
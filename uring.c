@@ -0,0 +1,471 @@
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "ring.h"
+
+/*
+ * io_uring socket backend
+ *
+ * The datagram socket has one multishot recvmsg armed at all times. The
+ * kernel picks a buffer from a ring of provided buffers registered with
+ * the io_uring, so a burst of datagrams completes without any syscall.
+ * Other fds (the notifier) are watched with multishot polls. Writes copy
+ * the datagram into a send slot and queue a sendmsg; the queue is only
+ * submitted by the next `wait`, together with the wait for completions,
+ * so a loop that echoes a burst costs a single io_uring_enter().
+ *
+ * Completions are reaped from the shared memory CQ: received datagrams
+ * queue up until `read` copies them out and recycles their buffer.
+ */
+#define URING_ENTRIES 256 /* submission queue */
+#define URING_CQ_ENTRIES 1024
+#define URING_BUFS 256 /* provided receive buffers, a power of 2 */
+#define URING_BUF_SIZE (sizeof(struct io_uring_recvmsg_out) + \
+                        sizeof(struct sockaddr_storage) + BUF_SIZE)
+#define URING_SENDS 256 /* writes in flight */
+#define URING_BGID 0 /* provided buffer group */
+
+enum { URING_RECV = 1, URING_POLL, URING_SEND };
+#define URING_DATA(op, index) ((uint64_t)(op) << 32 | (uint32_t)(index))
+
+struct uring_send {
+    struct msghdr msg;
+    struct iovec iov;
+    struct sockaddr_storage addr;
+    int next; /* freelist */
+    char data[BUF_SIZE];
+};
+
+struct uring {
+    int fd;
+    /* submission queue */
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned sq_entries, tail, to_submit;
+    struct io_uring_sqe *sqes;
+    /* completion queue */
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *rings;
+    size_t rings_len, sqes_len;
+    /* provided receive buffers */
+    struct io_uring_buf_ring *br;
+    size_t br_len;
+    char *bufs;
+    /* the datagram socket and its multishot recvmsg */
+    int dgram_fd, armed;
+    struct msghdr recv_msg;
+    /* datagrams received but not read yet, a FIFO of buffer ids */
+    struct { uint16_t bid; int len; } ready[URING_BUFS];
+    unsigned ready_head, ready_len;
+    /* fds watched with multishot polls */
+    struct { int fd, readable; } watch[MAX_EVENTS];
+    int watches;
+    /* send slots */
+    struct uring_send *sends;
+    int send_free;
+};
+
+static int uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_register(int fd, unsigned op, void *arg, unsigned n)
+{
+    return syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+/* submit the queued entries, wait for `min` completions (up to `timeout_ms`) */
+static int uring_enter(struct uring *u, unsigned min, int timeout_ms)
+{
+    struct __kernel_timespec ts = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_nsec = (timeout_ms % 1000) * 1000000L };
+    struct io_uring_getevents_arg arg = { .ts = (uint64_t)(uintptr_t)&ts };
+    unsigned flags = min ? IORING_ENTER_GETEVENTS : 0;
+    int ret;
+
+    if (min && timeout_ms >= 0) flags |= IORING_ENTER_EXT_ARG;
+    ret = syscall(__NR_io_uring_enter, u->fd, u->to_submit, min, flags,
+                  flags & IORING_ENTER_EXT_ARG ? (void *)&arg : NULL,
+                  sizeof(arg));
+    Stats.add(STAT_SYSCALLS, 1);
+    /* a wait that timed out may still have submitted entries */
+    u->to_submit = u->tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    if (ret < 0 && errno != EINTR && errno != ETIME && errno != EBUSY)
+        perror("io_uring_enter");
+    return ret;
+}
+
+static struct io_uring_sqe *uring_sqe(struct uring *u)
+{
+    struct io_uring_sqe *sqe;
+
+    /* the queue is full: hand it to the kernel first */
+    while (u->tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >=
+           u->sq_entries)
+        if (uring_enter(u, 0, 0) < 0 && errno != EINTR && errno != EBUSY)
+            return NULL;
+    sqe = u->sqes + (u->tail & *u->sq_mask);
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[u->tail & *u->sq_mask] = u->tail & *u->sq_mask;
+    return sqe;
+}
+
+/* publish the entry taken by the last uring_sqe() */
+static void uring_push(struct uring *u)
+{
+    __atomic_store_n(u->sq_tail, ++u->tail, __ATOMIC_RELEASE);
+    u->to_submit++;
+}
+
+static void uring_arm_recv(struct uring *u)
+{
+    struct io_uring_sqe *sqe;
+
+    if (u->armed || u->dgram_fd < 0 || !(sqe = uring_sqe(u))) return;
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = u->dgram_fd;
+    sqe->addr = (uintptr_t)&u->recv_msg;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = URING_DATA(URING_RECV, 0);
+    uring_push(u);
+    u->armed = 1;
+}
+
+static void uring_arm_poll(struct uring *u, int index)
+{
+    struct io_uring_sqe *sqe = uring_sqe(u);
+
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = u->watch[index].fd;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = URING_DATA(URING_POLL, index);
+    uring_push(u);
+}
+
+/* give buffer `bid` back to the kernel */
+static void uring_recycle(struct uring *u, uint16_t bid)
+{
+    unsigned short tail = u->br->tail;
+    struct io_uring_buf *buf = &u->br->bufs[tail & (URING_BUFS - 1)];
+
+    buf->addr = (uintptr_t)(u->bufs + bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    __atomic_store_n(&u->br->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* consume the completion queue, no syscall */
+static void uring_reap(struct uring *u)
+{
+    unsigned head = *u->cq_head;
+    unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = u->cqes + (head & *u->cq_mask);
+        unsigned index = (uint32_t)cqe->user_data;
+
+        switch (cqe->user_data >> 32) {
+        case URING_RECV:
+            if (!(cqe->flags & IORING_CQE_F_MORE)) u->armed = 0;
+            if (cqe->res >= 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+                unsigned slot = (u->ready_head + u->ready_len++) %
+                                URING_BUFS;
+                u->ready[slot].bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+                u->ready[slot].len = cqe->res;
+            } else if (cqe->res != -ENOBUFS) {
+                Stats.add(STAT_SOCKET_ERRORS, 1);
+            }
+            break;
+        case URING_POLL:
+            u->watch[index].readable = 1;
+            if (!(cqe->flags & IORING_CQE_F_MORE)) uring_arm_poll(u, index);
+            break;
+        case URING_SEND:
+            if (cqe->res < 0) Stats.add(STAT_SOCKET_ERRORS, 1);
+            u->sends[index].next = u->send_free;
+            u->send_free = index;
+            break;
+        }
+    }
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+    /* a multishot recv ends when it runs out of buffers */
+    if (u->ready_len < URING_BUFS) uring_arm_recv(u);
+}
+
+static void uring_close(socket_p socket);
+
+static int uring_open(socket_p socket)
+{
+    struct io_uring_params p = {
+        .flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN,
+        .cq_entries = URING_CQ_ENTRIES };
+    struct io_uring_buf_reg reg = { .ring_entries = URING_BUFS,
+                                    .bgid = URING_BGID };
+    struct uring *u;
+    char *sq, *cq;
+
+    if (posix_memalign((void **)&u, ARENA_ALIGN, sizeof(*u))) return -1;
+    memset(u, 0, sizeof(*u));
+    u->dgram_fd = -1;
+    u->rings = MAP_FAILED;
+    u->sqes = MAP_FAILED;
+    u->br = MAP_FAILED;
+    u->fd = uring_setup(URING_ENTRIES, &p);
+    if (u->fd < 0) goto fail;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        errno = ENOSYS;
+        goto fail;
+    }
+
+    /* the SQ and CQ rings share one mapping */
+    u->rings_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    if (p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe) >
+        u->rings_len)
+        u->rings_len = p.cq_off.cqes +
+                       p.cq_entries * sizeof(struct io_uring_cqe);
+    u->rings = mmap(NULL, u->rings_len, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->rings == MAP_FAILED || u->sqes == MAP_FAILED) goto fail;
+    sq = cq = u->rings;
+    u->sq_head = (unsigned *)(sq + p.sq_off.head);
+    u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)(sq + p.sq_off.array);
+    u->sq_entries = p.sq_entries;
+    u->tail = *u->sq_tail;
+    u->cq_head = (unsigned *)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    /* register the provided buffer ring and hand it every buffer */
+    u->br_len = URING_BUFS * sizeof(struct io_uring_buf);
+    u->br = mmap(NULL, u->br_len, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (u->br == MAP_FAILED ||
+        posix_memalign((void **)&u->bufs, ARENA_ALIGN,
+                       URING_BUFS * URING_BUF_SIZE))
+        goto fail;
+    reg.ring_addr = (uintptr_t)u->br;
+    if (uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        goto fail;
+    for (int i = 0; i < URING_BUFS; i++)
+        uring_recycle(u, i);
+    u->recv_msg.msg_namelen = sizeof(struct sockaddr_storage);
+
+    u->sends = calloc(URING_SENDS, sizeof(*u->sends));
+    if (!u->sends) goto fail;
+    for (int i = 0; i < URING_SENDS; i++)
+        u->sends[i].next = i + 1 < URING_SENDS ? i + 1 : -1;
+    socket->io = u;
+    return 0;
+fail:
+    perror("io_uring");
+    socket->io = u;
+    uring_close(socket);
+    return -1;
+}
+
+static void uring_close(socket_p socket)
+{
+    struct uring *u = socket->io;
+
+    if (!u) return;
+    if (u->fd >= 0) close(u->fd);
+    if (u->rings != MAP_FAILED) munmap(u->rings, u->rings_len);
+    if (u->sqes != MAP_FAILED) munmap(u->sqes, u->sqes_len);
+    if (u->br != MAP_FAILED) munmap(u->br, u->br_len);
+    free(u->bufs);
+    free(u->sends);
+    free(u);
+    socket->io = NULL;
+}
+
+static int uring_add(socket_p socket, int fd, int datagrams)
+{
+    struct uring *u = socket->io;
+
+    if (datagrams) {
+        if (u->dgram_fd >= 0) return -1;
+        u->dgram_fd = fd;
+        uring_arm_recv(u);
+        return 0;
+    }
+    if (u->watches == MAX_EVENTS) return -1;
+    u->watch[u->watches].fd = fd;
+    uring_arm_poll(u, u->watches++);
+    return 0;
+}
+
+static int uring_ready(struct uring *u, int *fds, int max)
+{
+    int n = 0;
+
+    if (u->ready_len && n < max) fds[n++] = u->dgram_fd;
+    for (int i = 0; i < u->watches && n < max; i++) {
+        if (!u->watch[i].readable) continue;
+        u->watch[i].readable = 0;
+        fds[n++] = u->watch[i].fd;
+    }
+    return n;
+}
+
+static int uring_wait(socket_p socket, int *fds, int max, int timeout_ms)
+{
+    struct uring *u = socket->io;
+    int n;
+
+    uring_reap(u);
+    if ((n = uring_ready(u, fds, max))) {
+        /* flush the writes, nothing to wait for */
+        if (u->to_submit) uring_enter(u, 0, 0);
+        return n;
+    }
+    if (!timeout_ms) {
+        if (u->to_submit) uring_enter(u, 0, 0);
+    } else {
+        Stats.idle_begin();
+        uring_enter(u, 1, timeout_ms);
+        Stats.idle_end();
+    }
+    uring_reap(u);
+    return uring_ready(u, fds, max);
+}
+
+static ssize_t uring_read(socket_p socket, int fd, void *buffer,
+               size_t max_len, struct sockaddr *addr)
+{
+    struct uring *u = socket->io;
+    struct io_uring_recvmsg_out *out;
+    char *payload;
+    size_t len, head;
+    uint16_t bid;
+
+    if (fd != u->dgram_fd) return -1;
+    if (!u->ready_len) uring_reap(u);
+    if (!u->ready_len) {
+        Stats.add(STAT_EAGAIN, 1);
+        return 0;
+    }
+    bid = u->ready[u->ready_head].bid;
+    len = u->ready[u->ready_head].len;
+    u->ready_head = (u->ready_head + 1) % URING_BUFS;
+    u->ready_len--;
+
+    out = (struct io_uring_recvmsg_out *)(u->bufs + bid * URING_BUF_SIZE);
+    head = sizeof(*out) + u->recv_msg.msg_namelen +
+           u->recv_msg.msg_controllen;
+    payload = (char *)out + head;
+    len = len > head ? len - head : 0;
+    if (len > out->payloadlen) len = out->payloadlen;
+    if (len > max_len) len = max_len;
+    memcpy(buffer, payload, len);
+    if (addr) {
+        socklen_t namelen = out->namelen < socket->len ? out->namelen
+                                                       : socket->len;
+        memcpy(addr, out + 1, namelen);
+        socket->len = out->namelen;
+    }
+    uring_recycle(u, bid);
+    uring_arm_recv(u);
+    Stats.add(STAT_PACKETS_READ, 1);
+    Stats.add(STAT_BYTES_READ, len);
+    return len;
+}
+
+static ssize_t uring_write(socket_p socket, int fd, void *data,
+               size_t data_len, struct sockaddr *addr)
+{
+    struct uring *u = socket->io;
+    struct io_uring_sqe *sqe;
+    struct uring_send *s;
+    int slot;
+
+    if (!fd || data_len > BUF_SIZE) return -1;
+    /* every slot is in flight: wait until the kernel is done with one */
+    while (u->send_free < 0) {
+        if (uring_enter(u, 1, -1) < 0 && errno != EINTR && errno != EBUSY)
+            return -1;
+        uring_reap(u);
+    }
+    if (!(sqe = uring_sqe(u))) return -1;
+    slot = u->send_free;
+    s = u->sends + slot;
+    u->send_free = s->next;
+
+    memcpy(s->data, data, data_len);
+    s->iov.iov_base = s->data;
+    s->iov.iov_len = data_len;
+    memset(&s->msg, 0, sizeof(s->msg));
+    s->msg.msg_iov = &s->iov;
+    s->msg.msg_iovlen = 1;
+    if (addr) {
+        memcpy(&s->addr, addr, socket->len);
+        s->msg.msg_name = &s->addr;
+        s->msg.msg_namelen = socket->len;
+    }
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)&s->msg;
+    sqe->len = 1;
+    sqe->user_data = URING_DATA(URING_SEND, slot);
+    uring_push(u);
+    Stats.add(STAT_PACKETS_WRITTEN, 1);
+    Stats.add(STAT_BYTES_WRITTEN, data_len);
+    return data_len;
+}
+
+static int uring_read_batch(socket_p socket, int fd, struct iovec *iov,
+               struct sockaddr_storage *addrs, int vlen)
+{
+    int n;
+
+    for (n = 0; n < vlen; n++) {
+        ssize_t len;
+        socket->len = sizeof(*addrs);
+        len = uring_read(socket, fd, iov[n].iov_base, iov[n].iov_len,
+                         addrs ? (struct sockaddr *)(addrs + n) : NULL);
+        if (len <= 0) break;
+        iov[n].iov_len = len;
+    }
+    return n;
+}
+
+static int uring_write_batch(socket_p socket, int fd, struct iovec *iov,
+               struct sockaddr_storage *addrs, int vlen)
+{
+    int n;
+
+    for (n = 0; n < vlen; n++) {
+        socket->len = addrs && addrs[n].ss_family == AF_INET6 ?
+                      sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+        if (uring_write(socket, fd, iov[n].iov_base, iov[n].iov_len,
+                        addrs ? (struct sockaddr *)(addrs + n) : NULL) < 0)
+            break;
+    }
+    return n ? n : -1;
+}
+
+/* io_uring backend */
+const struct socket_backend UringBackend = {
+    .name = "io_uring",
+    .open = uring_open,
+    .add = uring_add,
+    .wait = uring_wait,
+    .read = uring_read,
+    .write = uring_write,
+    .read_batch = uring_read_batch,
+    .write_batch = uring_write_batch,
+    .close = uring_close,
+};